@@ -0,0 +1,4048 @@
+/*
+ * Buddy Page Allocation Algorithm Header File
+ */
+
+/*
+ * STUDENT NUMBER: s1810150
+ */
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include <infos/mm/page-allocator.h>
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/util/math.h>
+#include <infos/util/printf.h>
+#include <infos/util/string.h>
+#include <infos/locking/spinlock.h>
+
+/*
+ * The default number of orders, and the default size of a page (as a shift).  Both can
+ * be chosen per instance, as parameters of BasicBuddyPageAllocator.
+ */
+#define MAX_ORDER 17
+#define BUDDY_PAGE_SHIFT 12
+
+/*
+ * When set, each order's free list is protected by its own lock, so callers do not
+ * need to serialise calls into the allocator, and operations on different orders
+ * proceed in parallel.  Locks are only ever acquired in ascending order, which
+ * makes the split (walking up to find a block) and merge (walking up to coalesce)
+ * paths deadlock-free.
+ */
+#define BUDDY_FINE_GRAINED_LOCKING 1
+
+/*
+ * Free memory is grouped by mobility in units of pageblocks of this order, so that
+ * long-lived unmovable allocations are kept together, instead of being scattered
+ * across every large block.
+ */
+#define BUDDY_PAGEBLOCK_ORDER 9
+
+/*
+ * The number of pageblocks whose mobility can be tracked.  At the default pageblock
+ * order this covers 128 GiB of memory.
+ */
+#define BUDDY_MAX_PAGEBLOCKS 65536
+
+/*
+ * The number of separate holes that offline_pages can leave in the memory managed.
+ * Memory taken off the top does not leave a hole.
+ */
+#define BUDDY_MAX_OFFLINE_RANGES 64
+
+/*
+ * Allocations of at least this order that fail will try to compact memory (if a
+ * page relocation callback has been registered) before giving up.
+ */
+#define BUDDY_COMPACTION_MIN_ORDER 4
+
+/*
+ * When set, freed blocks are not merged with their buddies straight away.  Workloads
+ * that free and re-allocate blocks of the same order then skip a merge and a split on
+ * every round trip.  Instead, an order is coalesced in one pass over its (address-
+ * ordered) free lists once its frees outnumber its allocations by the threshold, and
+ * every order is coalesced before an allocation falls back to another mobility class.
+ * This is the default for DefaultBuddyPolicy::LAZY_COALESCING.
+ */
+#define BUDDY_LAZY_COALESCING 0
+#define BUDDY_LAZY_COALESCE_THRESHOLD 64
+
+/*
+ * The number of pre-zeroed order-0 pages that refill_zeroed_pages keeps ready for
+ * AllocFlags::ZERO allocations.
+ */
+#define BUDDY_ZEROED_POOL_TARGET 256
+
+/*
+ * The orders of the pages held by the huge-page pools, i.e. 2 MiB and 1 GiB pages with
+ * 4 KiB base pages.  An order that is not below the allocator's MaxOrder is allocated
+ * as a contiguous range instead of a block, so it can only be found while memory is
+ * still largely unfragmented, and is best reserved early.
+ */
+#define BUDDY_HUGE_ORDER 9
+#define BUDDY_GIGANTIC_ORDER 18
+
+/*
+ * When set, each free list is indexed by a skip list, so that inserting and removing
+ * a block take logarithmic time, instead of a walk from the head of a list that can
+ * hold hundreds of thousands of blocks.  Level 0 of the skip list is the ordinary
+ * address-ordered list threaded through next_free, so code that only walks a free
+ * list is unaffected; the links for the levels above are kept in the first page of
+ * each free block, which is otherwise unused.  A block takes part in up to
+ * BUDDY_INDEX_LEVELS levels.
+ *
+ * The pages handed to init may still include pages that the kernel is about to
+ * reserve, so no links are written into free pages until allocation has started.
+ * Blocks inserted before then are only linked into level 0.
+ *
+ * This is the default for DefaultBuddyPolicy::INDEXED_FREE_LISTS.
+ */
+#define BUDDY_INDEXED_FREE_LISTS 1
+#define BUDDY_INDEX_LEVELS 24
+
+/*
+ * When set, order-0 allocations are served from per-colour lists, so that the pages
+ * a caller gets are spread evenly over the cache sets of a physically indexed cache.
+ * A page's colour is the low bits of its PFN, and there are (cache size) / (ways *
+ * page size) colours.  The lists are refilled by splitting a whole block with one
+ * page of each colour, or if memory is too fragmented for that, by sorting the
+ * loose free pages of order 0.  Each list keeps at most BUDDY_COLOUR_LIST_MAX pages.
+ */
+#define BUDDY_PAGE_COLOURING 0
+#define BUDDY_NR_COLOURS 32
+#define BUDDY_COLOUR_LIST_MAX 64
+
+// When no whole block is free, up to this many free order-0 pages are sorted instead.
+#define BUDDY_COLOUR_SCAN_LIMIT 256
+
+/*
+ * The PFNs at which the DMA zone (memory that legacy devices can address, below
+ * 16 MiB) and the normal zone (below 4 GiB) end.  Everything above is the high zone.
+ */
+#define BUDDY_ZONE_DMA_END_PFN 0x1000
+#define BUDDY_ZONE_NORMAL_END_PFN 0x100000
+
+/*
+ * An allocation that falls back to a lower zone than it asked for may not take that
+ * zone's free pages below its watermark, which is (zone size) / this ratio unless set
+ * otherwise.  The rest of the zone is kept for allocations that can only use it.
+ */
+#define BUDDY_ZONE_RESERVE_RATIO 8
+
+/*
+ * Ordinary allocations may not take free memory below the min watermark, which is
+ * (managed pages) / this ratio unless set otherwise.  The low and high watermarks are
+ * 5/4 and 3/2 of it.  Once free memory falls below low, the registered shrinkers are
+ * asked to give back enough to reach high, and an allocation that fails asks them
+ * again, up to this many times, before it gives up.
+ */
+#define BUDDY_WATERMARK_MIN_RATIO 256
+#define BUDDY_RECLAIM_RETRIES 3
+
+// The number of shrinker callbacks that can be registered with one allocator.
+#define BUDDY_MAX_SHRINKERS 16
+
+/*
+ * Compile in counters for the allocator's hot paths: per-order histograms of the
+ * cycles alloc_pages and free_pages calls take, of how many times allocations split a
+ * block and frees merged one, and of how many free-list nodes each search visits.
+ * Every counter is kept per CPU, indexed by the kernel's CPU number, so that CPUs never
+ * write to each other's cache lines; read_stats sums them.  Reading the TSC costs about
+ * as much as a whole order-0 allocation, so only one call in every
+ * BUDDY_STATS_SAMPLE_PERIOD is timed.
+ */
+#define BUDDY_INSTRUMENTATION 0
+#define BUDDY_STATS_NR_CPUS 16
+#define BUDDY_STATS_SAMPLE_PERIOD 64
+
+/*
+ * The number of buckets in each histogram.  Cycle counts are bucketed by powers of
+ * two: bucket 0 counts zeroes, and bucket b values in [2^(b-1), 2^b).  Walk lengths
+ * are bucketed exactly, and the last bucket also counts every longer walk.
+ */
+#define BUDDY_STATS_BUCKETS 24
+
+namespace buddy {
+	using namespace infos::kernel;
+	using namespace infos::locking;
+	using namespace infos::mm;
+	using namespace infos::util;
+
+	/**
+	 * The mobility classes that free memory is grouped by.
+	 */
+	namespace MigrateType {
+		enum MigrateType {
+			UNMOVABLE = 0,
+			RECLAIMABLE = 1,
+			MOVABLE = 2,
+			NR_TYPES = 3
+		};
+	}
+
+	/**
+	 * Flags that modify the behaviour of an allocation.  An allocation is unmovable
+	 * unless it says otherwise, and only single pages may be MOVABLE: compaction and
+	 * offlining move in-use memory a page at a time, as nothing records how large an
+	 * allocated block is.  An ATOMIC allocation may use the memory below the min
+	 * watermark, and never calls shrinkers, so it is safe where they cannot run.
+	 */
+	namespace AllocFlags {
+		enum AllocFlags {
+			UNMOVABLE = 0,
+			RECLAIMABLE = 1 << 0,
+			MOVABLE = 1 << 1,
+			ZERO = 1 << 2,
+			DMA = 1 << 3,
+			HIGH = 1 << 4,
+			ATOMIC = 1 << 5,
+		};
+	}
+
+	/**
+	 * The zones that physical memory is split into, in ascending address order.  An
+	 * allocation is served from the normal zone unless it says otherwise, and can
+	 * always fall back to a lower zone, but never to a higher one.
+	 */
+	namespace Zone {
+		enum Zone {
+			DMA = 0,
+			NORMAL = 1,
+			HIGH = 2,
+			NR_ZONES = 3
+		};
+	}
+
+	/**
+	 * A callback that moves an in-use page to a new location, i.e. copies its contents
+	 * and updates every reference to it.  Only order-0 allocations are movable, so the
+	 * page is always a whole allocation.  It is called with the allocator's locks held,
+	 * so it must not call back into the allocator.
+	 * @param from The page to move.
+	 * @param to The free page to move it to.
+	 * @param arg The argument given when the callback was registered.
+	 * @return Returns TRUE if the page was moved, or FALSE if it cannot be.
+	 */
+	typedef bool (*RelocatePageFn)(PageDescriptor *from, PageDescriptor *to, void *arg);
+
+	/**
+	 * A callback that frees memory held by a cache, when the allocator runs low.  It is
+	 * called without the allocator's order locks held, so it may free pages, but it
+	 * must not register or unregister shrinkers.
+	 * @param nr_pages The number of pages the allocator would like back.
+	 * @param arg The argument given when the callback was registered.
+	 * @return Returns the number of pages that were freed.
+	 */
+	typedef uint64_t (*ShrinkFn)(uint64_t nr_pages, void *arg);
+
+	/**
+	 * The policy traits that a buddy allocator is built with.  They are compile-time
+	 * constants, so the code for the settings an instance does not use is compiled out.
+	 * Free lists are always kept in address order, as contiguous ranges, lazy coalescing,
+	 * locality hints and snapshots all depend on it.
+	 */
+	struct DefaultBuddyPolicy {
+		// Index each free list with a skip list (see BUDDY_INDEXED_FREE_LISTS).
+		static const bool INDEXED_FREE_LISTS = BUDDY_INDEXED_FREE_LISTS;
+
+		// Defer merging freed blocks (see BUDDY_LAZY_COALESCING).
+		static const bool LAZY_COALESCING = BUDDY_LAZY_COALESCING;
+	};
+
+	/**
+	 * A buddy page allocation algorithm, with 2^(MaxOrder - 1) pages in its largest
+	 * block, pages of 2^PageShift bytes, and the given policy traits.
+	 */
+	template<int MaxOrder = MAX_ORDER, unsigned int PageShift = BUDDY_PAGE_SHIFT, class Policy = DefaultBuddyPolicy>
+	class BasicBuddyPageAllocator : public PageAllocatorAlgorithm
+	{
+	private:
+		// Pageblocks cannot be larger than the largest block.
+		static const int PAGEBLOCK_ORDER = BUDDY_PAGEBLOCK_ORDER < MaxOrder ? BUDDY_PAGEBLOCK_ORDER : MaxOrder - 1;
+
+		/**
+		 * Returns the size of a page, in bytes.
+		 */
+		static inline constexpr uint64_t page_size()
+		{
+			return (uint64_t) 1 << PageShift;
+		}
+
+		/**
+		 * Returns the number of pages that comprise a 'block', in a given order.
+		 * @param order The order to base the calculation off of.
+		 * @return Returns the number of pages in a block, in the order.
+		 */
+		static inline constexpr uint64_t pages_per_block(int order)
+		{
+			/* The number of pages per block in a given order is simply 1, shifted left by the order number.
+			 * For example, in order-2, there are (1 << 2) == 4 pages in each block.
+			 */
+			return ((uint64_t) 1 << order);
+		}
+
+		/**
+		 * Returns TRUE if the supplied page descriptor is correctly aligned for the
+		 * given order.  Returns FALSE otherwise.
+		 * @param pgd The page descriptor to test alignment for.
+		 * @param order The order to use for calculations.
+		 */
+		static inline bool is_correct_alignment_for_order(const PageDescriptor *pgd, int order)
+		{
+			// Calculate the page-frame-number for the page descriptor, and return TRUE if
+			// it divides evenly into the number pages in a block of the given order.
+			return (sys.mm().pgalloc().pgd_to_pfn(pgd) % pages_per_block(order)) == 0;
+		}
+
+		/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
+		 * to the left or the right of PGD, in the given order.
+		 * @param pgd The page descriptor to find the buddy for.
+		 * @param order The order in which the page descriptor lives.
+		 * @return Returns the buddy of the given page descriptor, in the given order.
+		 */
+		PageDescriptor *buddy_of(PageDescriptor *pgd, int order)
+		{
+			// (1) Make sure 'order' is within range
+			if (order >= MaxOrder) {
+				return NULL;
+			}
+
+			// (2) Check to make sure that PGD is correctly aligned in the order
+			if (!is_correct_alignment_for_order(pgd, order)) {
+				return NULL;
+			}
+
+			// (3) Calculate the page-frame-number of the buddy of this page.
+			// * If the PFN is aligned to the next order, then the buddy is the next block in THIS order.
+			// * If it's not aligned, then the buddy must be the previous block in THIS order.
+			uint64_t buddy_pfn = is_correct_alignment_for_order(pgd, order + 1) ?
+				sys.mm().pgalloc().pgd_to_pfn(pgd) + pages_per_block(order) :
+				sys.mm().pgalloc().pgd_to_pfn(pgd) - pages_per_block(order);
+
+			// (4) Return the page descriptor associated with the buddy page-frame-number.
+			return sys.mm().pgalloc().pfn_to_pgd(buddy_pfn);
+		}
+
+		/**
+		 * Returns TRUE if the given block lies entirely within the memory managed by
+		 * this allocator.
+		 * @param pgd The page descriptor of the block.
+		 * @param order The order of the block.
+		 */
+		bool is_managed_block(const PageDescriptor *pgd, int order) const
+		{
+			uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+			return pfn >= _base_pfn && pfn + pages_per_block(order) <= _base_pfn + _nr_pages;
+		}
+
+		/**
+		 * Returns the index of the pageblock that contains the given page.
+		 */
+		uint64_t pageblock_index(const PageDescriptor *pgd) const
+		{
+			return (sys.mm().pgalloc().pgd_to_pfn(pgd) >> PAGEBLOCK_ORDER) - (_base_pfn >> PAGEBLOCK_ORDER);
+		}
+
+		/**
+		 * Returns the mobility class of the pageblock that contains the given page.
+		 */
+		MigrateType::MigrateType pageblock_type(const PageDescriptor *pgd) const
+		{
+			return (MigrateType::MigrateType) _pageblock_types[pageblock_index(pgd)];
+		}
+
+		/**
+		 * Sets the mobility class of every pageblock that the given block overlaps.
+		 * This does not move any free blocks between lists.
+		 * @param pgd The page descriptor of the block.
+		 * @param order The order of the block.
+		 * @param type The new mobility class.
+		 */
+		void set_pageblock_types(const PageDescriptor *pgd, int order, MigrateType::MigrateType type)
+		{
+			uint64_t first = pageblock_index(pgd);
+			uint64_t count = order > PAGEBLOCK_ORDER ? pages_per_block(order - PAGEBLOCK_ORDER) : 1;
+
+			for (uint64_t i = first; i < first + count; i++) {
+				_pageblock_types[i] = type;
+			}
+		}
+
+		/**
+		 * Returns the number of skip-list levels that a free block takes part in.  This is
+		 * worked out from a hash of the block's PFN, so it needs no storage and no random
+		 * number generator, and each level holds half as many blocks as the one below.
+		 * @param pgd The page descriptor of the block.
+		 * @return Returns a level count between 1 and BUDDY_INDEX_LEVELS.
+		 */
+		static int index_height(const PageDescriptor *pgd)
+		{
+			uint64_t hash = sys.mm().pgalloc().pgd_to_pfn(pgd);
+			hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdULL;
+			hash = (hash ^ (hash >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+			hash ^= hash >> 33;
+
+			return 1 + __builtin_ctzll(hash | ((uint64_t) 1 << (BUDDY_INDEX_LEVELS - 1)));
+		}
+
+		/**
+		 * Returns the slot that holds the next block at the given level of a skip list,
+		 * after the given block (or after the head of the list, if the block is NULL).
+		 * Above level 0, a block's links are stored in its first page.
+		 * @param pgd The block to follow, or NULL for the head of the list.
+		 * @param type The mobility class of the list.
+		 * @param order The order of the list.
+		 * @param level The level of the skip list.
+		 */
+		PageDescriptor **index_next(PageDescriptor *pgd, int type, int order, int level)
+		{
+			if (!pgd) {
+				return level == 0 ? &_free_areas[type][order] : &_index_heads[type][order][level - 1];
+			}
+
+			return level == 0 ? &pgd->next_free : &index_links(pgd)[level - 1];
+		}
+
+		/**
+		 * Returns the links a free block holds for the levels above level 0, which are
+		 * stored at the start of its first page.
+		 */
+		static PageDescriptor **index_links(const PageDescriptor *pgd)
+		{
+			return (PageDescriptor **) sys.mm().pgalloc().pgd_to_vpa(pgd);
+		}
+
+		/**
+		 * Searches a skip list for the first block that is not below the given one, and
+		 * records the slot that points to it at every level.
+		 * @param pgd The block to search for.
+		 * @param type The mobility class of the list.
+		 * @param order The order of the list.
+		 * @param slots Receives, for each level, the slot that points to the first block
+		 * at that level that is not below pgd.
+		 */
+		void index_search(const PageDescriptor *pgd, int type, int order, PageDescriptor **slots[BUDDY_INDEX_LEVELS])
+		{
+			// The links of the node that the search has reached, starting at the head.
+			PageDescriptor *node = NULL;
+			PageDescriptor **links = _index_heads[type][order];
+			unsigned int steps = 0;
+
+			for (int level = BUDDY_INDEX_LEVELS - 1; level > 0; level--) {
+				PageDescriptor **slot = &links[level - 1];
+				while (*slot && *slot < pgd) {
+					node = *slot;
+					links = index_links(node);
+					slot = &links[level - 1];
+					steps++;
+				}
+
+				slots[level] = slot;
+			}
+
+			PageDescriptor **slot = node ? &node->next_free : &_free_areas[type][order];
+			while (*slot && *slot < pgd) {
+				slot = &(*slot)->next_free;
+				steps++;
+			}
+
+			slots[0] = slot;
+			note_walk(order, steps);
+		}
+
+		/**
+		 * Finds the slot in a free list that points to the first block that is not below
+		 * the given one.
+		 * @param pgd The block to search for.
+		 * @param type The mobility class of the list.
+		 * @param order The order of the list.
+		 * @return Returns the slot, which points to NULL if every block is below pgd.
+		 */
+		PageDescriptor **lower_bound(const PageDescriptor *pgd, int type, int order)
+		{
+			if (Policy::INDEXED_FREE_LISTS) {
+				PageDescriptor **slots[BUDDY_INDEX_LEVELS];
+				index_search(pgd, type, order, slots);
+
+				return slots[0];
+			} else {
+				// Iterate whilst there is a slot, and whilst the page descriptor pointer is numerically
+				// greater than what the slot is pointing to.
+				PageDescriptor **slot = &_free_areas[type][order];
+				unsigned int steps = 0;
+				while (*slot && pgd > *slot) {
+					slot = &(*slot)->next_free;
+					steps++;
+				}
+
+				note_walk(order, steps);
+				return slot;
+			}
+		}
+
+		/**
+		 * Inserts a block into the free list of the given order.  The block is inserted in ascending order.
+		 * @param pgd The page descriptor of the block to insert.
+		 * @param order The order in which to insert the block.
+		 * @return Returns the slot (i.e. a pointer to the pointer that points to the block) that the block
+		 * was inserted into.
+		 */
+		PageDescriptor **insert_block(PageDescriptor *pgd, int order)
+		{
+			// The block goes in the free list for its mobility class.
+			int type = pageblock_type(pgd);
+			__atomic_add_fetch(&_nr_free_blocks[order], 1, __ATOMIC_RELAXED);
+
+			if (Policy::INDEXED_FREE_LISTS) {
+				PageDescriptor **slots[BUDDY_INDEX_LEVELS];
+				index_search(pgd, type, order, slots);
+
+				// Link the block in at every level it takes part in.  A block may be linked into
+				// fewer levels than its height: removal only unlinks the levels it is in.
+				int height = __atomic_load_n(&_index_links_safe, __ATOMIC_RELAXED) ? index_height(pgd) : 1;
+				for (int level = 0; level < height; level++) {
+					*index_next(pgd, type, order, level) = *slots[level];
+					*slots[level] = pgd;
+				}
+
+				return slots[0];
+			} else {
+				// Find the slot in which the page descriptor should be inserted.
+				PageDescriptor **slot = lower_bound(pgd, type, order);
+
+				// Insert the page descriptor into the linked list.
+				pgd->next_free = *slot;
+				*slot = pgd;
+
+				// Return the insert point (i.e. slot)
+				return slot;
+			}
+		}
+
+		/**
+		 * Removes a block from the free list of the given order.  The block MUST be present in the free-list, otherwise
+		 * the system will panic.
+		 * @param pgd The page descriptor of the block to remove.
+		 * @param order The order in which to remove the block from.
+		 */
+		void remove_block(PageDescriptor *pgd, int order)
+		{
+			int type = pageblock_type(pgd);
+			__atomic_sub_fetch(&_nr_free_blocks[order], 1, __ATOMIC_RELAXED);
+
+			if (Policy::INDEXED_FREE_LISTS) {
+				// Allocations take the lowest block, which is first at every level it is in.
+				if (_free_areas[type][order] == pgd) {
+					_free_areas[type][order] = pgd->next_free;
+
+					PageDescriptor **heads = _index_heads[type][order];
+					for (int level = 1; level < BUDDY_INDEX_LEVELS && heads[level - 1] == pgd; level++) {
+						heads[level - 1] = index_links(pgd)[level - 1];
+					}
+
+					pgd->next_free = NULL;
+					return;
+				}
+
+				PageDescriptor **slots[BUDDY_INDEX_LEVELS];
+				index_search(pgd, type, order, slots);
+
+				// Make sure the block actually exists.  Panic the system if it does not.
+				assert(*slots[0] == pgd);
+
+				// Unlink the block from every level that it is linked into.
+				for (int level = 0; level < BUDDY_INDEX_LEVELS && *slots[level] == pgd; level++) {
+					*slots[level] = *index_next(pgd, type, order, level);
+				}
+			} else {
+				// Locate the block in the linked-list.
+				PageDescriptor **slot = lower_bound(pgd, type, order);
+
+				// Make sure the block actually exists.  Panic the system if it does not.
+				assert(*slot == pgd);
+
+				// Remove the block from the free list.
+				*slot = pgd->next_free;
+			}
+
+			pgd->next_free = NULL;
+		}
+
+		/**
+		 * Removes the block that a slot in a free list points to.
+		 * @param slot The slot, which must point into the free list for the block's class.
+		 * @param order The order of the free list.
+		 * @return Returns the block that was removed.
+		 */
+		PageDescriptor *unlink_block(PageDescriptor **slot, int order)
+		{
+			PageDescriptor *pgd = *slot;
+
+			if (Policy::INDEXED_FREE_LISTS) {
+				// The upper levels have to be searched anyway, and doing so updates the slot.
+				remove_block(pgd, order);
+			} else {
+				*slot = pgd->next_free;
+				pgd->next_free = NULL;
+				__atomic_sub_fetch(&_nr_free_blocks[order], 1, __ATOMIC_RELAXED);
+			}
+
+			return pgd;
+		}
+
+		/**
+		 * Given a pointer to a block of free memory in the order "source_order", this function will
+		 * split the block in half, and insert it into the order below.
+		 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
+		 * @param source_order The order in which the block of free memory exists.  Naturally,
+		 * the split will insert the two new blocks into the order below.
+		 * @return Returns the left-hand-side of the new block.
+		 */
+		PageDescriptor *split_block(PageDescriptor **block_pointer, int source_order)
+		{
+			// (1) Make sure 'order' is within range
+			if (source_order <= 0 || source_order >= MaxOrder) {
+				return NULL;
+			}
+			// Make sure there is an incoming pointer.
+			assert(*block_pointer);
+			// Make sure the block_pointer is correctly aligned.
+			assert(is_correct_alignment_for_order(*block_pointer, source_order));
+
+			// The left half starts at the same page as the block, and the right half
+			// starts half a block further on.
+			PageDescriptor *left = *block_pointer;
+			PageDescriptor *right = left + pages_per_block(source_order - 1);
+
+			// Move the block out of its order, and insert each half into the order below.
+			// Every pageblock in the block has the same mobility class, so both halves
+			// go back into the same class.
+			remove_block(left, source_order);
+			insert_block(left, source_order - 1);
+			insert_block(right, source_order - 1);
+
+			return left;
+		}
+
+		/**
+		 * Takes a block in the given source order, and merges it (and it's buddy) into the next order.
+		 * This function assumes both the source block and the buddy block are in the free list for the
+		 * source order.  If they aren't this function will panic the system.
+		 * @param block_pointer A pointer to a pointer containing a block in the pair to merge.
+		 * @param source_order The order in which the pair of blocks live.
+		 * @return Returns the new slot that points to the merged block.
+		 */
+		PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order)
+		{
+			assert(*block_pointer);
+
+			if (source_order >= MaxOrder - 1) {
+				return NULL;
+			}
+			// Make sure the area_pointer is correctly aligned.
+			assert(is_correct_alignment_for_order(*block_pointer, source_order));
+
+			// Take copies of both halves before the slot is disturbed by the removals.
+			PageDescriptor *block = *block_pointer;
+			PageDescriptor *buddy = buddy_of(block, source_order);
+			MigrateType::MigrateType type = pageblock_type(block);
+
+			remove_block(block, source_order);
+			remove_block(buddy, source_order);
+
+			// The merged block starts at whichever of the pair is lower in memory.  Once it
+			// spans whole pageblocks, they all take on the class of the block being merged.
+			PageDescriptor *merged = buddy < block ? buddy : block;
+			if (source_order + 1 >= PAGEBLOCK_ORDER) {
+				set_pageblock_types(merged, source_order + 1, type);
+			}
+
+			return insert_block(merged, source_order + 1);
+		}
+
+		/**
+		 * Returns TRUE if the given block is present in the free list of the given order.
+		 * @param pgd The page descriptor of the block to look for.
+		 * @param order The order whose free list should be searched.
+		 */
+		bool is_free_block(const PageDescriptor *pgd, int order)
+		{
+			if (!is_managed_block(pgd, order)) {
+				return false;
+			}
+
+			// The free lists are sorted, so the search can stop at the first block that is
+			// not below the one we are looking for.
+			return *lower_bound(pgd, pageblock_type(pgd), order) == pgd;
+		}
+
+		/**
+		 * Changes the mobility class of the pageblock containing the given page, and moves
+		 * the free blocks inside it to the free lists of the new class.
+		 * @param pgd A page descriptor in the pageblock.
+		 * @param type The new mobility class.
+		 */
+		void claim_pageblock(PageDescriptor *pgd, MigrateType::MigrateType type)
+		{
+			MigrateType::MigrateType old_type = pageblock_type(pgd);
+			if (old_type == type) {
+				return;
+			}
+
+			uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd) & ~(pages_per_block(PAGEBLOCK_ORDER) - 1);
+			PageDescriptor *start = sys.mm().pgalloc().pfn_to_pgd(pfn);
+			PageDescriptor *end = start + pages_per_block(PAGEBLOCK_ORDER);
+
+			// Detach the pageblock's free blocks from the old lists first, and re-insert
+			// them once the pageblock has its new class.
+			PageDescriptor *moved[PAGEBLOCK_ORDER];
+
+			for (int order = 0; order < PAGEBLOCK_ORDER; order++) {
+				PageDescriptor **slot = lower_bound(start, old_type, order);
+				moved[order] = NULL;
+
+				PageDescriptor **tail = &moved[order];
+				while (*slot && *slot < end) {
+					*tail = unlink_block(slot, order);
+					tail = &(*tail)->next_free;
+				}
+			}
+
+			_pageblock_types[pageblock_index(pgd)] = type;
+
+			for (int order = 0; order < PAGEBLOCK_ORDER; order++) {
+				PageDescriptor *block = moved[order];
+				while (block) {
+					PageDescriptor *next = block->next_free;
+					insert_block(block, order);
+					block = next;
+				}
+			}
+		}
+
+		/**
+		 * Finds a free block in another mobility class for an allocation whose own class
+		 * has run out, converting as much of the surrounding memory to the requested
+		 * class as is sensible.  The largest available block is taken, so that the
+		 * mixing of classes is confined to as few pageblocks as possible.  All order
+		 * locks must be held.
+		 * @param order The order of the allocation.
+		 * @param type The mobility class of the allocation.
+		 * @param block_order Receives the order of the block that was found.
+		 * @return Returns the free block, or NULL if there is no memory at all.
+		 */
+		PageDescriptor *steal_block(int order, MigrateType::MigrateType type, int& block_order)
+		{
+			static const MigrateType::MigrateType fallbacks[MigrateType::NR_TYPES][MigrateType::NR_TYPES - 1] = {
+				{ MigrateType::RECLAIMABLE, MigrateType::MOVABLE },		// UNMOVABLE
+				{ MigrateType::UNMOVABLE, MigrateType::MOVABLE },		// RECLAIMABLE
+				{ MigrateType::RECLAIMABLE, MigrateType::UNMOVABLE },	// MOVABLE
+			};
+
+			for (int i = 0; i < MigrateType::NR_TYPES - 1; i++) {
+				MigrateType::MigrateType from = fallbacks[type][i];
+
+				for (int ord = MaxOrder - 1; ord >= order; ord--) {
+					PageDescriptor *block = _free_areas[from][ord];
+					if (!block) {
+						continue;
+					}
+
+					if (ord >= PAGEBLOCK_ORDER) {
+						// The block covers whole pageblocks, so they can all change class.
+						remove_block(block, ord);
+						set_pageblock_types(block, ord, type);
+						insert_block(block, ord);
+						_nr_pageblocks_claimed += pages_per_block(ord - PAGEBLOCK_ORDER);
+					} else if (ord >= PAGEBLOCK_ORDER / 2 || type != MigrateType::MOVABLE) {
+						// Either a large part of the pageblock is free, or this is an allocation
+						// that should be kept away from movable memory: take over the pageblock,
+						// so that future allocations of this class are grouped into it.
+						claim_pageblock(block, type);
+						_nr_pageblocks_claimed++;
+					}
+
+					_nr_fallbacks++;
+
+					block_order = ord;
+					return block;
+				}
+			}
+
+			return NULL;
+		}
+
+		/**
+		 * Splits a free block down until its left-most part is the requested order, and
+		 * removes that part from the free lists.  The locks for every order between the
+		 * two must be held.
+		 * @param block The free block to allocate from.
+		 * @param block_order The order of the free block.
+		 * @param order The order of the allocation.
+		 * @return Returns the allocated block.
+		 */
+		PageDescriptor *take_block(PageDescriptor *block, int block_order, int order)
+		{
+			// An allocation served straight from its own order uses up a deferred free, so
+			// a workload that frees and re-allocates at one order never triggers a pass.
+			if (block_order == order && _nr_deferred_frees[order] > 0) {
+				_nr_deferred_frees[order]--;
+			}
+
+			for (int ord = block_order; ord > order; ord--) {
+				block = split_block(&block, ord);
+			}
+
+			remove_block(block, order);
+			note_split(order, block_order - order);
+			return block;
+		}
+
+		/**
+		 * Splits a free block down until the part of the requested order that contains
+		 * the target page is a block of its own, and removes that part from the free
+		 * lists.  All order locks must be held.
+		 * @param block The free block to allocate from.
+		 * @param block_order The order of the free block.
+		 * @param target A page inside the block.
+		 * @param order The order of the allocation.
+		 * @return Returns the allocated block, which contains the target page.
+		 */
+		PageDescriptor *carve_block(PageDescriptor *block, int block_order, const PageDescriptor *target, int order)
+		{
+			for (int ord = block_order; ord > order; ord--) {
+				PageDescriptor *left = split_block(&block, ord);
+				PageDescriptor *right = left + pages_per_block(ord - 1);
+
+				block = target >= right ? right : left;
+			}
+
+			remove_block(block, order);
+			note_split(order, block_order - order);
+			return block;
+		}
+
+		/**
+		 * Allocates a block of the given order and class, falling back to stealing from
+		 * another class if need be.  All order locks must be held.
+		 * @param order The order of the allocation.
+		 * @param type The mobility class of the allocation.
+		 * @return Returns the allocated block, or NULL if there is no free memory.
+		 */
+		PageDescriptor *alloc_block_locked(int order, MigrateType::MigrateType type)
+		{
+			PageDescriptor *block = NULL;
+			int ord;
+
+			for (ord = order; ord < MaxOrder && !block; ord++) {
+				block = _free_areas[type][ord];
+			}
+
+			if (block) {
+				ord--;
+			} else {
+				block = steal_block(order, type, ord);
+			}
+
+			return block ? take_block(block, ord, order) : NULL;
+		}
+
+		/**
+		 * Puts a block back in its order, and keeps merging it with its buddy for as long
+		 * as the buddy is free too.
+		 * @param pgd The block to free.
+		 * @param order The order of the block.
+		 * @param locked TRUE if the caller holds every order lock.  Otherwise, the caller
+		 * holds the lock for 'order', and each merge takes the lock of the order above,
+		 * so the locks are still taken in ascending order.
+		 * @return Returns the order that the block ended up in, after merging.
+		 */
+		int free_block(PageDescriptor *pgd, int order, bool locked)
+		{
+			PageDescriptor **slot = insert_block(pgd, order);
+			int ord = order;
+
+			while (ord < MaxOrder - 1) {
+				PageDescriptor *buddy = buddy_of(*slot, ord);
+				if (!buddy || !is_free_block(buddy, ord)) {
+					break;
+				}
+
+				if (!locked) {
+					lock_order(ord + 1);
+				}
+
+				slot = merge_block(slot, ord);
+				ord++;
+			}
+
+			note_merge(order, ord - order);
+			return ord;
+		}
+
+		/**
+		 * Merges every pair of free buddies in the given order into the order above.  As
+		 * the free lists are sorted, buddies in the same list are neighbours, so each list
+		 * is walked once.  The locks for the order and the one above must be held.
+		 * @param order The order to coalesce.
+		 * @return Returns the number of pairs that were merged.
+		 */
+		unsigned int coalesce_order(int order)
+		{
+			if (order >= MaxOrder - 1) {
+				return 0;
+			}
+
+			unsigned int nr_merged = 0;
+
+			for (int type = 0; type < MigrateType::NR_TYPES; type++) {
+				PageDescriptor **slot = &_free_areas[type][order];
+
+				while (*slot) {
+					PageDescriptor *block = *slot;
+					PageDescriptor *buddy = buddy_of(block, order);
+
+					if (buddy > block && block->next_free == buddy) {
+						unlink_block(slot, order);
+						unlink_block(slot, order);
+
+						insert_block(block, order + 1);
+						nr_merged++;
+					} else if (buddy > block && order + 1 >= PAGEBLOCK_ORDER &&
+							pageblock_type(buddy) != type && is_free_block(buddy, order)) {
+						// Buddies that span whole pageblocks can be in different classes.
+						merge_block(slot, order);
+						nr_merged++;
+					} else {
+						slot = &block->next_free;
+					}
+				}
+			}
+
+			_nr_lazy_merges += nr_merged;
+			return nr_merged;
+		}
+
+		/**
+		 * Coalesces the given order, and then each order above it for as long as the
+		 * previous pass produced new blocks for it.
+		 * @param order The first order to coalesce.
+		 * @param locked TRUE if the caller holds every order lock.  Otherwise, the caller
+		 * holds the lock for 'order', and the lock of each order above is taken before it
+		 * is written to.
+		 * @return Returns the highest order that was written to.
+		 */
+		int coalesce_from(int order, bool locked)
+		{
+			int ord = order;
+
+			while (ord < MaxOrder - 1) {
+				if (!locked) {
+					lock_order(ord + 1);
+				}
+
+				unsigned int nr_merged = coalesce_order(ord);
+				_nr_deferred_frees[ord] = 0;
+				ord++;
+
+				if (!nr_merged) {
+					break;
+				}
+			}
+
+			_nr_coalesce_passes++;
+			return ord;
+		}
+
+		/**
+		 * Coalesces every order, so that no two free buddies are left unmerged.  All order
+		 * locks must be held.
+		 */
+		void coalesce_all_locked()
+		{
+			for (int ord = 0; ord < MaxOrder - 1; ord++) {
+				coalesce_order(ord);
+				_nr_deferred_frees[ord] = 0;
+			}
+
+			_nr_coalesce_passes++;
+		}
+
+		/**
+		 * Finds the aligned window of the given order that can be emptied most cheaply:
+		 * the one entirely inside movable pageblocks, with no reserved pages, and with
+		 * the fewest pages in use.  The free lists are swept once, in address order,
+		 * alongside the pages.  All order locks must be held.
+		 * @param order The order of the window.
+		 * @return Returns the first page of the window, or NULL if there is no candidate.
+		 */
+		PageDescriptor *find_compaction_window(int order)
+		{
+			// One cursor per free list, which only ever moves forwards.
+			const PageDescriptor *cursors[MigrateType::NR_TYPES][MaxOrder];
+			for (int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (int ord = 0; ord < MaxOrder; ord++) {
+					cursors[type][ord] = _free_areas[type][ord];
+				}
+			}
+
+			uint64_t window_pages = pages_per_block(order);
+			uint64_t first_pfn = (_base_pfn + window_pages - 1) & ~(window_pages - 1);
+
+			PageDescriptor *best = NULL;
+			uint64_t best_in_use = window_pages;
+
+			for (uint64_t pfn = first_pfn; pfn + window_pages <= _base_pfn + _nr_pages; pfn += window_pages) {
+				PageDescriptor *window = sys.mm().pgalloc().pfn_to_pgd(pfn);
+
+				bool eligible = true;
+				for (uint64_t pb = 0; pb < window_pages && eligible; pb += pages_per_block(PAGEBLOCK_ORDER)) {
+					eligible = pageblock_type(window + pb) == MigrateType::MOVABLE;
+				}
+
+				if (!eligible) {
+					continue;
+				}
+
+				uint64_t in_use = 0;
+				for (uint64_t page = 0; page < window_pages && eligible; ) {
+					PageDescriptor *pgd = window + page;
+					int type = pageblock_type(pgd);
+					int free_order = -1;
+
+					for (int ord = 0; ord <= order && free_order < 0; ord++) {
+						const PageDescriptor *head = pgd - (page & (pages_per_block(ord) - 1));
+						while (cursors[type][ord] && cursors[type][ord] < head) {
+							cursors[type][ord] = cursors[type][ord]->next_free;
+						}
+
+						if (cursors[type][ord] == head) {
+							free_order = ord;
+						}
+					}
+
+					if (free_order >= 0) {
+						page += pages_per_block(free_order);
+					} else if (pgd->type == PageDescriptorType::RESERVED) {
+						eligible = false;
+					} else {
+						in_use++;
+						page++;
+					}
+				}
+
+				if (eligible && in_use < best_in_use) {
+					best = window;
+					best_in_use = in_use;
+				}
+			}
+
+			return best;
+		}
+
+		/**
+		 * Tries to create a free block of the given order, by moving the in-use pages out
+		 * of an aligned window of movable memory, and letting the emptied window merge
+		 * back together.  All order locks must be held.
+		 * @param order The order of the block to create.
+		 * @return Returns TRUE if a block of the order was freed, FALSE otherwise.
+		 */
+		bool compact_locked(int order)
+		{
+			if (!_relocate || order <= 0 || order >= MaxOrder) {
+				return false;
+			}
+
+			// Free pages that are held back from the free lists would look in use, and be
+			// moved, leaving the pools pointing at pages that are no longer theirs.
+			drain_zeroed_pages_locked();
+#if BUDDY_PAGE_COLOURING
+			drain_colour_lists_locked();
+#endif
+
+			PageDescriptor *window = find_compaction_window(order);
+			if (!window) {
+				return false;
+			}
+
+			uint64_t window_pages = pages_per_block(order);
+
+			// Isolate the window's free blocks, so that none of the pages being moved can be
+			// given a destination inside the window.  Each free page is tagged, so the
+			// in-use pages can be told apart from them below.
+			PageDescriptor *isolated = (PageDescriptor *) COMPACTION_ISOLATED;
+
+			for (uint64_t page = 0; page < window_pages; ) {
+				int free_order = -1;
+				for (int ord = 0; ord <= order && free_order < 0; ord++) {
+					PageDescriptor *head = window + (page & ~(pages_per_block(ord) - 1));
+					if (head == window + page && is_free_block(head, ord)) {
+						free_order = ord;
+					}
+				}
+
+				if (free_order < 0) {
+					page++;
+					continue;
+				}
+
+				remove_block(window + page, free_order);
+				for (uint64_t i = 0; i < pages_per_block(free_order); i++) {
+					window[page + i].next_free = isolated;
+				}
+
+				page += pages_per_block(free_order);
+			}
+
+			// Move each in-use page out of the window.
+			bool success = true;
+			for (uint64_t page = 0; page < window_pages && success; page++) {
+				PageDescriptor *pgd = window + page;
+				if (pgd->next_free == isolated) {
+					continue;
+				}
+
+				PageDescriptor *target = alloc_block_locked(0, MigrateType::MOVABLE);
+				if (!target || !_relocate(pgd, target, _relocate_arg)) {
+					if (target) {
+						free_block(target, 0, true);
+					}
+
+					success = false;
+					break;
+				}
+
+				pgd->next_free = isolated;
+				_nr_pages_migrated++;
+			}
+
+			if (success) {
+				// The whole window is now free.
+				for (uint64_t page = 0; page < window_pages; page++) {
+					window[page].next_free = NULL;
+				}
+
+				free_block(window, order, true);
+				_nr_compactions++;
+			} else {
+				// Give back the free pages, and leave the pages that could not be moved where
+				// they are.
+				for (uint64_t page = 0; page < window_pages; page++) {
+					if (window[page].next_free == isolated) {
+						window[page].next_free = NULL;
+						free_block(window + page, 0, true);
+					}
+				}
+
+				_nr_compaction_failures++;
+			}
+
+			return success;
+		}
+
+		/**
+		 * Frees the pages in [first, last), as the largest aligned blocks that fit.  All
+		 * order locks must be held.
+		 * @param first The PFN of the first page to free.
+		 * @param last The PFN one past the last page to free.
+		 */
+		void free_range_locked(uint64_t first, uint64_t last)
+		{
+			while (first < last) {
+				int order = MaxOrder - 1;
+				while (order > 0 && ((first & (pages_per_block(order) - 1)) || first + pages_per_block(order) > last)) {
+					order--;
+				}
+
+				free_block(sys.mm().pgalloc().pfn_to_pgd(first), order, true);
+				first += pages_per_block(order);
+			}
+		}
+
+		/**
+		 * Frees every run of pages in [first, last) that is tagged as isolated, clearing
+		 * the tag.  All order locks must be held.
+		 * @param first The PFN of the first page to look at.
+		 * @param last The PFN one past the last page to look at.
+		 */
+		void release_isolated_locked(uint64_t first, uint64_t last)
+		{
+			PageDescriptor *isolated = (PageDescriptor *) COMPACTION_ISOLATED;
+			uint64_t pfn = first;
+
+			while (pfn < last) {
+				if (sys.mm().pgalloc().pfn_to_pgd(pfn)->next_free != isolated) {
+					pfn++;
+					continue;
+				}
+
+				uint64_t run = pfn;
+				while (pfn < last && sys.mm().pgalloc().pfn_to_pgd(pfn)->next_free == isolated) {
+					sys.mm().pgalloc().pfn_to_pgd(pfn)->next_free = NULL;
+					pfn++;
+				}
+
+				free_range_locked(run, pfn);
+			}
+		}
+
+		/**
+		 * Returns the index of the first offline range that ends at or after a page.
+		 * @param pfn The PFN of the page.
+		 * @return Returns the index, or the number of offline ranges if there is none.
+		 */
+		unsigned int find_offline_range(uint64_t pfn) const
+		{
+			unsigned int i = 0;
+			while (i < _nr_offline_ranges && _offline_ranges[i].last < pfn) {
+				i++;
+			}
+
+			return i;
+		}
+
+		/**
+		 * Records that [first, last) has been taken offline, merging it with the ranges
+		 * next to it.  All order locks must be held.
+		 * @param first The PFN of the first page taken offline.
+		 * @param last The PFN one past the last page taken offline.
+		 * @return Returns TRUE if the range was recorded, or FALSE if there is no room.
+		 */
+		bool add_offline_range_locked(uint64_t first, uint64_t last)
+		{
+			unsigned int i = find_offline_range(first);
+
+			if (i < _nr_offline_ranges && _offline_ranges[i].first <= last) {
+				// The range touches this one, and perhaps the one after it.
+				if (first < _offline_ranges[i].first) _offline_ranges[i].first = first;
+				if (last > _offline_ranges[i].last) _offline_ranges[i].last = last;
+
+				if (i + 1 < _nr_offline_ranges && _offline_ranges[i + 1].first <= _offline_ranges[i].last) {
+					_offline_ranges[i].last = _offline_ranges[i + 1].last;
+					memmove(&_offline_ranges[i + 1], &_offline_ranges[i + 2], (_nr_offline_ranges - i - 2) * sizeof(_offline_ranges[0]));
+					_nr_offline_ranges--;
+				}
+
+				return true;
+			}
+
+			if (_nr_offline_ranges == BUDDY_MAX_OFFLINE_RANGES) {
+				return false;
+			}
+
+			memmove(&_offline_ranges[i + 1], &_offline_ranges[i], (_nr_offline_ranges - i) * sizeof(_offline_ranges[0]));
+			_offline_ranges[i].first = first;
+			_offline_ranges[i].last = last;
+			_nr_offline_ranges++;
+			return true;
+		}
+
+		/**
+		 * Forgets that [first, last) is offline.  The range must lie within one recorded
+		 * range.  All order locks must be held.
+		 * @param first The PFN of the first page brought back.
+		 * @param last The PFN one past the last page brought back.
+		 * @return Returns TRUE if the range was forgotten, or FALSE if it is not offline, or
+		 * it would split a range and there is no room for the second half.
+		 */
+		bool remove_offline_range_locked(uint64_t first, uint64_t last)
+		{
+			unsigned int i = find_offline_range(first + 1);
+
+			if (i == _nr_offline_ranges || _offline_ranges[i].first > first || _offline_ranges[i].last < last) {
+				return false;
+			}
+
+			OfflineRange& range = _offline_ranges[i];
+
+			if (range.first < first && range.last > last) {
+				if (_nr_offline_ranges == BUDDY_MAX_OFFLINE_RANGES) {
+					return false;
+				}
+
+				memmove(&_offline_ranges[i + 1], &_offline_ranges[i], (_nr_offline_ranges - i) * sizeof(_offline_ranges[0]));
+				_nr_offline_ranges++;
+
+				_offline_ranges[i].last = first;
+				_offline_ranges[i + 1].first = last;
+			} else if (range.first < first) {
+				range.last = first;
+			} else if (range.last > last) {
+				range.first = last;
+			} else {
+				memmove(&_offline_ranges[i], &_offline_ranges[i + 1], (_nr_offline_ranges - i - 1) * sizeof(_offline_ranges[0]));
+				_nr_offline_ranges--;
+			}
+
+			return true;
+		}
+
+		/**
+		 * Makes every pageblock that [first, last) overlaps unmovable, moving the free
+		 * blocks inside them to the unmovable lists, so that neither compaction nor
+		 * offline_pages try to move the pages of an allocated range.  All order locks must
+		 * be held.
+		 * @param first The PFN of the first page of the range.
+		 * @param last The PFN one past the last page of the range.
+		 */
+		void pin_pageblocks_locked(uint64_t first, uint64_t last)
+		{
+			for (uint64_t pfn = first; pfn < last; pfn = (pfn | (pages_per_block(PAGEBLOCK_ORDER) - 1)) + 1) {
+				claim_pageblock(sys.mm().pgalloc().pfn_to_pgd(pfn), MigrateType::UNMOVABLE);
+			}
+		}
+
+		/**
+		 * Makes the pageblocks that lie wholly inside [first, last) movable again, once the
+		 * range pinned by pin_pageblocks_locked is being freed.  A pageblock the range only
+		 * shares stays unmovable, as other unmovable pages may have gone into it since.
+		 * All order locks must be held, and no page in the range may be on a free list.
+		 * @param first The PFN of the first page of the range.
+		 * @param last The PFN one past the last page of the range.
+		 */
+		void unpin_pageblocks_locked(uint64_t first, uint64_t last)
+		{
+			uint64_t pageblock_pages = pages_per_block(PAGEBLOCK_ORDER);
+
+			for (uint64_t pfn = (first + pageblock_pages - 1) & ~(pageblock_pages - 1); pfn + pageblock_pages <= last; pfn += pageblock_pages) {
+				set_pageblock_types(sys.mm().pgalloc().pfn_to_pgd(pfn), PAGEBLOCK_ORDER, MigrateType::MOVABLE);
+			}
+		}
+
+		/**
+		 * Finds the lowest run of free pages that holds an aligned range of the given size
+		 * inside a PFN window.  Runs are made of free blocks that are adjacent in memory,
+		 * of any order or class, so the free lists are merged in one sweep by address.
+		 * All order locks must be held.
+		 * @param nr_pages The number of pages in the range.
+		 * @param min_pfn The lowest PFN the range may start at.
+		 * @param max_pfn The PFN the range must end at or before.
+		 * @param align The alignment of the range's first PFN, in pages (a power of two).
+		 * @return Returns the first PFN of the range, or CONTIG_NOT_FOUND.
+		 */
+		uint64_t find_contig_range(uint64_t nr_pages, uint64_t min_pfn, uint64_t max_pfn, uint64_t align)
+		{
+			// One cursor per non-empty free list, which only ever moves forwards.  Lists
+			// are dropped as they run out, so the sweep only looks at live lists.
+			const PageDescriptor *cursors[MigrateType::NR_TYPES * MaxOrder];
+			int cursor_orders[MigrateType::NR_TYPES * MaxOrder];
+			int nr_cursors = 0;
+
+			for (int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (int ord = 0; ord < MaxOrder; ord++) {
+					if (_free_areas[type][ord]) {
+						cursors[nr_cursors] = _free_areas[type][ord];
+						cursor_orders[nr_cursors++] = ord;
+					}
+				}
+			}
+
+			uint64_t run_start = 0, run_end = 0;
+
+			while (nr_cursors > 0) {
+				// Take the lowest free block that has not been visited yet.
+				int lowest = 0;
+				for (int i = 1; i < nr_cursors; i++) {
+					if (cursors[i] < cursors[lowest]) {
+						lowest = i;
+					}
+				}
+
+				const PageDescriptor *block = cursors[lowest];
+				int block_order = cursor_orders[lowest];
+
+				if (!(cursors[lowest] = block->next_free)) {
+					nr_cursors--;
+					cursors[lowest] = cursors[nr_cursors];
+					cursor_orders[lowest] = cursor_orders[nr_cursors];
+				}
+
+				uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+				uint64_t end = pfn + pages_per_block(block_order);
+
+				if (end <= min_pfn) {
+					continue;
+				}
+
+				if (pfn >= max_pfn) {
+					break;
+				}
+
+				// Extend the current run, or start a new one after a gap.
+				if (pfn != run_end) {
+					run_start = pfn;
+				}
+
+				run_end = end;
+
+				uint64_t start = run_start > min_pfn ? run_start : min_pfn;
+				start = (start + align - 1) & ~(align - 1);
+
+				if (start + nr_pages <= (run_end < max_pfn ? run_end : max_pfn)) {
+					return start;
+				}
+			}
+
+			return CONTIG_NOT_FOUND;
+		}
+
+		/**
+		 * Clears a page with non-temporal stores, so that zeroing pages ahead of time does
+		 * not push useful data out of the cache.  Integer stores are used, as the kernel
+		 * does not save SIMD state.
+		 * @param page The virtual address of the page.
+		 */
+		static void clear_page_nt(void *page)
+		{
+			long long *words = (long long *) page;
+			for (unsigned int i = 0; i < page_size() / sizeof(long long); i += 4) {
+				__builtin_ia32_movnti64(&words[i + 0], 0);
+				__builtin_ia32_movnti64(&words[i + 1], 0);
+				__builtin_ia32_movnti64(&words[i + 2], 0);
+				__builtin_ia32_movnti64(&words[i + 3], 0);
+			}
+
+			__builtin_ia32_sfence();
+		}
+
+		/**
+		 * Returns every page in the zeroed-page pool to the free lists.  All order locks
+		 * must be held.
+		 * @return Returns the number of pages that were returned.
+		 */
+		uint64_t drain_zeroed_pages_locked()
+		{
+			uint64_t nr_drained = 0;
+
+			while (_zeroed_pages) {
+				PageDescriptor *pgd = _zeroed_pages;
+				_zeroed_pages = pgd->next_free;
+				pgd->next_free = NULL;
+
+				free_block(pgd, 0, true);
+				nr_drained++;
+			}
+
+			_nr_zeroed_pages = 0;
+			return nr_drained;
+		}
+
+		/**
+		 * Returns the index of the huge-page pool for the given order.
+		 * @return Returns the index, or -1 if no pool holds pages of that order.
+		 */
+		static int huge_pool_of(int order)
+		{
+			if (order == BUDDY_HUGE_ORDER) return 0;
+			if (order == BUDDY_GIGANTIC_ORDER) return 1;
+			return -1;
+		}
+
+		/**
+		 * Allocates a huge page straight from free memory, bypassing the pools.  Huge
+		 * pages are unmovable, and their pageblocks are marked so (by the fallback that
+		 * claims them, or by alloc_contig_range), so compaction never picks them to move.
+		 * @param order The order of the page.
+		 * @return Returns the page, or NULL if there is no such page free.
+		 */
+		PageDescriptor *alloc_huge_block(int order)
+		{
+			if (order < MaxOrder) {
+				return alloc_pages(order, AllocFlags::UNMOVABLE);
+			}
+
+			// A range this large would leave nothing for anyone else, so leave the memory
+			// below the min watermark alone, as an allocation would.
+			if (nr_free_pages() < _watermark_min + pages_per_block(order)) {
+				return NULL;
+			}
+
+			return alloc_contig_range(pages_per_block(order), 0, ~(uint64_t) 0, pages_per_block(order));
+		}
+
+		/**
+		 * Gives a huge page back to free memory.  The order locks needed must already be
+		 * held if 'locked' is TRUE (i.e. every order lock), and must not be otherwise.
+		 * @param pgd The page.
+		 * @param order The order of the page.
+		 * @param locked TRUE if the caller holds every order lock.
+		 */
+		void free_huge_block(PageDescriptor *pgd, int order, bool locked)
+		{
+			if (!locked) {
+				if (order < MaxOrder) {
+					free_pages(pgd, order);
+				} else {
+					free_contig_range(pgd, pages_per_block(order));
+				}
+			} else if (order < MaxOrder) {
+				free_block(pgd, order, true);
+			} else {
+				uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+				unpin_pageblocks_locked(pfn, pfn + pages_per_block(order));
+				free_range_locked(pfn, pfn + pages_per_block(order));
+			}
+		}
+
+		/**
+		 * Returns every page in the huge-page pools to the free lists.  Their targets are
+		 * kept, so reserve_huge_pages can fill them again.  All order locks must be held.
+		 * @return Returns the number of pages that were returned.
+		 */
+		uint64_t drain_huge_pages_locked()
+		{
+			static const int orders[] = { BUDDY_HUGE_ORDER, BUDDY_GIGANTIC_ORDER };
+			uint64_t nr_drained = 0;
+
+			_huge_lock.lock();
+
+			for (int pool = 0; pool < 2; pool++) {
+				while (_huge_pages[pool]) {
+					PageDescriptor *pgd = _huge_pages[pool];
+					_huge_pages[pool] = pgd->next_free;
+					pgd->next_free = NULL;
+
+					free_huge_block(pgd, orders[pool], true);
+					nr_drained += pages_per_block(orders[pool]);
+				}
+
+				_nr_huge_pages[pool] = 0;
+			}
+
+			_huge_lock.unlock();
+			return nr_drained;
+		}
+
+#if BUDDY_PAGE_COLOURING
+		/**
+		 * Returns the cache colour of a page.
+		 */
+		static unsigned int colour_of(const PageDescriptor *pgd)
+		{
+			return sys.mm().pgalloc().pgd_to_pfn(pgd) & (BUDDY_NR_COLOURS - 1);
+		}
+
+		/**
+		 * Takes a page of the given colour and class from the colour lists.  The order-0
+		 * lock must be held.
+		 * @return Returns the page, or NULL if that colour's list is empty.
+		 */
+		PageDescriptor *take_coloured_page(unsigned int colour, MigrateType::MigrateType type)
+		{
+			PageDescriptor *pgd = _colour_lists[type][colour];
+			if (pgd) {
+				_colour_lists[type][colour] = pgd->next_free;
+				_nr_colour_pages[type][colour]--;
+				_nr_coloured_pages--;
+				_nr_colour_served[colour]++;
+				pgd->next_free = NULL;
+			}
+
+			return pgd;
+		}
+
+		/**
+		 * Moves free order-0 pages of the given class onto the colour lists, until a page
+		 * of the wanted colour turns up or the scan limit is reached.  Pages whose colour
+		 * list is full are left where they are.  The order-0 lock must be held.
+		 * @param colour The colour that is wanted.
+		 * @param type The mobility class of the pages.
+		 */
+		void sort_loose_pages(unsigned int colour, MigrateType::MigrateType type)
+		{
+			PageDescriptor **slot = &_free_areas[type][0];
+
+			for (unsigned int scanned = 0; *slot && scanned < BUDDY_COLOUR_SCAN_LIMIT; scanned++) {
+				unsigned int pgd_colour = colour_of(*slot);
+
+				if (pgd_colour != colour && _nr_colour_pages[type][pgd_colour] >= BUDDY_COLOUR_LIST_MAX) {
+					slot = &(*slot)->next_free;
+					continue;
+				}
+
+				PageDescriptor *pgd = unlink_block(slot, 0);
+				pgd->next_free = _colour_lists[type][pgd_colour];
+				_colour_lists[type][pgd_colour] = pgd;
+				_nr_colour_pages[type][pgd_colour]++;
+				_nr_coloured_pages++;
+
+				if (pgd_colour == colour) {
+					break;
+				}
+			}
+		}
+
+		/**
+		 * Returns every page on the colour lists to the free lists.  All order locks must
+		 * be held.
+		 * @return Returns the number of pages that were returned.
+		 */
+		uint64_t drain_colour_lists_locked()
+		{
+			uint64_t nr_drained = 0;
+
+			for (int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (unsigned int colour = 0; colour < BUDDY_NR_COLOURS; colour++) {
+					while (_colour_lists[type][colour]) {
+						PageDescriptor *pgd = _colour_lists[type][colour];
+						_colour_lists[type][colour] = pgd->next_free;
+						pgd->next_free = NULL;
+
+						free_block(pgd, 0, true);
+						nr_drained++;
+					}
+
+					_nr_colour_pages[type][colour] = 0;
+				}
+			}
+
+			_nr_coloured_pages = 0;
+			return nr_drained;
+		}
+#endif
+
+		/**
+		 * Notes that the kernel is allocating, so every reservation has been made, free pages
+		 * really are free, and they can hold skip-list links.  Every allocation calls this,
+		 * so the flag is only written the first time.
+		 */
+		void allow_index_links()
+		{
+			if (!__atomic_load_n(&_index_links_safe, __ATOMIC_RELAXED)) {
+				__atomic_store_n(&_index_links_safe, true, __ATOMIC_RELAXED);
+			}
+		}
+
+		/**
+		 * Allocates 2^order contiguous pages of the given class from the free lists.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @param type The mobility class of the allocation.
+		 * @return Returns the first page descriptor of the block, or NULL if allocation failed.
+		 */
+		PageDescriptor *alloc_block(int order, MigrateType::MigrateType type)
+		{
+			allow_index_links();
+
+			// Find the lowest order that has a free block of the right class, taking each
+			// order's lock on the way up.  Every order passed over will be written to by
+			// the splits.
+			int ord = order;
+			lock_order(ord);
+
+			while (_free_areas[type][ord] == NULL) {
+				if (ord + 1 >= MaxOrder) {
+					break;
+				}
+
+				lock_order(++ord);
+			}
+
+			if (_free_areas[type][ord]) {
+				PageDescriptor *block = take_block(_free_areas[type][ord], ord, order);
+
+				unlock_orders(order, ord);
+				return block;
+			}
+
+			// This class has run out.  Falling back to another class can touch any order,
+			// so start again holding every lock.
+			unlock_orders(order, ord);
+			lock_all_orders();
+
+			if (Policy::LAZY_COALESCING) {
+				// The class may only have missed because its free blocks have not been merged.
+				coalesce_all_locked();
+			}
+
+			PageDescriptor *block = alloc_block_locked(order, type);
+
+			// Pre-zeroed pages are only a cache, so give them up before failing.
+			if (!block && drain_zeroed_pages_locked()) {
+				block = alloc_block_locked(order, type);
+			}
+
+#if BUDDY_PAGE_COLOURING
+			// So are the pages on the colour lists.
+			if (!block && drain_colour_lists_locked()) {
+				block = alloc_block_locked(order, type);
+			}
+#endif
+
+			// A large allocation may still be satisfiable if memory is compacted.
+			if (!block && order >= BUDDY_COMPACTION_MIN_ORDER && compact_locked(order)) {
+				block = alloc_block_locked(order, type);
+			}
+
+			unlock_orders(0, MaxOrder - 1);
+			return block;
+		}
+
+		/**
+		 * Returns the bucket of a cycle histogram that a number of cycles is counted in.
+		 */
+		static inline unsigned int stats_bucket(uint64_t value)
+		{
+			unsigned int bucket = value ? 64 - __builtin_clzll(value) : 0;
+			return bucket < BUDDY_STATS_BUCKETS ? bucket : BUDDY_STATS_BUCKETS - 1;
+		}
+
+		/**
+		 * Counts a free-list search that visited the given number of nodes.
+		 */
+		void note_walk(int order, unsigned int steps)
+		{
+#if BUDDY_INSTRUMENTATION
+			this_cpu_stats().walk_lengths[order][steps < BUDDY_STATS_BUCKETS ? steps : BUDDY_STATS_BUCKETS - 1]++;
+#else
+			(void)order;
+			(void)steps;
+#endif
+		}
+
+		/**
+		 * Counts an allocation of the given order that split a block 'depth' times.
+		 */
+		void note_split(int order, int depth)
+		{
+#if BUDDY_INSTRUMENTATION
+			this_cpu_stats().split_depths[order][depth]++;
+#else
+			(void)order;
+			(void)depth;
+#endif
+		}
+
+		/**
+		 * Counts a free of the given order that merged 'depth' times.
+		 */
+		void note_merge(int order, int depth)
+		{
+#if BUDDY_INSTRUMENTATION
+			this_cpu_stats().merge_depths[order][depth]++;
+#else
+			(void)order;
+			(void)depth;
+#endif
+		}
+
+		/**
+		 * Times a sample of alloc_pages or free_pages calls, from construction to the end
+		 * of the scope, and counts each in the histogram of the CPU it finished on.  Each
+		 * CPU samples every BUDDY_STATS_SAMPLE_PERIOD-th call it starts.
+		 */
+		class OpTimer {
+		public:
+#if BUDDY_INSTRUMENTATION
+			OpTimer(BasicBuddyPageAllocator& owner, bool free, int order) : _owner(owner), _free(free), _order(order), _start(0)
+			{
+				if (__builtin_expect((++owner.this_cpu_stats().tick & (BUDDY_STATS_SAMPLE_PERIOD - 1)) == 0, 0)) {
+					_start = __builtin_ia32_rdtsc();
+				}
+			}
+
+			~OpTimer()
+			{
+				if (!_start) {
+					return;
+				}
+
+				unsigned int aux;
+				uint64_t cycles = __builtin_ia32_rdtscp(&aux) - _start;
+
+				CpuStats& cpu = _owner.this_cpu_stats();
+				(_free ? cpu.free_cycles : cpu.alloc_cycles)[_order][stats_bucket(cycles)]++;
+			}
+
+		private:
+			BasicBuddyPageAllocator& _owner;
+			bool _free;
+			int _order;
+			uint64_t _start;
+#else
+			OpTimer(BasicBuddyPageAllocator&, bool, int) { }
+#endif
+		};
+
+		/**
+		 * Acquires the lock protecting the free lists of the given order.  Callers must
+		 * acquire order locks in ascending order.
+		 */
+		void lock_order(int order) const
+		{
+#if BUDDY_FINE_GRAINED_LOCKING
+			_order_locks[order].lock();
+#endif
+		}
+
+		/**
+		 * Releases the locks protecting the free lists of orders [low, high].
+		 */
+		void unlock_orders(int low, int high) const
+		{
+#if BUDDY_FINE_GRAINED_LOCKING
+			for (int order = high; order >= low; order--) {
+				_order_locks[order].unlock();
+			}
+#endif
+		}
+
+		/**
+		 * Acquires the locks protecting every free list, for operations that can touch
+		 * any order.
+		 */
+		void lock_all_orders() const
+		{
+			for (int order = 0; order < MaxOrder; order++) {
+				lock_order(order);
+			}
+		}
+
+	public:
+		/**
+		 * Constructs a new instance of the Buddy Page Allocator.
+		 */
+		BasicBuddyPageAllocator() : _base_pfn(0), _nr_pages(0), _nr_fallbacks(0), _nr_pageblocks_claimed(0),
+			_relocate(NULL), _relocate_arg(NULL), _nr_compactions(0), _nr_compaction_failures(0), _nr_pages_migrated(0),
+			_nr_coalesce_passes(0), _nr_lazy_merges(0),
+			_zeroed_pages(NULL), _nr_zeroed_pages(0), _nr_zeroed_served(0), _nr_zeroed_on_demand(0), _nr_near_exact(0),
+			_nr_pages_onlined(0), _nr_pages_offlined(0), _nr_offline_ranges(0),
+			_watermark_min(0), _watermark_low(0), _watermark_high(0), _watermarks_set(false),
+			_nr_shrinkers(0), _reclaiming(false), _nr_reclaim_passes(0), _nr_pages_reclaimed(0), _nr_alloc_failures(0) {
+			// Iterate over each free area, and clear it.
+			for (unsigned int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (unsigned int i = 0; i < MaxOrder; i++) {
+					_free_areas[type][i] = NULL;
+				}
+			}
+
+			for (unsigned int i = 0; i < MaxOrder; i++) {
+				_nr_deferred_frees[i] = 0;
+				_nr_free_blocks[i] = 0;
+			}
+
+			for (unsigned int pool = 0; pool < 2; pool++) {
+				_huge_pages[pool] = NULL;
+				_nr_huge_pages[pool] = 0;
+				_huge_pool_target[pool] = 0;
+				_nr_huge_hits[pool] = 0;
+				_nr_huge_misses[pool] = 0;
+				_nr_huge_failures[pool] = 0;
+			}
+
+#if BUDDY_PAGE_COLOURING
+			for (unsigned int colour = 0; colour < BUDDY_NR_COLOURS; colour++) {
+				for (unsigned int type = 0; type < MigrateType::NR_TYPES; type++) {
+					_colour_lists[type][colour] = NULL;
+					_nr_colour_pages[type][colour] = 0;
+				}
+
+				_nr_colour_served[colour] = 0;
+			}
+
+			_nr_coloured_pages = 0;
+			_next_colour = 0;
+#endif
+
+			_index_links_safe = false;
+
+			for (unsigned int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (unsigned int i = 0; i < MaxOrder; i++) {
+					for (unsigned int level = 0; level < BUDDY_INDEX_LEVELS - 1; level++) {
+						_index_heads[type][i][level] = NULL;
+					}
+				}
+			}
+
+#if BUDDY_INSTRUMENTATION
+			reset_stats();
+#endif
+		}
+
+		/**
+		 * Allocates 2^order number of contiguous, unmovable pages, keeping free memory above
+		 * the min watermark and calling the shrinkers when it runs low, as alloc_pages(order,
+		 * flags) does.  The shrinkers may take locks of their own, so a caller that holds a
+		 * spinlock must allocate with alloc_pages(order, AllocFlags::ATOMIC) instead.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+		 * allocation failed.
+		 */
+		PageDescriptor *alloc_pages(int order) override
+		{
+			return alloc_pages(order, AllocFlags::UNMOVABLE);
+		}
+
+		/**
+		 * Allocates 2^order number of contiguous pages.  Unless the allocation is ATOMIC,
+		 * it does not take free memory below the min watermark, and the shrinkers are
+		 * asked for memory when free memory is below the low watermark, or the allocation
+		 * would otherwise fail.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @param flags The AllocFlags for the allocation, which give its mobility class, and
+		 * whether the pages must be zeroed.  Only an order-0 allocation may be MOVABLE.
+		 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+		 * allocation failed.
+		 */
+		PageDescriptor *alloc_pages(int order, unsigned int flags)
+		{
+			return alloc_pages_hinted(order, NO_PFN_HINT, flags);
+		}
+
+		/**
+		 * Returns the number of free pages, i.e. those on the free lists, and those parked in
+		 * the zeroed-page pool and the colour lists, which are given back before an allocation
+		 * fails.  This is read without locks, so it is only a snapshot.
+		 */
+		uint64_t nr_free_pages() const
+		{
+			uint64_t nr_free = __atomic_load_n(&_nr_zeroed_pages, __ATOMIC_RELAXED);
+			for (int order = 0; order < MaxOrder; order++) {
+				nr_free += __atomic_load_n(&_nr_free_blocks[order], __ATOMIC_RELAXED) << order;
+			}
+
+#if BUDDY_PAGE_COLOURING
+			nr_free += __atomic_load_n(&_nr_coloured_pages, __ATOMIC_RELAXED);
+#endif
+
+			return nr_free;
+		}
+
+		/**
+		 * Sets the watermarks, in pages.  They must be in ascending order.
+		 * @param min The free memory that ordinary allocations must leave alone.
+		 * @param low The free memory below which the shrinkers are called.
+		 * @param high The free memory that the shrinkers are asked to restore.
+		 */
+		void set_watermarks(uint64_t min, uint64_t low, uint64_t high)
+		{
+			assert(min <= low && low <= high);
+
+			_watermark_min = min;
+			_watermark_low = low;
+			_watermark_high = high;
+			_watermarks_set = true;
+		}
+
+		uint64_t watermark_min() const { return _watermark_min; }
+		uint64_t watermark_low() const { return _watermark_low; }
+		uint64_t watermark_high() const { return _watermark_high; }
+
+		/**
+		 * Registers a callback that is asked to free memory when the allocator runs low.
+		 * @param shrink The callback.
+		 * @param arg An argument passed through to the callback.
+		 * @return Returns TRUE if the callback was registered, or FALSE if there is no room
+		 * for another.
+		 */
+		bool register_shrinker(ShrinkFn shrink, void *arg)
+		{
+			_shrinker_lock.lock();
+
+			bool registered = _nr_shrinkers < BUDDY_MAX_SHRINKERS;
+			if (registered) {
+				_shrinkers[_nr_shrinkers].shrink = shrink;
+				_shrinkers[_nr_shrinkers].arg = arg;
+				_nr_shrinkers++;
+			}
+
+			_shrinker_lock.unlock();
+			return registered;
+		}
+
+		/**
+		 * Unregisters a shrinker.  Once this returns, the callback is not running, and will
+		 * not be called again.
+		 * @param shrink The callback.
+		 * @param arg The argument it was registered with.
+		 */
+		void unregister_shrinker(ShrinkFn shrink, void *arg)
+		{
+			_shrinker_lock.lock();
+
+			for (unsigned int i = 0; i < _nr_shrinkers; i++) {
+				if (_shrinkers[i].shrink == shrink && _shrinkers[i].arg == arg) {
+					_shrinkers[i] = _shrinkers[--_nr_shrinkers];
+					break;
+				}
+			}
+
+			_shrinker_lock.unlock();
+		}
+
+		/**
+		 * Asks the shrinkers to free memory, in turn, until they have freed the given
+		 * number of pages between them.  Only one thread reclaims at a time: a call made
+		 * while another is in progress (including one made by a shrinker) does nothing.
+		 * @param nr_pages The number of pages wanted.
+		 * @return Returns the number of pages the shrinkers freed.
+		 */
+		uint64_t reclaim(uint64_t nr_pages)
+		{
+			if (__atomic_exchange_n(&_reclaiming, true, __ATOMIC_ACQUIRE)) {
+				return 0;
+			}
+
+			uint64_t nr_reclaimed = 0;
+
+			_shrinker_lock.lock();
+
+			for (unsigned int i = 0; i < _nr_shrinkers && nr_reclaimed < nr_pages; i++) {
+				nr_reclaimed += _shrinkers[i].shrink(nr_pages - nr_reclaimed, _shrinkers[i].arg);
+			}
+
+			_nr_reclaim_passes++;
+			_nr_pages_reclaimed += nr_reclaimed;
+
+			_shrinker_lock.unlock();
+			__atomic_store_n(&_reclaiming, false, __ATOMIC_RELEASE);
+			return nr_reclaimed;
+		}
+
+	private:
+		/**
+		 * Allocates 2^order number of contiguous pages, keeping free memory above the min
+		 * watermark and calling the shrinkers unless the allocation is ATOMIC, as described
+		 * for alloc_pages.  This is shared by alloc_pages and alloc_pages_near.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @param pfn_hint The page-frame-number the block should be near, or NO_PFN_HINT.
+		 * @param flags The AllocFlags for the allocation.
+		 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+		 * allocation failed.
+		 */
+		PageDescriptor *alloc_pages_hinted(int order, uint64_t pfn_hint, unsigned int flags)
+		{
+			// Compaction would scatter a movable block over unrelated pages.
+			assert(order == 0 || !(flags & AllocFlags::MOVABLE));
+
+			if (order < 0 || order >= MaxOrder || (order > 0 && (flags & AllocFlags::MOVABLE))) {
+				return NULL;
+			}
+
+			OpTimer timer(*this, false, order);
+
+			if (flags & AllocFlags::ATOMIC) {
+				return try_alloc_pages(order, flags, pfn_hint);
+			}
+
+			uint64_t nr_pages = pages_per_block(order);
+
+			for (unsigned int attempt = 0; ; attempt++) {
+				uint64_t nr_free = nr_free_pages();
+
+				// Running low: have the caches give back enough to reach the high watermark.
+				if (nr_free < _watermark_low + nr_pages) {
+					reclaim(_watermark_high + nr_pages - nr_free);
+					nr_free = nr_free_pages();
+				}
+
+				if (nr_free >= _watermark_min + nr_pages) {
+					PageDescriptor *pgd = try_alloc_pages(order, flags, pfn_hint);
+					if (pgd) {
+						return pgd;
+					}
+				}
+
+				// Free memory may be too fragmented for the order, or a racing allocation may
+				// have taken it, so keep asking while the shrinkers still have memory to give.
+				if (attempt == BUDDY_RECLAIM_RETRIES || reclaim(nr_pages + (nr_free < _watermark_high ? _watermark_high - nr_free : 0)) == 0) {
+					break;
+				}
+			}
+
+			__atomic_add_fetch(&_nr_alloc_failures, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+
+		/**
+		 * Allocates 2^order number of contiguous pages, without looking at the watermarks.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @param flags The AllocFlags for the allocation.
+		 * @param pfn_hint The page-frame-number the block should be near, or NO_PFN_HINT.
+		 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+		 * allocation failed.
+		 */
+		PageDescriptor *try_alloc_pages(int order, unsigned int flags, uint64_t pfn_hint = NO_PFN_HINT)
+		{
+			MigrateType::MigrateType type = migrate_type_of(flags);
+
+			if (flags & AllocFlags::ZERO) {
+				// The pool is filled from movable pageblocks.  A page of another class taken
+				// from it is mixed in, as it would be by a fallback, and is no worse for
+				// compaction than one: the relocation callback can refuse to move it.  A
+				// pooled page could be anywhere, so an allocation with a hint clears its own.
+				if (order == 0 && pfn_hint == NO_PFN_HINT) {
+					lock_order(0);
+
+					PageDescriptor *pgd = _zeroed_pages;
+					if (pgd) {
+						_zeroed_pages = pgd->next_free;
+						pgd->next_free = NULL;
+						_nr_zeroed_pages--;
+						_nr_zeroed_served++;
+					}
+
+					unlock_orders(0, 0);
+
+					if (pgd) {
+						return pgd;
+					}
+				}
+
+				PageDescriptor *block = try_alloc_pages(order, flags & ~AllocFlags::ZERO, pfn_hint);
+				if (block) {
+					memset(sys.mm().pgalloc().pgd_to_vpa(block), 0, pages_per_block(order) * page_size());
+					__atomic_add_fetch(&_nr_zeroed_on_demand, 1, __ATOMIC_RELAXED);
+				}
+
+				return block;
+			}
+
+			if (pfn_hint != NO_PFN_HINT) {
+				return alloc_block_near(order, pfn_hint, type);
+			}
+
+#if BUDDY_PAGE_COLOURING
+			if (order == 0) {
+				return alloc_coloured_page(-1, flags);
+			}
+#endif
+
+			return alloc_block(order, type);
+		}
+
+		/**
+		 * Allocates 2^order contiguous pages of the given class as close as possible to a
+		 * given page, as described for alloc_pages_near.  If nothing of the class is free,
+		 * or the hint is outside the memory managed, the usual fallbacks decide.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @param pfn_hint The page-frame-number that the block should start at, or near.
+		 * @param type The mobility class of the allocation.
+		 * @return Returns the first page descriptor of the block, or NULL if allocation failed.
+		 */
+		PageDescriptor *alloc_block_near(int order, uint64_t pfn_hint, MigrateType::MigrateType type)
+		{
+			uint64_t target_pfn = pfn_hint & ~(pages_per_block(order) - 1);
+
+			if (target_pfn < _base_pfn || target_pfn + pages_per_block(order) > _base_pfn + _nr_pages) {
+				return alloc_block(order, type);
+			}
+
+			PageDescriptor *target = sys.mm().pgalloc().pfn_to_pgd(target_pfn);
+			PageDescriptor *block = NULL;
+
+			allow_index_links();
+
+			lock_all_orders();
+
+			// Walk up the buddy chain of the target, looking for a free block that holds it.
+			// The caller asked for this spot, so it is taken even if its pageblock belongs to
+			// another class (which is typically where the caller's previous block came from).
+			for (int ord = order; ord < MaxOrder && !block; ord++) {
+				PageDescriptor *chain = sys.mm().pgalloc().pfn_to_pgd(target_pfn & ~(pages_per_block(ord) - 1));
+				if (is_free_block(chain, ord)) {
+					if (pageblock_type(chain) != type) {
+						_nr_fallbacks++;
+					}
+
+					block = carve_block(chain, ord, target, order);
+					_nr_near_exact++;
+				}
+			}
+
+			// Otherwise, find the nearest free block on each side of the target, in each order.
+			if (!block) {
+				PageDescriptor *best = NULL, *best_target = NULL;
+				int best_order = 0;
+				uint64_t best_distance = ~(uint64_t) 0;
+
+				for (int ord = order; ord < MaxOrder; ord++) {
+					PageDescriptor **slot = lower_bound(target, type, ord);
+
+					// The block after the target would give up its lowest part.
+					if (*slot && (uint64_t) (*slot - target) < best_distance) {
+						best = *slot;
+						best_target = *slot;
+						best_order = ord;
+						best_distance = *slot - target;
+					}
+
+					// The block before it (whose next_free is the slot, unless the slot is the
+					// list head) would give up its highest part.
+					if (slot != &_free_areas[type][ord]) {
+						PageDescriptor *before = (PageDescriptor *) ((uintptr_t) slot - offsetof(PageDescriptor, next_free));
+						PageDescriptor *last = before + pages_per_block(ord) - pages_per_block(order);
+
+						if ((uint64_t) (target - last) < best_distance) {
+							best = before;
+							best_target = last;
+							best_order = ord;
+							best_distance = target - last;
+						}
+					}
+				}
+
+				if (best) {
+					block = carve_block(best, best_order, best_target, order);
+				}
+			}
+
+			unlock_orders(0, MaxOrder - 1);
+
+			// There is nothing of this class free at all, so let the usual fallbacks decide.
+			return block ? block : alloc_block(order, type);
+		}
+
+	public:
+		/**
+		 * Allocates 2^order contiguous pages as close as possible to a given page, so that
+		 * a buffer that grows a block at a time stays physically contiguous.  The block at
+		 * the hint itself is used if it is free (i.e. some block in its buddy chain is);
+		 * otherwise the nearest free block of the class on either side of the hint is
+		 * carved up, keeping the part closest to the hint.  The watermarks, shrinkers and
+		 * flags are handled as they are by alloc_pages.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @param pfn_hint The page-frame-number that the block should start at, or near.
+		 * @param flags The AllocFlags for the allocation, as for alloc_pages.
+		 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+		 * allocation failed.
+		 */
+		PageDescriptor *alloc_pages_near(int order, uint64_t pfn_hint, unsigned int flags)
+		{
+			return alloc_pages_hinted(order, pfn_hint, flags);
+		}
+
+		/**
+		 * Returns the number of alloc_pages_near calls that got the block at their hint.
+		 */
+		uint64_t nr_near_exact() const { return _nr_near_exact; }
+
+#if BUDDY_PAGE_COLOURING
+		/**
+		 * Allocates a single page of the given cache colour.
+		 * @param colour The colour of the page, or -1 to take the colours in turn.
+		 * @param flags The AllocFlags for the allocation, which give its mobility class.
+		 * @return Returns the page descriptor of the page, or NULL if allocation failed.
+		 */
+		PageDescriptor *alloc_coloured_page(int colour, unsigned int flags)
+		{
+			MigrateType::MigrateType type = migrate_type_of(flags);
+
+			lock_order(0);
+
+			if (colour < 0) {
+				colour = _next_colour;
+				_next_colour = (_next_colour + 1) & (BUDDY_NR_COLOURS - 1);
+			}
+
+			colour &= BUDDY_NR_COLOURS - 1;
+
+			PageDescriptor *pgd = take_coloured_page(colour, type);
+			unlock_orders(0, 0);
+
+			if (pgd) {
+				return pgd;
+			}
+
+			// Split a block that holds one page of every colour across the lists.  A page
+			// whose list is already full goes straight back to the free lists.
+			PageDescriptor *block = alloc_block(COLOUR_BLOCK_ORDER, type);
+			if (!block) {
+				lock_order(0);
+				sort_loose_pages(colour, type);
+				pgd = take_coloured_page(colour, type);
+				unlock_orders(0, 0);
+
+				// Failing that, settle for a page of any colour.
+				return pgd ? pgd : alloc_block(0, type);
+			}
+
+			lock_order(0);
+
+			for (unsigned int page = 0; page < BUDDY_NR_COLOURS; page++) {
+				PageDescriptor *pgd = block + page;
+				unsigned int pgd_colour = colour_of(pgd);
+
+				if (pgd_colour != (unsigned int) colour && _nr_colour_pages[type][pgd_colour] >= BUDDY_COLOUR_LIST_MAX) {
+					int ord = free_block(pgd, 0, false);
+					unlock_orders(1, ord);
+					continue;
+				}
+
+				pgd->next_free = _colour_lists[type][pgd_colour];
+				_colour_lists[type][pgd_colour] = pgd;
+				_nr_colour_pages[type][pgd_colour]++;
+				_nr_coloured_pages++;
+			}
+
+			pgd = take_coloured_page(colour, type);
+			unlock_orders(0, 0);
+
+			return pgd;
+		}
+#endif
+
+		/**
+		 * Frees 2^order contiguous pages.
+		 * @param pgd A pointer to an array of page descriptors to be freed.
+		 * @param order The power of two number of contiguous pages to free.
+		 */
+		void free_pages(PageDescriptor *pgd, int order) override
+		{
+			// Make sure that the incoming page descriptor is correctly aligned
+			// for the order on which it is being freed, for example, it is
+			// illegal to free page 1 in order-1.
+			assert(is_correct_alignment_for_order(pgd, order));
+
+			if (order < 0 || order >= MaxOrder) {
+				return;
+			}
+
+			OpTimer timer(*this, true, order);
+			lock_order(order);
+
+			int ord = order;
+			if (Policy::LAZY_COALESCING) {
+				insert_block(pgd, order);
+
+				if (++_nr_deferred_frees[order] >= BUDDY_LAZY_COALESCE_THRESHOLD) {
+					ord = coalesce_from(order, false);
+				}
+			} else {
+				ord = free_block(pgd, order, false);
+			}
+
+			unlock_orders(order, ord);
+		}
+
+		/**
+		 * Allocates a physically contiguous range of pages, which may be larger than the
+		 * largest block, and may have to be aligned or lie within a window of memory
+		 * (e.g. for DMA below 4 GiB).  The range is built out of adjacent free blocks, and
+		 * its pageblocks are marked unmovable until it is freed.
+		 * @param nr_pages The number of pages to allocate.
+		 * @param min_pfn The lowest PFN the range may start at.
+		 * @param max_pfn The PFN the range must end at or before.
+		 * @param align The alignment of the first PFN of the range, in pages.  This must
+		 * be a power of two.
+		 * @return Returns the first page descriptor of the range, or NULL if there is no
+		 * such range free.
+		 */
+		PageDescriptor *alloc_contig_range(uint64_t nr_pages, uint64_t min_pfn, uint64_t max_pfn, uint64_t align)
+		{
+			if (nr_pages == 0 || (align & (align - 1))) {
+				return NULL;
+			}
+
+			if (align == 0) {
+				align = 1;
+			}
+
+			if (min_pfn < _base_pfn) min_pfn = _base_pfn;
+			if (max_pfn > _base_pfn + _nr_pages) max_pfn = _base_pfn + _nr_pages;
+
+			lock_all_orders();
+
+			uint64_t start = find_contig_range(nr_pages, min_pfn, max_pfn, align);
+			if (start == CONTIG_NOT_FOUND) {
+				unlock_orders(0, MaxOrder - 1);
+				return NULL;
+			}
+
+			uint64_t end = start + nr_pages;
+
+			// Detach every free block that overlaps the range.  The blocks at either end
+			// may stick out of it, so remember how far, and give those parts back once all
+			// of the range has been detached (so they cannot merge back into it).
+			uint64_t first = start, last = end;
+
+			for (int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (int ord = 0; ord < MaxOrder; ord++) {
+					// Only the block that starts below the range can overlap it from the left,
+					// so start the walk there.
+					uint64_t from = start & ~(pages_per_block(ord) - 1);
+					PageDescriptor **slot = lower_bound(sys.mm().pgalloc().pfn_to_pgd(from), type, ord);
+
+					while (*slot) {
+						uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(*slot);
+						if (pfn >= end) {
+							break;
+						}
+
+						if (pfn < first) first = pfn;
+						if (pfn + pages_per_block(ord) > last) last = pfn + pages_per_block(ord);
+
+						unlink_block(slot, ord);
+					}
+				}
+			}
+
+			// The parts at either end are given back to the unmovable lists along with the
+			// rest of the free memory in the range's pageblocks.
+			pin_pageblocks_locked(start, end);
+
+			free_range_locked(first, start);
+			free_range_locked(end, last);
+
+			unlock_orders(0, MaxOrder - 1);
+			return sys.mm().pgalloc().pfn_to_pgd(start);
+		}
+
+		/**
+		 * Frees a range of pages allocated with alloc_contig_range.
+		 * @param pgd The first page descriptor of the range.
+		 * @param nr_pages The number of pages in the range.
+		 */
+		void free_contig_range(PageDescriptor *pgd, uint64_t nr_pages)
+		{
+			uint64_t first = sys.mm().pgalloc().pgd_to_pfn(pgd);
+
+			lock_all_orders();
+			unpin_pageblocks_locked(first, first + nr_pages);
+			free_range_locked(first, first + nr_pages);
+			unlock_orders(0, MaxOrder - 1);
+		}
+
+		/**
+		 * Sets the number of huge pages of the given order that are kept in reserve, and
+		 * allocates or releases pages until the pool holds that many.  Pages in a pool are
+		 * off the free lists, so small allocations cannot split them.  Pools are meant to
+		 * be filled early (e.g. at boot), while memory is still unfragmented.
+		 * @param order BUDDY_HUGE_ORDER or BUDDY_GIGANTIC_ORDER.
+		 * @param nr_pages The number of huge pages to keep.
+		 * @return Returns the number of huge pages now in the pool, which is less than
+		 * nr_pages if memory ran out.
+		 */
+		uint64_t reserve_huge_pages(int order, uint64_t nr_pages)
+		{
+			int pool = huge_pool_of(order);
+			if (pool < 0) {
+				return 0;
+			}
+
+			_huge_lock.lock();
+			_huge_pool_target[pool] = nr_pages;
+
+			// The target is read again each time around, so that concurrent calls settle on
+			// the last one's.
+			while (_nr_huge_pages[pool] != _huge_pool_target[pool]) {
+				if (_nr_huge_pages[pool] > _huge_pool_target[pool]) {
+					PageDescriptor *pgd = _huge_pages[pool];
+					_huge_pages[pool] = pgd->next_free;
+					pgd->next_free = NULL;
+					_nr_huge_pages[pool]--;
+
+					_huge_lock.unlock();
+					free_huge_block(pgd, order, false);
+					_huge_lock.lock();
+					continue;
+				}
+
+				// Allocating takes order locks, which must not be taken under the pool's lock.
+				_huge_lock.unlock();
+				PageDescriptor *pgd = alloc_huge_block(order);
+				_huge_lock.lock();
+
+				if (!pgd) {
+					break;
+				}
+
+				pgd->next_free = _huge_pages[pool];
+				_huge_pages[pool] = pgd;
+				_nr_huge_pages[pool]++;
+			}
+
+			uint64_t nr_reserved = _nr_huge_pages[pool];
+			_huge_lock.unlock();
+
+			return nr_reserved;
+		}
+
+		/**
+		 * Allocates a huge page.  The page comes from the pool for its order if it has one,
+		 * and is otherwise allocated from free memory, which for a large order on a
+		 * fragmented heap may need compaction, or fail.
+		 * @param order BUDDY_HUGE_ORDER or BUDDY_GIGANTIC_ORDER.
+		 * @return Returns the first page descriptor of the page, or NULL if allocation
+		 * failed.
+		 */
+		PageDescriptor *alloc_huge_page(int order)
+		{
+			int pool = huge_pool_of(order);
+			if (pool < 0) {
+				return NULL;
+			}
+
+			_huge_lock.lock();
+
+			PageDescriptor *pgd = _huge_pages[pool];
+			if (pgd) {
+				_huge_pages[pool] = pgd->next_free;
+				pgd->next_free = NULL;
+				_nr_huge_pages[pool]--;
+				_nr_huge_hits[pool]++;
+			}
+
+			_huge_lock.unlock();
+
+			if (pgd) {
+				return pgd;
+			}
+
+			pgd = alloc_huge_block(order);
+			__atomic_add_fetch(pgd ? &_nr_huge_misses[pool] : &_nr_huge_failures[pool], 1, __ATOMIC_RELAXED);
+
+			return pgd;
+		}
+
+		/**
+		 * Frees a huge page allocated with alloc_huge_page.  It goes back to its pool if
+		 * the pool is below its target, and to free memory otherwise.
+		 * @param pgd The first page descriptor of the page.
+		 * @param order The order the page was allocated with.
+		 */
+		void free_huge_page(PageDescriptor *pgd, int order)
+		{
+			int pool = huge_pool_of(order);
+			if (pool < 0) {
+				return;
+			}
+
+			_huge_lock.lock();
+
+			if (_nr_huge_pages[pool] < _huge_pool_target[pool]) {
+				pgd->next_free = _huge_pages[pool];
+				_huge_pages[pool] = pgd;
+				_nr_huge_pages[pool]++;
+
+				_huge_lock.unlock();
+				return;
+			}
+
+			_huge_lock.unlock();
+			free_huge_block(pgd, order, false);
+		}
+
+		/**
+		 * Adds a range of pages to the allocator while it is running, e.g. memory that a
+		 * hypervisor has handed back to a ballooned guest.  The range may lie inside a hole
+		 * left by offline_pages, or beyond either end of the memory already managed.  Its
+		 * pages are freed as the largest aligned blocks that fit, so they merge with any
+		 * free neighbours.
+		 * @param first_pfn The PFN of the first page to add.
+		 * @param nr_pages The number of pages to add.
+		 * @return Returns TRUE if the pages were added, or FALSE if part of the range is
+		 * within the memory managed but was not taken out by offline_pages, or the memory
+		 * managed would then span more pageblocks than can be tracked.
+		 */
+		bool online_pages(uint64_t first_pfn, uint64_t nr_pages)
+		{
+			if (nr_pages == 0) {
+				return true;
+			}
+
+			uint64_t last_pfn = first_pfn + nr_pages;
+
+			lock_all_orders();
+
+			// Within the memory already managed, only pages that offline_pages took out can
+			// be added.  Freeing a page that is free, in use, or reserved by reserve_page
+			// (e.g. the kernel image) would corrupt the free lists or hand it out.
+			uint64_t from = first_pfn > _base_pfn ? first_pfn : _base_pfn;
+			uint64_t to = last_pfn < _base_pfn + _nr_pages ? last_pfn : _base_pfn + _nr_pages;
+
+			if (_nr_pages > 0 && from < to && !remove_offline_range_locked(from, to)) {
+				unlock_orders(0, MaxOrder - 1);
+				return false;
+			}
+
+			uint64_t base = first_pfn, end = last_pfn;
+			if (_nr_pages > 0) {
+				if (_base_pfn < base) base = _base_pfn;
+				if (_base_pfn + _nr_pages > end) end = _base_pfn + _nr_pages;
+			}
+
+			if (((end - 1) >> PAGEBLOCK_ORDER) - (base >> PAGEBLOCK_ORDER) >= BUDDY_MAX_PAGEBLOCKS) {
+				unlock_orders(0, MaxOrder - 1);
+				return false;
+			}
+
+			if (_nr_pages == 0) {
+				// Nothing has been managed yet, so nothing is known about any pageblock.
+				memset(_pageblock_types, MigrateType::MOVABLE, sizeof(_pageblock_types));
+			} else {
+				// Pageblocks are indexed from the base, so moving the base down moves every
+				// pageblock's slot up.
+				uint64_t shift = (_base_pfn >> PAGEBLOCK_ORDER) - (base >> PAGEBLOCK_ORDER);
+				if (shift > 0) {
+					for (uint64_t i = BUDDY_MAX_PAGEBLOCKS; i > shift; i--) {
+						_pageblock_types[i - 1] = _pageblock_types[i - 1 - shift];
+					}
+
+					memset(_pageblock_types, MigrateType::MOVABLE, shift);
+				}
+			}
+
+			_base_pfn = base;
+			_nr_pages = end - base;
+
+			// New memory starts out movable, like memory given to init, apart from any
+			// pageblock it shares with memory that is already here.
+			for (uint64_t pfn = first_pfn; pfn < last_pfn; pfn++) {
+				PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(pfn);
+				pgd->type = PageDescriptorType::AVAILABLE;
+				pgd->next_free = NULL;
+
+				if ((pfn & (pages_per_block(PAGEBLOCK_ORDER) - 1)) == 0 && pfn + pages_per_block(PAGEBLOCK_ORDER) <= last_pfn) {
+					set_pageblock_types(pgd, PAGEBLOCK_ORDER, MigrateType::MOVABLE);
+				}
+			}
+
+			free_range_locked(first_pfn, last_pfn);
+			_nr_pages_onlined += nr_pages;
+			update_default_watermarks();
+
+			unlock_orders(0, MaxOrder - 1);
+			return true;
+		}
+
+		/**
+		 * Takes a range of pages out of the allocator while it is running, e.g. so that a
+		 * hypervisor can reclaim it from a ballooned guest.  The free blocks in the range
+		 * are detached from the free lists, and every page in it that is still in use is
+		 * moved out with the relocation callback.  Only pages in movable pageblocks are
+		 * moved, as only single pages are movable; a page in any other pageblock may be part
+		 * of a larger block.  If a page cannot be moved (it is reserved or not in a movable
+		 * pageblock, there is no callback, the callback refuses, or there is nowhere to move
+		 * it to), the range is left as it was, and the caller should try again once the
+		 * page has been freed.  Offline pages are marked as reserved, and recorded, so that
+		 * online_pages can tell them from pages reserved by reserve_page.
+		 * @param first_pfn The PFN of the first page to remove.
+		 * @param nr_pages The number of pages to remove.
+		 * @return Returns TRUE if the range is now offline, or FALSE otherwise.
+		 */
+		bool offline_pages(uint64_t first_pfn, uint64_t nr_pages)
+		{
+			uint64_t last_pfn = first_pfn + nr_pages;
+
+			if (nr_pages == 0 || first_pfn < _base_pfn || last_pfn > _base_pfn + _nr_pages) {
+				return false;
+			}
+
+			lock_all_orders();
+
+			// A hole needs a record of its own, unless it grows one that is already there.
+			if (last_pfn < _base_pfn + _nr_pages && _nr_offline_ranges == BUDDY_MAX_OFFLINE_RANGES) {
+				unsigned int i = find_offline_range(first_pfn);
+				if (i == _nr_offline_ranges || _offline_ranges[i].first > last_pfn) {
+					unlock_orders(0, MaxOrder - 1);
+					return false;
+				}
+			}
+
+			// Free pages that are held back from the free lists would look in use below.
+			drain_zeroed_pages_locked();
+			drain_huge_pages_locked();
+#if BUDDY_PAGE_COLOURING
+			drain_colour_lists_locked();
+#endif
+
+			// Detach every free block that overlaps the range, and tag its pages inside the
+			// range.  The parts of the blocks at either end that stick out of the range are
+			// given back once the range is done with.
+			PageDescriptor *isolated = (PageDescriptor *) COMPACTION_ISOLATED;
+			uint64_t first = first_pfn, last = last_pfn;
+
+			for (int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (int ord = 0; ord < MaxOrder; ord++) {
+					uint64_t from = first_pfn & ~(pages_per_block(ord) - 1);
+					PageDescriptor **slot = lower_bound(sys.mm().pgalloc().pfn_to_pgd(from), type, ord);
+
+					while (*slot) {
+						uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(*slot);
+						if (pfn >= last_pfn) {
+							break;
+						}
+
+						uint64_t block_end = pfn + pages_per_block(ord);
+						if (pfn < first) first = pfn;
+						if (block_end > last) last = block_end;
+
+						unlink_block(slot, ord);
+
+						for (uint64_t page = pfn > first_pfn ? pfn : first_pfn; page < block_end && page < last_pfn; page++) {
+							sys.mm().pgalloc().pfn_to_pgd(page)->next_free = isolated;
+						}
+					}
+				}
+			}
+
+			// Move each in-use page out of the range.
+			bool success = true;
+			for (uint64_t pfn = first_pfn; pfn < last_pfn; pfn++) {
+				PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(pfn);
+				if (pgd->next_free == isolated) {
+					continue;
+				}
+
+				PageDescriptor *target = NULL;
+				if (pgd->type != PageDescriptorType::RESERVED && pageblock_type(pgd) == MigrateType::MOVABLE && _relocate) {
+					target = alloc_block_locked(0, MigrateType::MOVABLE);
+				}
+
+				if (!target || !_relocate(pgd, target, _relocate_arg)) {
+					if (target) {
+						free_block(target, 0, true);
+					}
+
+					success = false;
+					break;
+				}
+
+				pgd->next_free = isolated;
+				_nr_pages_migrated++;
+			}
+
+			if (success) {
+				for (uint64_t pfn = first_pfn; pfn < last_pfn; pfn++) {
+					PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(pfn);
+					pgd->next_free = NULL;
+					pgd->type = PageDescriptorType::RESERVED;
+				}
+
+				// Memory taken off the top stops being managed.  A hole anywhere else is left
+				// in place, as none of its pages are ever free.
+				if (last_pfn == _base_pfn + _nr_pages) {
+					_nr_pages = first_pfn - _base_pfn;
+				} else {
+					add_offline_range_locked(first_pfn, last_pfn);
+				}
+
+				_nr_pages_offlined += nr_pages;
+				update_default_watermarks();
+			} else {
+				release_isolated_locked(first_pfn, last_pfn);
+			}
+
+			free_range_locked(first, first_pfn);
+			free_range_locked(last_pfn, last);
+
+			unlock_orders(0, MaxOrder - 1);
+			return success;
+		}
+
+		/**
+		 * Reserves a specific page, so that it cannot be allocated.
+		 * @param pgd The page descriptor of the page to reserve.
+		 * @return Returns TRUE if the reservation was successful, FALSE otherwise.
+		 */
+		bool reserve_page(PageDescriptor *pgd) override
+		{
+			assert(pgd);
+
+			if (!is_managed_block(pgd, 0)) {
+				return false;
+			}
+
+			// A reservation can split a block from any order.
+			lock_all_orders();
+
+			for (int current_order = 0; current_order < MaxOrder; current_order++) {
+				// Look for the free block in this order that contains the page.  It must be
+				// in the list for the class of the page's pageblock.
+				uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd) & ~(pages_per_block(current_order) - 1);
+				PageDescriptor *slot = sys.mm().pgalloc().pfn_to_pgd(pfn);
+
+				// If this order has no such block, try the next one up.
+				if (!is_free_block(slot, current_order)) {
+					continue;
+				}
+
+				// Split the block down to order 0, following the half that holds the page.
+				while (current_order != 0) {
+					slot = split_block(&slot, current_order);
+					current_order--;
+
+					PageDescriptor *buddy = buddy_of(slot, current_order);
+					if (pgd >= buddy)
+						slot = buddy;
+				}
+
+				// change the type of pgd to reserved, and remove it from order 0
+				pgd->type = PageDescriptorType::RESERVED;
+				remove_block(pgd, 0);
+
+				unlock_orders(0, MaxOrder - 1);
+				return true;
+			}
+
+			unlock_orders(0, MaxOrder - 1);
+			return false;
+		}
+
+		/**
+		 * Initialises the allocation algorithm.
+		 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+		 */
+		bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+		{
+			mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator Initialising pd=%p, nr=0x%lx", page_descriptors, nr_page_descriptors);
+
+			_base_pfn = sys.mm().pgalloc().pgd_to_pfn(page_descriptors);
+
+			// Only as much memory as there are pageblock slots for can be managed.
+			uint64_t max_pages = (BUDDY_MAX_PAGEBLOCKS - 1) * pages_per_block(PAGEBLOCK_ORDER);
+			if (nr_page_descriptors > max_pages) {
+				mm_log.messagef(LogLevel::ERROR, "Buddy Allocator can only manage 0x%lx pages", max_pages);
+				nr_page_descriptors = max_pages;
+			}
+
+			_nr_pages = nr_page_descriptors;
+			_nr_offline_ranges = 0;
+
+			// All memory starts out movable.  Pageblocks are taken over by the other
+			// classes as they are needed.
+			for (unsigned int i = 0; i < BUDDY_MAX_PAGEBLOCKS; i++) {
+				_pageblock_types[i] = MigrateType::MOVABLE;
+			}
+
+			// Carve the page descriptors into the largest blocks that both fit in what is
+			// left, and are correctly aligned for their order.
+			PageDescriptor *pgd = page_descriptors;
+			uint64_t remainder = nr_page_descriptors;
+
+			while (remainder > 0) {
+				int order = MaxOrder - 1;
+				while (order > 0 && (pages_per_block(order) > remainder || !is_correct_alignment_for_order(pgd, order))) {
+					order--;
+				}
+
+				insert_block(pgd, order);
+
+				pgd += pages_per_block(order);
+				remainder -= pages_per_block(order);
+			}
+
+			update_default_watermarks();
+			return true;
+		}
+
+		/**
+		 * Writes the allocator's state to a buffer, so that a warm restart can restore it
+		 * instead of calling init and reserving every page again.  The state is the class
+		 * of each pageblock, the free blocks of each list, the reserved pages, the holes
+		 * left by offline_pages, and the watermarks.  Everything is stored as runs, so memory that is mostly free or
+		 * mostly in use takes little space.  Pages held in the zeroed-page pool, the
+		 * huge-page pools and the colour lists go back to the free lists first.
+		 * @param buffer The buffer to write to, or NULL to find out how large it must be.
+		 * @param size The size of the buffer, in bytes.
+		 * @return Returns the number of bytes written (or needed), or 0 if the buffer is
+		 * too small.
+		 */
+		uint64_t snapshot(void *buffer, uint64_t size)
+		{
+			lock_all_orders();
+
+			drain_zeroed_pages_locked();
+			drain_huge_pages_locked();
+#if BUDDY_PAGE_COLOURING
+			drain_colour_lists_locked();
+#endif
+
+			SnapshotStream stream = { (uint8_t *) buffer, size, 0 };
+
+			stream.put(SNAPSHOT_MAGIC);
+			stream.put(_base_pfn);
+			stream.put(_nr_pages);
+			stream.put(_watermarks_set);
+			stream.put(_watermark_min);
+			stream.put(_watermark_low);
+			stream.put(_watermark_high);
+
+			// The class of each pageblock, as (length, class) runs.
+			uint64_t nr_pageblocks = nr_tracked_pageblocks();
+			for (uint64_t pb = 0; pb < nr_pageblocks; ) {
+				uint64_t run = 1;
+				while (pb + run < nr_pageblocks && _pageblock_types[pb + run] == _pageblock_types[pb]) {
+					run++;
+				}
+
+				stream.put(run);
+				stream.put(_pageblock_types[pb]);
+				pb += run;
+			}
+
+			// Each free list, as runs of adjacent blocks.  A run is stored as the gap since
+			// the previous run plus one, and its length, both in blocks of the list's order;
+			// a zero ends the list.
+			for (int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (int order = 0; order < MaxOrder; order++) {
+					uint64_t end = 0;
+					PageDescriptor *pgd = _free_areas[type][order];
+
+					while (pgd) {
+						uint64_t first = sys.mm().pgalloc().pgd_to_pfn(pgd) >> order;
+						uint64_t run = 0;
+
+						while (pgd && sys.mm().pgalloc().pgd_to_pfn(pgd) >> order == first + run) {
+							run++;
+							pgd = pgd->next_free;
+						}
+
+						stream.put(first - end + 1);
+						stream.put(run);
+						end = first + run;
+					}
+
+					stream.put(0);
+				}
+			}
+
+			// The reserved pages, as runs in the same form.
+			uint64_t end = _base_pfn;
+			for (uint64_t pfn = _base_pfn; pfn < _base_pfn + _nr_pages; ) {
+				if (sys.mm().pgalloc().pfn_to_pgd(pfn)->type != PageDescriptorType::RESERVED) {
+					pfn++;
+					continue;
+				}
+
+				uint64_t first = pfn;
+				while (pfn < _base_pfn + _nr_pages && sys.mm().pgalloc().pfn_to_pgd(pfn)->type == PageDescriptorType::RESERVED) {
+					pfn++;
+				}
+
+				stream.put(first - end + 1);
+				stream.put(pfn - first);
+				end = pfn;
+			}
+
+			stream.put(0);
+
+			// The holes left by offline_pages, which are among the reserved pages.
+			end = _base_pfn;
+			for (unsigned int i = 0; i < _nr_offline_ranges; i++) {
+				stream.put(_offline_ranges[i].first - end + 1);
+				stream.put(_offline_ranges[i].last - _offline_ranges[i].first);
+				end = _offline_ranges[i].last;
+			}
+
+			stream.put(0);
+
+			unlock_orders(0, MaxOrder - 1);
+
+			return buffer && stream.pos > size ? 0 : stream.pos;
+		}
+
+		/**
+		 * Initialises the allocation algorithm from a snapshot, in place of init.  The whole
+		 * snapshot is checked before anything is changed: the free lists and the reserved
+		 * pages are walked together in address order, and a snapshot in which any two of
+		 * them overlap is rejected.  The free lists (and their index) are then rebuilt by
+		 * appending each block in address order.  Every page is reset to available, and the
+		 * reserved pages are marked as such without going through reserve_page, so this
+		 * takes time in proportion to the number of pages.  The zeroed, colour and huge-page
+		 * pools start out empty.
+		 * @param page_descriptors The page descriptors that the snapshot was taken over.
+		 * @param nr_page_descriptors The number of page descriptors.
+		 * @param buffer The snapshot.
+		 * @param size The size of the snapshot, in bytes.
+		 * @return Returns TRUE if the state was restored, or FALSE if the snapshot is
+		 * malformed or was taken over different memory (in which case the allocator is
+		 * unchanged, and init must be used).
+		 */
+		bool restore(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors, const void *buffer, uint64_t size)
+		{
+			SnapshotStream stream = { (uint8_t *) buffer, size, 0 };
+			uint64_t magic, base_pfn, nr_pages, watermarks_set, watermark_min, watermark_low, watermark_high;
+
+			if (!stream.get(magic) || magic != SNAPSHOT_MAGIC || !stream.get(base_pfn) || !stream.get(nr_pages) ||
+				base_pfn != sys.mm().pgalloc().pgd_to_pfn(page_descriptors) || nr_pages > nr_page_descriptors) {
+				return false;
+			}
+
+			if (!stream.get(watermarks_set) || !stream.get(watermark_min) || !stream.get(watermark_low) || !stream.get(watermark_high) ||
+				watermarks_set > 1 || watermark_min > watermark_low || watermark_low > watermark_high) {
+				return false;
+			}
+
+			uint64_t nr_pageblocks = nr_tracked_pageblocks(base_pfn, nr_pages);
+			if (nr_pageblocks > BUDDY_MAX_PAGEBLOCKS) {
+				return false;
+			}
+
+			uint64_t pageblocks_pos = stream.pos;
+			for (uint64_t pb = 0; pb < nr_pageblocks; ) {
+				uint64_t run, type;
+				if (!stream.get(run) || !stream.get(type) || run == 0 || run > nr_pageblocks - pb || type >= MigrateType::NR_TYPES) {
+					return false;
+				}
+
+				pb += run;
+			}
+
+			// Open a reader on each free list, and one on the reserved pages after them.
+			uint64_t limit = base_pfn + nr_pages;
+			uint64_t lists_pos = stream.pos, reserved_pos = 0;
+			SnapshotRuns runs[NR_SNAPSHOT_LISTS + 1];
+
+			for (unsigned int list = 0; list <= NR_SNAPSHOT_LISTS; list++) {
+				int order = list < NR_SNAPSHOT_LISTS ? list % MaxOrder : 0;
+				runs[list] = { stream.pos, list < NR_SNAPSHOT_LISTS ? 0 : base_pfn, 0, 0 };
+				if (list == NR_SNAPSHOT_LISTS) {
+					reserved_pos = stream.pos;
+				}
+
+				SnapshotRuns skip = runs[list];
+				do {
+					if (!skip.next(stream, order, limit)) {
+						return false;
+					}
+				} while (skip.first != skip.last);
+
+				stream.pos = skip.pos;
+				runs[list].next(stream, order, limit);
+			}
+
+			uint64_t holes_pos = stream.pos;
+
+			// Walk every run in address order, checking that each starts past the end of the
+			// one before, and that the free blocks lie in pageblocks of their list's class.
+			// Only the lists that have runs left are searched for the next one.
+			SnapshotStream pageblocks = { stream.data, stream.size, pageblocks_pos };
+			uint64_t covered = base_pfn, pb_end = 0, pb_type = 0;
+			unsigned int active[NR_SNAPSHOT_LISTS + 1];
+			unsigned int nr_active = 0;
+
+			for (unsigned int list = 0; list <= NR_SNAPSHOT_LISTS; list++) {
+				if (runs[list].first != runs[list].last) {
+					active[nr_active++] = list;
+				}
+			}
+
+			while (nr_active > 0) {
+				unsigned int next = 0;
+				for (unsigned int i = 1; i < nr_active; i++) {
+					if (runs[active[i]].first < runs[active[next]].first) {
+						next = i;
+					}
+				}
+
+				unsigned int list = active[next];
+				SnapshotRuns& run = runs[list];
+				if (run.first < covered) {
+					return false;
+				}
+
+				if (list < NR_SNAPSHOT_LISTS) {
+					// Smaller blocks tile every pageblock that the run overlaps; a larger block
+					// takes its class from its first pageblock.
+					int order = list % MaxOrder;
+					uint64_t step = pages_per_block(order > PAGEBLOCK_ORDER ? order : PAGEBLOCK_ORDER);
+
+					for (uint64_t pfn = run.first; pfn < run.last; pfn = (pfn & ~(step - 1)) + step) {
+						uint64_t pb = (pfn >> PAGEBLOCK_ORDER) - (base_pfn >> PAGEBLOCK_ORDER);
+						while (pb >= pb_end) {
+							uint64_t length;
+							pageblocks.get(length);
+							pageblocks.get(pb_type);
+							pb_end += length;
+						}
+
+						if (pb_type != list / MaxOrder) {
+							return false;
+						}
+					}
+				}
+
+				covered = run.last;
+				if (!run.next(stream, list < NR_SNAPSHOT_LISTS ? list % MaxOrder : 0, limit)) {
+					return false;
+				}
+
+				if (run.first == run.last) {
+					active[next] = active[--nr_active];
+				}
+			}
+
+			// The holes must lie within the reserved pages, and apart, or online_pages could
+			// not merge them.
+			SnapshotRuns holes = { holes_pos, base_pfn, 0, 0 };
+			SnapshotRuns reserved = { reserved_pos, base_pfn, 0, 0 };
+			unsigned int nr_holes = 0;
+
+			reserved.next(stream, 0, limit);
+			for (;;) {
+				uint64_t previous = holes.last;
+				if (!holes.next(stream, 0, limit)) {
+					return false;
+				}
+
+				if (holes.first == holes.last) {
+					break;
+				}
+
+				if ((nr_holes > 0 && holes.first == previous) || nr_holes == BUDDY_MAX_OFFLINE_RANGES) {
+					return false;
+				}
+
+				while (reserved.first != reserved.last && reserved.last <= holes.first) {
+					reserved.next(stream, 0, limit);
+				}
+
+				if (reserved.first == reserved.last || reserved.first > holes.first || reserved.last < holes.last) {
+					return false;
+				}
+
+				nr_holes++;
+			}
+
+			// The snapshot is sound, so it can be applied without further checks.
+			lock_all_orders();
+
+			clear_free_lists();
+
+			_base_pfn = base_pfn;
+			_nr_pages = nr_pages;
+			_watermarks_set = watermarks_set;
+			_watermark_min = watermark_min;
+			_watermark_low = watermark_low;
+			_watermark_high = watermark_high;
+
+			pageblocks.pos = pageblocks_pos;
+			for (uint64_t pb = 0; pb < nr_pageblocks; ) {
+				uint64_t run, type;
+				pageblocks.get(run);
+				pageblocks.get(type);
+				memset(_pageblock_types + pb, type, run);
+				pb += run;
+			}
+
+			// Memory added later starts out movable, as it would after init.
+			memset(_pageblock_types + nr_pageblocks, MigrateType::MOVABLE, BUDDY_MAX_PAGEBLOCKS - nr_pageblocks);
+
+			// Blocks arrive in ascending order, so each is appended to every level of the
+			// index that insert_block would have linked it into, without a search.
+			SnapshotRuns blocks = { lists_pos, 0, 0, 0 };
+			for (int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (int order = 0; order < MaxOrder; order++) {
+					PageDescriptor **tails[BUDDY_INDEX_LEVELS];
+					for (int level = 0; level < BUDDY_INDEX_LEVELS; level++) {
+						tails[level] = index_next(NULL, type, order, level);
+					}
+
+					blocks.end = 0;
+					for (blocks.next(stream, order, limit); blocks.first != blocks.last; blocks.next(stream, order, limit)) {
+						for (uint64_t pfn = blocks.first; pfn < blocks.last; pfn += pages_per_block(order)) {
+							PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(pfn);
+
+							int height = Policy::INDEXED_FREE_LISTS && __atomic_load_n(&_index_links_safe, __ATOMIC_RELAXED) ? index_height(pgd) : 1;
+							for (int level = 0; level < height; level++) {
+								*tails[level] = pgd;
+								tails[level] = index_next(pgd, type, order, level);
+							}
+
+							__atomic_add_fetch(&_nr_free_blocks[order], 1, __ATOMIC_RELAXED);
+						}
+					}
+
+					for (int level = 0; level < BUDDY_INDEX_LEVELS; level++) {
+						*tails[level] = NULL;
+					}
+				}
+			}
+
+			// Whatever the descriptors said before, only the snapshot's reserved pages are
+			// reserved now.
+			for (uint64_t pfn = base_pfn; pfn < limit; pfn++) {
+				sys.mm().pgalloc().pfn_to_pgd(pfn)->type = PageDescriptorType::AVAILABLE;
+			}
+
+			reserved = { reserved_pos, base_pfn, 0, 0 };
+			for (reserved.next(stream, 0, limit); reserved.first != reserved.last; reserved.next(stream, 0, limit)) {
+				for (uint64_t pfn = reserved.first; pfn < reserved.last; pfn++) {
+					sys.mm().pgalloc().pfn_to_pgd(pfn)->type = PageDescriptorType::RESERVED;
+				}
+			}
+
+			holes = { holes_pos, base_pfn, 0, 0 };
+			_nr_offline_ranges = 0;
+			for (holes.next(stream, 0, limit); holes.first != holes.last; holes.next(stream, 0, limit)) {
+				_offline_ranges[_nr_offline_ranges].first = holes.first;
+				_offline_ranges[_nr_offline_ranges].last = holes.last;
+				_nr_offline_ranges++;
+			}
+
+			unlock_orders(0, MaxOrder - 1);
+			return true;
+		}
+
+		/**
+		 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+		 */
+		const char* name() const override { return "buddy"; }
+
+		/**
+		 * Dumps out the current state of the buddy system
+		 */
+		void dump_state() const override
+		{
+			static const char *type_names[MigrateType::NR_TYPES] = { "U", "R", "M" };
+
+			// Print out a header, so we can find the output in the logs.
+			mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE: free=%lu (min=%lu low=%lu high=%lu) fallbacks=%lu claimed-pageblocks=%lu zeroed=%lu",
+				nr_free_pages(), _watermark_min, _watermark_low, _watermark_high, _nr_fallbacks, _nr_pageblocks_claimed, _nr_zeroed_pages);
+
+			// Iterate over each free area.
+			for (unsigned int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (unsigned int i = 0; i < MaxOrder; i++) {
+					char buffer[256];
+					snprintf(buffer, sizeof(buffer), "[%s%d] ", type_names[type], i);
+
+					// Iterate over each block in the free area.
+					PageDescriptor *pg = _free_areas[type][i];
+					while (pg) {
+						// Append the PFN of the free block to the output buffer.
+						snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
+						pg = pg->next_free;
+					}
+
+					mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+				}
+			}
+		}
+
+		/**
+		 * Registers the callback used to move in-use movable pages during compaction.
+		 * Compaction is disabled until a callback is registered.
+		 * @param relocate The callback, or NULL to disable compaction.
+		 * @param arg An argument passed through to the callback.
+		 */
+		void set_relocator(RelocatePageFn relocate, void *arg)
+		{
+			lock_all_orders();
+			_relocate = relocate;
+			_relocate_arg = arg;
+			unlock_orders(0, MaxOrder - 1);
+		}
+
+		/**
+		 * Compacts memory to create a free block of the given order.  Allocation failures
+		 * do this synchronously; this entry point lets a background thread do it ahead of
+		 * time.
+		 * @param order The order of the block to create.
+		 * @return Returns TRUE if a block of the order is free, FALSE otherwise.
+		 */
+		bool compact(int order)
+		{
+			lock_all_orders();
+
+			// There is nothing to do if a large enough block is free already.
+			bool success = false;
+			for (int ord = order > 0 ? order : 0; ord < MaxOrder && !success; ord++) {
+				success = _nr_free_blocks[ord] > 0;
+			}
+
+			if (!success) {
+				success = compact_locked(order);
+			}
+
+			unlock_orders(0, MaxOrder - 1);
+
+			return success;
+		}
+
+		/**
+		 * Tops up the pool of pre-zeroed pages that serves AllocFlags::ZERO allocations.
+		 * This is meant to be called when the CPU would otherwise be idle, so it clears a
+		 * bounded number of pages per call, and none of them under a lock.
+		 * @param max_pages The most pages to clear in this call.
+		 * @return Returns the number of pages added to the pool.
+		 */
+		unsigned int refill_zeroed_pages(unsigned int max_pages)
+		{
+			unsigned int nr_added = 0;
+
+			while (nr_added < max_pages) {
+				lock_order(0);
+				bool full = _nr_zeroed_pages >= BUDDY_ZEROED_POOL_TARGET;
+				unlock_orders(0, 0);
+
+				// Pages for the pool are not worth taking from memory that is running low.
+				if (full || nr_free_pages() < _watermark_high) {
+					break;
+				}
+
+				PageDescriptor *pgd = try_alloc_pages(0, AllocFlags::MOVABLE);
+				if (!pgd) {
+					break;
+				}
+
+				clear_page_nt(sys.mm().pgalloc().pgd_to_vpa(pgd));
+
+				lock_order(0);
+				pgd->next_free = _zeroed_pages;
+				_zeroed_pages = pgd;
+				_nr_zeroed_pages++;
+				unlock_orders(0, 0);
+
+				nr_added++;
+			}
+
+			return nr_added;
+		}
+
+		/**
+		 * Returns the number of pages in the zeroed-page pool, the number of zeroed
+		 * allocations it has served, and the number that had to be zeroed on demand.
+		 */
+		uint64_t nr_zeroed_pages() const { return _nr_zeroed_pages; }
+		uint64_t nr_zeroed_served() const { return _nr_zeroed_served; }
+		uint64_t nr_zeroed_on_demand() const { return _nr_zeroed_on_demand; }
+
+		/**
+		 * Returns the number of pages in the huge-page pool of the given order, and the
+		 * number of huge page allocations that the pool served, that were allocated from
+		 * free memory instead, and that failed.
+		 */
+		uint64_t nr_huge_pages(int order) const { return huge_pool_of(order) < 0 ? 0 : _nr_huge_pages[huge_pool_of(order)]; }
+		uint64_t nr_huge_hits(int order) const { return huge_pool_of(order) < 0 ? 0 : _nr_huge_hits[huge_pool_of(order)]; }
+		uint64_t nr_huge_misses(int order) const { return huge_pool_of(order) < 0 ? 0 : _nr_huge_misses[huge_pool_of(order)]; }
+		uint64_t nr_huge_failures(int order) const { return huge_pool_of(order) < 0 ? 0 : _nr_huge_failures[huge_pool_of(order)]; }
+
+#if BUDDY_PAGE_COLOURING
+		/**
+		 * Returns the number of pages of the given colour handed out from the colour lists.
+		 */
+		uint64_t nr_colour_served(unsigned int colour) const { return _nr_colour_served[colour & (BUDDY_NR_COLOURS - 1)]; }
+#endif
+
+		/**
+		 * Returns the number of allocations that had to fall back to another mobility class.
+		 */
+		uint64_t nr_fallbacks() const { return _nr_fallbacks; }
+
+		/**
+		 * Returns the number of pageblocks that have changed mobility class.
+		 */
+		uint64_t nr_pageblocks_claimed() const { return _nr_pageblocks_claimed; }
+
+		/**
+		 * Returns the number of successful and failed compactions, and of pages moved.
+		 */
+		uint64_t nr_compactions() const { return _nr_compactions; }
+		uint64_t nr_compaction_failures() const { return _nr_compaction_failures; }
+		uint64_t nr_pages_migrated() const { return _nr_pages_migrated; }
+
+		/**
+		 * Returns the number of lazy coalescing passes, and of merges they performed.
+		 */
+		uint64_t nr_coalesce_passes() const { return _nr_coalesce_passes; }
+		uint64_t nr_lazy_merges() const { return _nr_lazy_merges; }
+
+		/**
+		 * Returns the number of pages that have been added and removed while running.
+		 */
+		uint64_t nr_pages_onlined() const { return _nr_pages_onlined; }
+		uint64_t nr_pages_offlined() const { return _nr_pages_offlined; }
+
+		/**
+		 * Returns the number of reclaim passes, the pages the shrinkers freed in them, and
+		 * the number of allocations that failed even after reclaim.
+		 */
+		uint64_t nr_reclaim_passes() const { return _nr_reclaim_passes; }
+		uint64_t nr_pages_reclaimed() const { return _nr_pages_reclaimed; }
+		uint64_t nr_alloc_failures() const { return _nr_alloc_failures; }
+
+#if BUDDY_INSTRUMENTATION
+		/**
+		 * The allocator's hot-path counters, as returned by read_stats.  The histograms
+		 * are indexed by order and then by bucket (see BUDDY_STATS_BUCKETS); the depth
+		 * counts by order and then by the number of splits or merges.  The cycle
+		 * histograms only count the sampled calls.
+		 */
+		struct Stats {
+			uint64_t alloc_cycles[MaxOrder][BUDDY_STATS_BUCKETS];
+			uint64_t free_cycles[MaxOrder][BUDDY_STATS_BUCKETS];
+			uint64_t split_depths[MaxOrder][MaxOrder];
+			uint64_t merge_depths[MaxOrder][MaxOrder];
+			uint64_t walk_lengths[MaxOrder][BUDDY_STATS_BUCKETS];
+		};
+
+		/**
+		 * Copies out every counter, summing the per-CPU copies.  No locks are taken, so
+		 * operations running at the same time may or may not be included.
+		 * @param stats Receives the counters.
+		 */
+		void read_stats(Stats& stats) const
+		{
+			memset(&stats, 0, sizeof(stats));
+
+			for (unsigned int cpu = 0; cpu < BUDDY_STATS_NR_CPUS; cpu++) {
+				const CpuStats& counters = _cpu_stats[cpu];
+
+				for (unsigned int order = 0; order < MaxOrder; order++) {
+					for (unsigned int bucket = 0; bucket < BUDDY_STATS_BUCKETS; bucket++) {
+						stats.alloc_cycles[order][bucket] += counters.alloc_cycles[order][bucket];
+						stats.free_cycles[order][bucket] += counters.free_cycles[order][bucket];
+						stats.walk_lengths[order][bucket] += counters.walk_lengths[order][bucket];
+					}
+
+					for (unsigned int depth = 0; depth < MaxOrder; depth++) {
+						stats.split_depths[order][depth] += counters.split_depths[order][depth];
+						stats.merge_depths[order][depth] += counters.merge_depths[order][depth];
+					}
+				}
+			}
+		}
+
+		/**
+		 * Zeroes every counter, e.g. before measuring a workload.  Counts made by operations
+		 * running at the same time may survive.
+		 */
+		void reset_stats()
+		{
+			memset(_cpu_stats, 0, sizeof(_cpu_stats));
+		}
+#endif
+
+	private:
+		/**
+		 * A buffer that a snapshot is written to or read from, as a sequence of unsigned
+		 * LEB128 numbers.  Writing past the end only counts the bytes that would have been
+		 * written, so a NULL buffer can be used to size a snapshot.
+		 */
+		struct SnapshotStream {
+			uint8_t *data;
+			uint64_t size, pos;
+
+			void put(uint64_t value)
+			{
+				do {
+					uint8_t byte = value & 0x7f;
+					value >>= 7;
+					if (value) byte |= 0x80;
+
+					if (data && pos < size) data[pos] = byte;
+					pos++;
+				} while (value);
+			}
+
+			bool get(uint64_t& value)
+			{
+				value = 0;
+				for (int shift = 0; shift < 64; shift += 7) {
+					if (pos >= size) {
+						return false;
+					}
+
+					uint8_t byte = data[pos++];
+					value |= (uint64_t) (byte & 0x7f) << shift;
+
+					if (!(byte & 0x80)) {
+						return true;
+					}
+				}
+
+				return false;
+			}
+		};
+
+		/**
+		 * Reads one list of runs from a snapshot: a free list, the reserved pages or the
+		 * holes.  Each run is stored as the gap since the previous run plus one, and its
+		 * length, both in blocks of the list's order; a zero ends the list.
+		 */
+		struct SnapshotRuns {
+			uint64_t pos;			// The position of the next run in the snapshot.
+			uint64_t end;			// The block one past the previous run.
+			uint64_t first, last;	// The PFNs of the current run, which are equal at the end of the list.
+
+			/**
+			 * Moves to the next run of the list, which must end at or below the given PFN.
+			 * @param snapshot The snapshot.
+			 * @param order The order of the blocks in the list.
+			 * @param limit The PFN one past the last page that a run may cover.
+			 * @return Returns FALSE if the run is malformed, or runs past the limit.
+			 */
+			bool next(const SnapshotStream& snapshot, int order, uint64_t limit)
+			{
+				SnapshotStream stream = { snapshot.data, snapshot.size, pos };
+				uint64_t gap, run, limit_block = limit >> order;
+
+				if (!stream.get(gap)) {
+					return false;
+				}
+
+				if (gap == 0) {
+					first = last = end << order;
+				} else {
+					if (!stream.get(run) || run == 0 || gap - 1 > limit_block - end || run > limit_block - end - (gap - 1)) {
+						return false;
+					}
+
+					first = (end + gap - 1) << order;
+					end += gap - 1 + run;
+					last = end << order;
+				}
+
+				pos = stream.pos;
+				return true;
+			}
+		};
+
+		// The number of free lists in a snapshot.
+		static const unsigned int NR_SNAPSHOT_LISTS = MigrateType::NR_TYPES * MaxOrder;
+
+		// Identifies a snapshot, and the version of its format.
+		static const uint64_t SNAPSHOT_MAGIC = 0x3270616e53796442;
+
+		/**
+		 * Returns the number of pageblocks that the managed memory overlaps.
+		 */
+		uint64_t nr_tracked_pageblocks() const
+		{
+			return nr_tracked_pageblocks(_base_pfn, _nr_pages);
+		}
+
+		/**
+		 * Returns the number of pageblocks that the given range of pages overlaps.
+		 */
+		static uint64_t nr_tracked_pageblocks(uint64_t base_pfn, uint64_t nr_pages)
+		{
+			if (nr_pages == 0) {
+				return 0;
+			}
+
+			return ((base_pfn + nr_pages - 1) >> PAGEBLOCK_ORDER) - (base_pfn >> PAGEBLOCK_ORDER) + 1;
+		}
+
+		/**
+		 * Empties every free list, and the pools of free pages kept off them, without
+		 * touching the blocks that were on them.
+		 */
+		void clear_free_lists()
+		{
+			_zeroed_pages = NULL;
+			_nr_zeroed_pages = 0;
+
+			for (unsigned int pool = 0; pool < 2; pool++) {
+				_huge_pages[pool] = NULL;
+				_nr_huge_pages[pool] = 0;
+			}
+
+#if BUDDY_PAGE_COLOURING
+			for (unsigned int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (unsigned int colour = 0; colour < BUDDY_NR_COLOURS; colour++) {
+					_colour_lists[type][colour] = NULL;
+					_nr_colour_pages[type][colour] = 0;
+				}
+			}
+
+			_nr_coloured_pages = 0;
+#endif
+
+			for (unsigned int type = 0; type < MigrateType::NR_TYPES; type++) {
+				for (unsigned int i = 0; i < MaxOrder; i++) {
+					_free_areas[type][i] = NULL;
+
+					for (unsigned int level = 0; level < BUDDY_INDEX_LEVELS - 1; level++) {
+						_index_heads[type][i][level] = NULL;
+					}
+				}
+			}
+
+			for (unsigned int i = 0; i < MaxOrder; i++) {
+				__atomic_store_n(&_nr_free_blocks[i], 0, __ATOMIC_RELAXED);
+				_nr_deferred_frees[i] = 0;
+			}
+		}
+
+		/**
+		 * Scales the watermarks to the amount of memory managed, unless they have been set
+		 * explicitly.
+		 */
+		void update_default_watermarks()
+		{
+			if (_watermarks_set) {
+				return;
+			}
+
+			uint64_t nr_managed = _nr_pages - _nr_pages_offlined;
+
+			_watermark_min = nr_managed / BUDDY_WATERMARK_MIN_RATIO;
+			_watermark_low = _watermark_min * 5 / 4;
+			_watermark_high = _watermark_min * 3 / 2;
+		}
+
+		/**
+		 * Returns the mobility class requested by a set of allocation flags.
+		 */
+		static MigrateType::MigrateType migrate_type_of(unsigned int flags)
+		{
+			if (flags & AllocFlags::MOVABLE) return MigrateType::MOVABLE;
+			if (flags & AllocFlags::RECLAIMABLE) return MigrateType::RECLAIMABLE;
+			return MigrateType::UNMOVABLE;
+		}
+
+		PageDescriptor *_free_areas[MigrateType::NR_TYPES][MaxOrder];
+
+		// The heads of the upper levels of each free list's skip list.
+		PageDescriptor *_index_heads[MigrateType::NR_TYPES][MaxOrder][BUDDY_INDEX_LEVELS - 1];
+		bool _index_links_safe;
+
+		uint64_t _base_pfn, _nr_pages;
+		uint8_t _pageblock_types[BUDDY_MAX_PAGEBLOCKS];
+
+		uint64_t _nr_fallbacks, _nr_pageblocks_claimed;
+
+		// Returned by find_contig_range when there is no suitable range.
+		static const uint64_t CONTIG_NOT_FOUND = ~(uint64_t) 0;
+
+		// Passed as the hint by allocations that do not need to be near any page.
+		static const uint64_t NO_PFN_HINT = ~(uint64_t) 0;
+
+		// Free pages are tagged with this while compaction has them isolated.
+		static const uintptr_t COMPACTION_ISOLATED = ~(uintptr_t) 0;
+
+		RelocatePageFn _relocate;
+		void *_relocate_arg;
+		uint64_t _nr_compactions, _nr_compaction_failures, _nr_pages_migrated;
+
+		// The number of frees in each order since it was last coalesced, less the
+		// allocations served from that order in the meantime.
+		unsigned int _nr_deferred_frees[MaxOrder];
+		uint64_t _nr_coalesce_passes, _nr_lazy_merges;
+
+		// Free order-0 pages that have already been cleared.  They are kept off the free
+		// lists, and are protected by the order-0 lock.
+		PageDescriptor *_zeroed_pages;
+		uint64_t _nr_zeroed_pages, _nr_zeroed_served, _nr_zeroed_on_demand;
+
+		// The huge-page pools, for BUDDY_HUGE_ORDER and BUDDY_GIGANTIC_ORDER pages.  The
+		// lock is never held while taking an order lock, but may be taken under them.
+		Spinlock _huge_lock;
+		PageDescriptor *_huge_pages[2];
+		uint64_t _nr_huge_pages[2], _huge_pool_target[2];
+		uint64_t _nr_huge_hits[2], _nr_huge_misses[2], _nr_huge_failures[2];
+
+		uint64_t _nr_near_exact;
+		uint64_t _nr_pages_onlined, _nr_pages_offlined;
+
+		// The holes left by offline_pages, in address order and never touching, as
+		// [first, last) PFNs.  Protected by the order locks.
+		struct OfflineRange {
+			uint64_t first, last;
+		};
+
+		OfflineRange _offline_ranges[BUDDY_MAX_OFFLINE_RANGES];
+		unsigned int _nr_offline_ranges;
+
+		// The number of blocks on the free lists of each order, protected by that order's lock.
+		uint64_t _nr_free_blocks[MaxOrder];
+
+		uint64_t _watermark_min, _watermark_low, _watermark_high;
+		bool _watermarks_set;
+
+		struct Shrinker {
+			ShrinkFn shrink;
+			void *arg;
+		};
+
+		Spinlock _shrinker_lock;
+		Shrinker _shrinkers[BUDDY_MAX_SHRINKERS];
+		unsigned int _nr_shrinkers;
+		bool _reclaiming;
+		uint64_t _nr_reclaim_passes, _nr_pages_reclaimed, _nr_alloc_failures;
+
+#if BUDDY_PAGE_COLOURING
+		// The order of the block that holds exactly one page of every colour.
+		static const int COLOUR_BLOCK_ORDER = __builtin_ctz(BUDDY_NR_COLOURS);
+
+		// Free order-0 pages, sorted by class and colour, and protected by the order-0 lock.
+		PageDescriptor *_colour_lists[MigrateType::NR_TYPES][BUDDY_NR_COLOURS];
+		unsigned int _nr_colour_pages[MigrateType::NR_TYPES][BUDDY_NR_COLOURS];
+		uint64_t _nr_coloured_pages;
+		uint64_t _nr_colour_served[BUDDY_NR_COLOURS];
+		unsigned int _next_colour;
+#endif
+
+#if BUDDY_INSTRUMENTATION
+		// The counters of one CPU, on cache lines of their own, and only written by that CPU.
+		struct CpuStats {
+			uint64_t tick;
+			uint64_t alloc_cycles[MaxOrder][BUDDY_STATS_BUCKETS];
+			uint64_t free_cycles[MaxOrder][BUDDY_STATS_BUCKETS];
+			uint64_t split_depths[MaxOrder][MaxOrder];
+			uint64_t merge_depths[MaxOrder][MaxOrder];
+			uint64_t walk_lengths[MaxOrder][BUDDY_STATS_BUCKETS];
+		} __attribute__((aligned(64)));
+
+		/**
+		 * Returns the counters of the calling CPU.  CPUs numbered beyond
+		 * BUDDY_STATS_NR_CPUS share counters with lower-numbered ones, and may then lose a
+		 * count now and then.
+		 */
+		CpuStats& this_cpu_stats()
+		{
+			return _cpu_stats[current_cpu_id() % BUDDY_STATS_NR_CPUS];
+		}
+
+		CpuStats _cpu_stats[BUDDY_STATS_NR_CPUS];
+#endif
+
+#if BUDDY_FINE_GRAINED_LOCKING
+		mutable Spinlock _order_locks[MaxOrder];
+#endif
+	};
+
+	/**
+	 * The buddy allocator the kernel uses, built with the default configuration.
+	 */
+	typedef BasicBuddyPageAllocator<> BuddyPageAllocator;
+
+	/**
+	 * A page allocation algorithm that splits memory into zones, each managed by its
+	 * own buddy allocator, so that memory only some callers can use (e.g. DMA-capable
+	 * low memory) is not used up by callers that could have been served elsewhere.
+	 */
+	class ZonedBuddyAllocator : public PageAllocatorAlgorithm
+	{
+	public:
+		/**
+		 * Constructs a new instance of the Zoned Buddy Page Allocator.
+		 */
+		ZonedBuddyAllocator()
+		{
+			for (unsigned int zone = 0; zone < Zone::NR_ZONES; zone++) {
+				_zone_start_pfn[zone] = 0;
+				_zone_nr_pages[zone] = 0;
+				_zone_watermarks[zone] = 0;
+				_nr_zone_allocs[zone] = 0;
+				_nr_zone_fallbacks[zone] = 0;
+				_nr_watermark_refusals[zone] = 0;
+			}
+		}
+
+		/**
+		 * Allocates 2^order number of contiguous, unmovable pages from the normal zone
+		 * (or below).  Like the buddy allocator's, this calls the shrinkers when memory
+		 * runs low, so callers that hold a spinlock must pass ATOMIC to alloc_pages(order,
+		 * flags) instead.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+		 * allocation failed.
+		 */
+		PageDescriptor *alloc_pages(int order) override
+		{
+			return alloc_pages(order, AllocFlags::UNMOVABLE);
+		}
+
+		/**
+		 * Allocates 2^order number of contiguous pages.  The zone the flags ask for is
+		 * tried first, then each zone below it, as long as that leaves the lower zone
+		 * with at least its watermark of free pages.
+		 * @param order The power of two, of the number of contiguous pages to allocate.
+		 * @param flags The AllocFlags for the allocation, which give its zone, its mobility
+		 * class, and whether the pages must be zeroed.
+		 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+		 * allocation failed.
+		 */
+		PageDescriptor *alloc_pages(int order, unsigned int flags)
+		{
+			if (order < 0 || order >= MAX_ORDER) {
+				return NULL;
+			}
+
+			int preferred = zone_of_flags(flags);
+			uint64_t nr_pages = (uint64_t) 1 << order;
+
+			for (int zone = preferred; zone >= 0; zone--) {
+				if (_zone_nr_pages[zone] == 0) {
+					continue;
+				}
+
+				// The zone's free count is read without its locks, so fallbacks that race each
+				// other can take a zone slightly below its watermark.  It is a soft limit.
+				if (zone != preferred && _zones[zone].nr_free_pages() < _zone_watermarks[zone] + nr_pages) {
+					__atomic_add_fetch(&_nr_watermark_refusals[zone], 1, __ATOMIC_RELAXED);
+					continue;
+				}
+
+				PageDescriptor *pgd = _zones[zone].alloc_pages(order, flags & ~(AllocFlags::DMA | AllocFlags::HIGH));
+				if (pgd) {
+					__atomic_add_fetch(&_nr_zone_allocs[zone], 1, __ATOMIC_RELAXED);
+					if (zone != preferred) {
+						__atomic_add_fetch(&_nr_zone_fallbacks[zone], 1, __ATOMIC_RELAXED);
+					}
+
+					return pgd;
+				}
+			}
+
+			return NULL;
+		}
+
+		/**
+		 * Frees 2^order contiguous pages, back to the zone they came from.
+		 * @param pgd A pointer to an array of page descriptors to be freed.
+		 * @param order The power of two number of contiguous pages to free.
+		 */
+		void free_pages(PageDescriptor *pgd, int order) override
+		{
+			if (order < 0 || order >= MAX_ORDER) {
+				return;
+			}
+
+			_zones[zone_of_page(pgd)].free_pages(pgd, order);
+		}
+
+		/**
+		 * Reserves a specific page, so that it cannot be allocated.
+		 * @param pgd The page descriptor of the page to reserve.
+		 * @return Returns TRUE if the reservation was successful, FALSE otherwise.
+		 */
+		bool reserve_page(PageDescriptor *pgd) override
+		{
+			assert(pgd);
+
+			return _zones[zone_of_page(pgd)].reserve_page(pgd);
+		}
+
+		/**
+		 * Initialises the allocation algorithm, giving each zone the part of the page
+		 * descriptors that falls within it.
+		 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+		 */
+		bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+		{
+			uint64_t first_pfn = sys.mm().pgalloc().pgd_to_pfn(page_descriptors);
+			uint64_t end_pfn = first_pfn + nr_page_descriptors;
+
+			for (unsigned int zone = 0; zone < Zone::NR_ZONES; zone++) {
+				uint64_t start, end;
+				if (!clip_to_zone(zone, first_pfn, end_pfn, start, end)) {
+					continue;
+				}
+
+				if (!_zones[zone].init(sys.mm().pgalloc().pfn_to_pgd(start), end - start)) {
+					return false;
+				}
+
+				_zone_start_pfn[zone] = start;
+				_zone_nr_pages[zone] = end - start;
+				_zone_watermarks[zone] = (end - start) / BUDDY_ZONE_RESERVE_RATIO;
+
+				mm_log.messagef(LogLevel::DEBUG, "Buddy Zone %s: pfn=0x%lx, nr=0x%lx", zone_name(zone), start, end - start);
+			}
+
+			return true;
+		}
+
+		/**
+		 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+		 */
+		const char* name() const override { return "buddy-zoned"; }
+
+		/**
+		 * Dumps out the current state of each zone.
+		 */
+		void dump_state() const override
+		{
+			for (unsigned int zone = 0; zone < Zone::NR_ZONES; zone++) {
+				if (_zone_nr_pages[zone] == 0) {
+					continue;
+				}
+
+				mm_log.messagef(LogLevel::DEBUG, "ZONE %s: free=%lu/%lu watermark=%lu fallbacks=%lu refusals=%lu", zone_name(zone),
+					_zones[zone].nr_free_pages(), _zone_nr_pages[zone], _zone_watermarks[zone], _nr_zone_fallbacks[zone], _nr_watermark_refusals[zone]);
+				_zones[zone].dump_state();
+			}
+		}
+
+		/**
+		 * Adds a range of pages while running, giving each zone the part of the range that
+		 * falls within it.  The zones' watermarks grow in proportion.
+		 * @param first_pfn The PFN of the first page to add.
+		 * @param nr_pages The number of pages to add.
+		 * @return Returns TRUE if the pages were added, or FALSE otherwise.
+		 */
+		bool online_pages(uint64_t first_pfn, uint64_t nr_pages)
+		{
+			for (unsigned int zone = 0; zone < Zone::NR_ZONES; zone++) {
+				uint64_t start, end;
+				if (!clip_to_zone(zone, first_pfn, first_pfn + nr_pages, start, end)) {
+					continue;
+				}
+
+				if (!_zones[zone].online_pages(start, end - start)) {
+					return false;
+				}
+
+				if (_zone_nr_pages[zone] == 0 || start < _zone_start_pfn[zone]) {
+					_zone_start_pfn[zone] = start;
+				}
+
+				_zone_nr_pages[zone] += end - start;
+				_zone_watermarks[zone] += (end - start) / BUDDY_ZONE_RESERVE_RATIO;
+			}
+
+			return true;
+		}
+
+		/**
+		 * Takes a range of pages out while running.  The range must lie within one zone,
+		 * as its in-use pages can only be moved elsewhere in that zone.
+		 * @param first_pfn The PFN of the first page to remove.
+		 * @param nr_pages The number of pages to remove.
+		 * @return Returns TRUE if the range is now offline, or FALSE otherwise.
+		 */
+		bool offline_pages(uint64_t first_pfn, uint64_t nr_pages)
+		{
+			if (nr_pages == 0) {
+				return false;
+			}
+
+			int zone = zone_of_page(sys.mm().pgalloc().pfn_to_pgd(first_pfn));
+
+			uint64_t start, end;
+			if (!clip_to_zone(zone, first_pfn, first_pfn + nr_pages, start, end) || end - start != nr_pages) {
+				return false;
+			}
+
+			if (!_zones[zone].offline_pages(first_pfn, nr_pages)) {
+				return false;
+			}
+
+			uint64_t watermark_cut = nr_pages / BUDDY_ZONE_RESERVE_RATIO;
+
+			_zone_nr_pages[zone] -= nr_pages;
+			_zone_watermarks[zone] -= watermark_cut < _zone_watermarks[zone] ? watermark_cut : _zone_watermarks[zone];
+
+			return true;
+		}
+
+		/**
+		 * Registers a shrinker with every zone, so that it is asked for memory whichever
+		 * zone runs low.
+		 * @param shrink The callback.
+		 * @param arg An argument passed through to the callback.
+		 * @return Returns TRUE if the callback was registered with every zone, FALSE otherwise.
+		 */
+		bool register_shrinker(ShrinkFn shrink, void *arg)
+		{
+			for (unsigned int zone = 0; zone < Zone::NR_ZONES; zone++) {
+				if (!_zones[zone].register_shrinker(shrink, arg)) {
+					unregister_shrinker(shrink, arg);
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		/**
+		 * Unregisters a shrinker from every zone.
+		 * @param shrink The callback.
+		 * @param arg The argument it was registered with.
+		 */
+		void unregister_shrinker(ShrinkFn shrink, void *arg)
+		{
+			for (unsigned int zone = 0; zone < Zone::NR_ZONES; zone++) {
+				_zones[zone].unregister_shrinker(shrink, arg);
+			}
+		}
+
+		/**
+		 * Sets the number of pages a zone keeps free for allocations that asked for it.
+		 * @param zone The zone.
+		 * @param nr_pages The watermark, in pages.
+		 */
+		void set_zone_watermark(Zone::Zone zone, uint64_t nr_pages)
+		{
+			_zone_watermarks[zone] = nr_pages;
+		}
+
+		/**
+		 * Returns the buddy allocator of a zone, for the operations that only make sense
+		 * within one zone (e.g. contiguous ranges, compaction, and the zeroed-page pool).
+		 */
+		BuddyPageAllocator& zone(Zone::Zone zone) { return _zones[zone]; }
+
+		/**
+		 * Returns the size of a zone, and the number of its pages that are free.
+		 */
+		uint64_t zone_nr_pages(Zone::Zone zone) const { return _zone_nr_pages[zone]; }
+		uint64_t zone_nr_free(Zone::Zone zone) const { return _zones[zone].nr_free_pages(); }
+
+		/**
+		 * Returns the number of allocations a zone has served, the number of those that
+		 * had asked for a higher zone, and the number it turned away at its watermark.
+		 */
+		uint64_t nr_zone_allocs(Zone::Zone zone) const { return _nr_zone_allocs[zone]; }
+		uint64_t nr_zone_fallbacks(Zone::Zone zone) const { return _nr_zone_fallbacks[zone]; }
+		uint64_t nr_watermark_refusals(Zone::Zone zone) const { return _nr_watermark_refusals[zone]; }
+
+	private:
+		/**
+		 * Returns the highest zone a set of allocation flags allows.
+		 */
+		static Zone::Zone zone_of_flags(unsigned int flags)
+		{
+			if (flags & AllocFlags::DMA) return Zone::DMA;
+			if (flags & AllocFlags::HIGH) return Zone::HIGH;
+			return Zone::NORMAL;
+		}
+
+		/**
+		 * Returns the zone that contains the given page.
+		 */
+		int zone_of_page(const PageDescriptor *pgd) const
+		{
+			uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+
+			int zone = Zone::NR_ZONES - 1;
+			while (zone > 0 && (_zone_nr_pages[zone] == 0 || pfn < _zone_start_pfn[zone])) {
+				zone--;
+			}
+
+			return zone;
+		}
+
+		/**
+		 * Clips a PFN range to the bounds of a zone.
+		 * @param zone The zone.
+		 * @param first_pfn The first PFN of the range.
+		 * @param last_pfn The PFN one past the end of the range.
+		 * @param start Set to the first PFN of the part of the range in the zone.
+		 * @param end Set to the PFN one past the end of that part.
+		 * @return Returns TRUE if any of the range is in the zone, FALSE otherwise.
+		 */
+		static bool clip_to_zone(unsigned int zone, uint64_t first_pfn, uint64_t last_pfn, uint64_t& start, uint64_t& end)
+		{
+			static const uint64_t zone_ends[Zone::NR_ZONES] = { BUDDY_ZONE_DMA_END_PFN, BUDDY_ZONE_NORMAL_END_PFN, ~(uint64_t) 0 };
+
+			uint64_t zone_start = zone > 0 ? zone_ends[zone - 1] : 0;
+
+			start = first_pfn > zone_start ? first_pfn : zone_start;
+			end = last_pfn < zone_ends[zone] ? last_pfn : zone_ends[zone];
+
+			return start < end;
+		}
+
+		static const char *zone_name(unsigned int zone)
+		{
+			static const char *zone_names[Zone::NR_ZONES] = { "DMA", "Normal", "High" };
+			return zone_names[zone];
+		}
+
+		BuddyPageAllocator _zones[Zone::NR_ZONES];
+
+		uint64_t _zone_start_pfn[Zone::NR_ZONES], _zone_nr_pages[Zone::NR_ZONES];
+		uint64_t _zone_watermarks[Zone::NR_ZONES];
+
+		uint64_t _nr_zone_allocs[Zone::NR_ZONES], _nr_zone_fallbacks[Zone::NR_ZONES], _nr_watermark_refusals[Zone::NR_ZONES];
+	};
+}
+
+#endif /* BUDDY_H */
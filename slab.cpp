@@ -0,0 +1,421 @@
+/*
+ * Slab Object Cache
+ */
+#include "slab.h"
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/locking/lock.h>
+
+using namespace infos::kernel;
+using namespace infos::locking;
+using namespace infos::mm;
+using namespace slab;
+
+// Objects are aligned to this many bytes within a slab.
+#define SLAB_OBJECT_ALIGN 16
+
+/**
+ * Returns the index of the per-CPU cache used by the calling CPU, from the kernel's CPU
+ * number.  Every per-CPU cache has its own lock, so a CPU that shares a slot with
+ * another (or a thread that migrates mid-operation) is still correct.
+ * @return Returns the per-CPU cache index.
+ */
+static inline unsigned int current_cpu_slot()
+{
+	return current_cpu_id() % SLAB_NR_CPUS;
+}
+
+/**
+ * Rounds a value up to the given power-of-two alignment.
+ */
+static inline size_t align_up(size_t value, size_t align)
+{
+	return (value + align - 1) & ~(align - 1);
+}
+
+ObjectCache::ObjectCache(const char *name, size_t object_size, ObjectCtor ctor)
+	: _name(name),
+	_object_size(object_size),
+	_ctor(ctor),
+	_partial_slabs(NULL),
+	_full_slabs(NULL),
+	_empty_slabs(NULL),
+	_nr_slabs(0),
+	_full_magazines(NULL),
+	_empty_magazines(NULL),
+	_nr_full_magazines(0)
+{
+	assert(object_size <= SLAB_MAX_OBJECT_SIZE);
+
+	// Free objects are chained through a link word.  Without a constructor the link can
+	// overlay the object itself, but constructed objects must keep their state while
+	// free, so the link goes in an extra word after the object instead.
+	_link_offset = _ctor ? align_up(object_size, sizeof(void *)) : 0;
+	_stride = align_up(_link_offset + sizeof(void *) > object_size ? _link_offset + sizeof(void *) : object_size, SLAB_OBJECT_ALIGN);
+	_objects_per_slab = (SLAB_SIZE - objects_offset()) / _stride;
+
+	for (unsigned int i = 0; i < SLAB_NR_CPUS; i++) {
+		_cpus[i].loaded = NULL;
+		_cpus[i].previous = NULL;
+	}
+}
+
+/**
+ * Returns the cache that owns an object.  Slabs are naturally aligned blocks, so the
+ * slab header is found by masking the object's address.
+ * @param object The object to look up.
+ * @return Returns the cache the object was allocated from.
+ */
+ObjectCache *ObjectCache::cache_of(const void *object)
+{
+	return ((Slab *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1)))->cache;
+}
+
+/**
+ * Moves a slab from one of the slab lists to another.  Must be called with the cache
+ * lock held.
+ * @param slab The slab to move.
+ * @param from The list the slab is currently on.
+ * @param to The list to move the slab onto.
+ */
+void ObjectCache::move_slab(Slab *slab, Slab **from, Slab **to)
+{
+	if (slab->prev) slab->prev->next = slab->next;
+	else *from = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+
+	slab->prev = NULL;
+	slab->next = *to;
+	if (*to) (*to)->prev = slab;
+	*to = slab;
+}
+
+/**
+ * Allocates a new slab from the page allocator, carves it into objects, and runs the
+ * constructor on each of them.  Must be called WITHOUT the cache's locks held, as
+ * the page allocator may call shrinkers, which can take them, and so that other CPUs
+ * are not held up meanwhile; the caller adds the slab to the cache with add_slab().
+ * @return Returns the new slab, or NULL if out of memory.
+ */
+ObjectCache::Slab *ObjectCache::grow()
+{
+	PageDescriptor *pgd = sys.mm().pgalloc().alloc_pages(SLAB_ORDER);
+	if (!pgd) return NULL;
+
+	uint8_t *base = (uint8_t *)sys.mm().pgalloc().pgd_to_vpa(pgd);
+	assert(((uintptr_t)base & (SLAB_SIZE - 1)) == 0);
+
+	Slab *slab = (Slab *)base;
+	slab->cache = this;
+	slab->prev = NULL;
+	slab->next = NULL;
+	slab->nr_in_use = 0;
+	slab->free_objects = NULL;
+
+	// Thread the free list in address order, so a new slab is handed out sequentially.
+	uint8_t *objects = base + objects_offset();
+	for (unsigned int i = _objects_per_slab; i > 0; i--) {
+		void *object = objects + (i - 1) * _stride;
+		if (_ctor) _ctor(object);
+		*link_of(object) = slab->free_objects;
+		slab->free_objects = object;
+	}
+
+	return slab;
+}
+
+/**
+ * Adds a freshly grown slab to the empty list.  Must be called with the cache lock held.
+ * @param slab The slab to add.
+ */
+void ObjectCache::add_slab(Slab *slab)
+{
+	slab->next = _empty_slabs;
+	if (_empty_slabs) _empty_slabs->prev = slab;
+	_empty_slabs = slab;
+	_nr_slabs++;
+}
+
+/**
+ * Allocates an object directly from the slab layer, preferring partially used slabs
+ * so that empty slabs can be given back.  Must be called with the cache lock held.
+ * @return Returns the object, or NULL if the cache needs to grow.
+ */
+void *ObjectCache::alloc_from_slabs()
+{
+	Slab *slab = _partial_slabs;
+	Slab **list = &_partial_slabs;
+
+	if (!slab) {
+		if (!_empty_slabs) return NULL;
+		slab = _empty_slabs;
+		list = &_empty_slabs;
+	}
+
+	void *object = slab->free_objects;
+	slab->free_objects = *link_of(object);
+	slab->nr_in_use++;
+
+	if (slab->nr_in_use == _objects_per_slab) {
+		move_slab(slab, list, &_full_slabs);
+	} else if (list == &_empty_slabs) {
+		move_slab(slab, list, &_partial_slabs);
+	}
+
+	return object;
+}
+
+/**
+ * Returns an object to its slab.  If that leaves a second slab empty, the older empty
+ * slab is released to the page allocator.  Must be called with the cache lock held.
+ * @param object The object to free.
+ */
+void ObjectCache::free_to_slabs(void *object)
+{
+	Slab *slab = (Slab *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+	assert(slab->cache == this);
+
+	Slab **list = (slab->nr_in_use == _objects_per_slab) ? &_full_slabs : &_partial_slabs;
+
+	*link_of(object) = slab->free_objects;
+	slab->free_objects = object;
+	slab->nr_in_use--;
+
+	if (slab->nr_in_use == 0) {
+		move_slab(slab, list, &_empty_slabs);
+
+		// Keep one empty slab around to absorb alloc/free churn at a slab boundary.
+		Slab *spare = slab->next;
+		if (spare) {
+			slab->next = spare->next;
+			if (spare->next) spare->next->prev = slab;
+
+			_nr_slabs--;
+			sys.mm().pgalloc().free_pages(sys.mm().pgalloc().vpa_to_pgd(spare), SLAB_ORDER);
+		}
+	} else if (list == &_full_slabs) {
+		move_slab(slab, list, &_partial_slabs);
+	}
+}
+
+/**
+ * Exchanges an empty magazine for a full one from the depot.  Must be called with the
+ * cache lock held.
+ * @param empty The empty magazine to hand to the depot (may be NULL).
+ * @return Returns a full magazine, or NULL if the depot has none (in which case the
+ * empty magazine is not taken).
+ */
+ObjectCache::Magazine *ObjectCache::get_full_magazine(Magazine *empty)
+{
+	Magazine *full = _full_magazines;
+	if (!full) return NULL;
+
+	_full_magazines = full->next;
+	_nr_full_magazines--;
+	if (empty) {
+		empty->next = _empty_magazines;
+		_empty_magazines = empty;
+	}
+
+	return full;
+}
+
+/**
+ * Exchanges a full magazine for an empty one from the depot.  If the depot already
+ * holds its limit of full magazines, the full magazine is instead emptied back into
+ * the slabs and reused, so that objects freed in bulk eventually give their slabs
+ * back to the page allocator.  Must be called with the cache lock held.
+ * @param full The full magazine to hand to the depot (may be NULL).
+ * @return Returns an empty magazine, or NULL if the depot has none (in which case the
+ * full magazine is not taken).
+ */
+ObjectCache::Magazine *ObjectCache::get_empty_magazine(Magazine *full)
+{
+	if (full && _nr_full_magazines >= SLAB_DEPOT_SIZE) {
+		while (full->nr_objects > 0) {
+			free_to_slabs(full->objects[--full->nr_objects]);
+		}
+
+		return full;
+	}
+
+	Magazine *empty = _empty_magazines;
+	if (!empty) return NULL;
+
+	_empty_magazines = empty->next;
+
+	empty->nr_objects = 0;
+	if (full) {
+		full->next = _full_magazines;
+		_full_magazines = full;
+		_nr_full_magazines++;
+	}
+
+	return empty;
+}
+
+/**
+ * Allocates an object.  The calling CPU's loaded magazine is tried first, then its
+ * previous magazine, then a full magazine from the depot, and finally the slabs.  If
+ * the slabs are exhausted too, the cache grows with no locks held.
+ * @return Returns the object, or NULL if out of memory.
+ */
+void *ObjectCache::alloc()
+{
+	{
+		CpuCache& cpu = _cpus[current_cpu_slot()];
+		UniqueLock<Spinlock> cl(cpu.lock);
+
+		if (cpu.loaded && cpu.loaded->nr_objects > 0) {
+			return cpu.loaded->objects[--cpu.loaded->nr_objects];
+		}
+
+		if (cpu.previous && cpu.previous->nr_objects > 0) {
+			Magazine *tmp = cpu.loaded;
+			cpu.loaded = cpu.previous;
+			cpu.previous = tmp;
+			return cpu.loaded->objects[--cpu.loaded->nr_objects];
+		}
+
+		UniqueLock<Spinlock> l(_lock);
+
+		Magazine *full = get_full_magazine(cpu.previous);
+		if (full) {
+			cpu.previous = cpu.loaded;
+			cpu.loaded = full;
+			return cpu.loaded->objects[--cpu.loaded->nr_objects];
+		}
+
+		void *object = alloc_from_slabs();
+		if (object) return object;
+	}
+
+	Slab *slab = grow();
+	if (!slab) return NULL;
+
+	// Another CPU may have grown the cache while the lock was dropped, in which case
+	// the new slab is surplus and goes straight back to the page allocator.
+	Slab *surplus = NULL;
+	void *object;
+	{
+		UniqueLock<Spinlock> l(_lock);
+
+		if (_partial_slabs || _empty_slabs) {
+			surplus = slab;
+		} else {
+			add_slab(slab);
+		}
+
+		object = alloc_from_slabs();
+	}
+
+	if (surplus) {
+		sys.mm().pgalloc().free_pages(sys.mm().pgalloc().vpa_to_pgd(surplus), SLAB_ORDER);
+	}
+
+	return object;
+}
+
+/**
+ * Frees an object, which must be in its constructed state.  It goes into the calling
+ * CPU's loaded or previous magazine if either has room, otherwise a full magazine is
+ * swapped for an empty one at the depot.  If the depot has no empty magazine, one is
+ * allocated with no locks held, and the free tried again; only if that fails does
+ * the object go straight back to its slab.
+ * @param object The object to free.
+ */
+void ObjectCache::free(void *object)
+{
+	if (!object) return;
+
+	for (bool retried = false; ; retried = true) {
+		{
+			CpuCache& cpu = _cpus[current_cpu_slot()];
+			UniqueLock<Spinlock> cl(cpu.lock);
+
+			if (cpu.loaded && cpu.loaded->nr_objects < SLAB_MAGAZINE_SIZE) {
+				cpu.loaded->objects[cpu.loaded->nr_objects++] = object;
+				return;
+			}
+
+			if (cpu.previous && cpu.previous->nr_objects < SLAB_MAGAZINE_SIZE) {
+				Magazine *tmp = cpu.loaded;
+				cpu.loaded = cpu.previous;
+				cpu.previous = tmp;
+				cpu.loaded->objects[cpu.loaded->nr_objects++] = object;
+				return;
+			}
+
+			UniqueLock<Spinlock> l(_lock);
+
+			Magazine *empty = get_empty_magazine(cpu.previous);
+			if (empty) {
+				cpu.previous = cpu.loaded;
+				cpu.loaded = empty;
+				cpu.loaded->objects[cpu.loaded->nr_objects++] = object;
+				return;
+			}
+
+			// Other CPUs took the magazine added last time round.
+			if (retried) {
+				free_to_slabs(object);
+				return;
+			}
+		}
+
+		// The kernel heap may call the page allocator, so the new magazine is allocated
+		// with no locks held, and put in the depot for whichever CPU gets there first.
+		Magazine *magazine = new Magazine();
+
+		UniqueLock<Spinlock> l(_lock);
+
+		if (!magazine) {
+			free_to_slabs(object);
+			return;
+		}
+
+		magazine->next = _empty_magazines;
+		_empty_magazines = magazine;
+	}
+}
+
+/*
+ * The general-purpose caches, one per power-of-two size class.
+ */
+static ObjectCache size_caches[] = {
+	ObjectCache("size-16", 16),
+	ObjectCache("size-32", 32),
+	ObjectCache("size-64", 64),
+	ObjectCache("size-128", 128),
+	ObjectCache("size-256", 256),
+	ObjectCache("size-512", 512),
+	ObjectCache("size-1024", 1024),
+	ObjectCache("size-2048", 2048),
+};
+
+/**
+ * Allocates an object of the given size from the smallest size class that fits.
+ * @param size The size of the object, in bytes.
+ * @return Returns the object, or NULL if the size is too large or memory is exhausted.
+ */
+void *slab::alloc(size_t size)
+{
+	for (unsigned int i = 0; i < sizeof(size_caches) / sizeof(size_caches[0]); i++) {
+		if (size <= size_caches[i].object_size()) {
+			return size_caches[i].alloc();
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Frees an object allocated with slab::alloc.
+ * @param object The object to free.
+ */
+void slab::free(void *object)
+{
+	if (!object) return;
+	ObjectCache::cache_of(object)->free(object);
+}
@@ -0,0 +1,130 @@
+/*
+ * Slab Object Cache Header File
+ */
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <infos/mm/page-allocator.h>
+#include <infos/locking/spinlock.h>
+
+// Every slab is a block of this order, taken from the page allocator.
+#define SLAB_ORDER 3
+
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_SIZE (SLAB_PAGE_SIZE << SLAB_ORDER)
+
+// The largest object a cache can hold, so that each slab holds at least eight.
+#define SLAB_MAX_OBJECT_SIZE (SLAB_SIZE / 16)
+
+// The number of objects held by one magazine, and the number of per-CPU caches.
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_NR_CPUS 16
+
+// The number of full magazines a cache's depot may hold before frees go back to slabs.
+#define SLAB_DEPOT_SIZE 16
+
+namespace slab {
+
+	/**
+	 * A constructor that puts a freshly carved object into its initial state.  It is
+	 * only called when a slab is created, and objects are expected to be freed back
+	 * in their constructed state, so that the work is not repeated on every alloc.
+	 */
+	typedef void (*ObjectCtor)(void *object);
+
+	/**
+	 * A cache of fixed-size objects.  Objects are carved out of slabs that come from
+	 * the page allocator, and recently freed objects are kept in per-CPU magazines,
+	 * so that the common alloc/free path touches neither the slabs nor a shared lock.
+	 */
+	class ObjectCache {
+	public:
+		ObjectCache(const char *name, size_t object_size, ObjectCtor ctor = NULL);
+
+		void *alloc();
+		void free(void *object);
+
+		static ObjectCache *cache_of(const void *object);
+
+		const char *name() const {
+			return _name;
+		}
+
+		size_t object_size() const {
+			return _object_size;
+		}
+
+		unsigned int objects_per_slab() const {
+			return _objects_per_slab;
+		}
+
+		uint64_t nr_slabs() const {
+			return _nr_slabs;
+		}
+
+		/**
+		 * Returns the number of bytes of slab memory that cannot hold objects, i.e. the
+		 * slab headers, the free-list links, and the slack at the end of each slab.
+		 */
+		uint64_t overhead_bytes() const {
+			return _nr_slabs * (SLAB_SIZE - _objects_per_slab * _object_size);
+		}
+
+	private:
+		struct Slab {
+			ObjectCache *cache;
+			Slab *next, *prev;
+			void *free_objects;
+			unsigned int nr_in_use;
+		};
+
+		struct Magazine {
+			Magazine *next;
+			unsigned int nr_objects;
+			void *objects[SLAB_MAGAZINE_SIZE];
+		};
+
+		struct CpuCache {
+			infos::locking::Spinlock lock;
+			Magazine *loaded, *previous;
+		};
+
+		static size_t objects_offset() {
+			return (sizeof(Slab) + 15) & ~(size_t)15;
+		}
+
+		void **link_of(void *object) const {
+			return (void **)((uint8_t *)object + _link_offset);
+		}
+
+		void *alloc_from_slabs();
+		void free_to_slabs(void *object);
+
+		Slab *grow();
+		void add_slab(Slab *slab);
+		void move_slab(Slab *slab, Slab **from, Slab **to);
+
+		Magazine *get_full_magazine(Magazine *empty);
+		Magazine *get_empty_magazine(Magazine *full);
+
+		const char *_name;
+		size_t _object_size;
+		ObjectCtor _ctor;
+		size_t _link_offset, _stride;
+		unsigned int _objects_per_slab;
+
+		infos::locking::Spinlock _lock;
+		Slab *_partial_slabs, *_full_slabs, *_empty_slabs;
+		uint64_t _nr_slabs;
+
+		Magazine *_full_magazines, *_empty_magazines;
+		unsigned int _nr_full_magazines;
+
+		CpuCache _cpus[SLAB_NR_CPUS];
+	};
+
+	void *alloc(size_t size);
+	void free(void *object);
+}
+
+#endif /* SLAB_H */
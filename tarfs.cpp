@@ -7,12 +7,16 @@
  * STUDENT NUMBER: s1820742
  */
 #include "tarfs.h"
+#include "slab.h"
 #include <infos/kernel/log.h>
+#include <infos/locking/spinlock.h>
+#include <infos/locking/lock.h>
 
 using namespace infos::fs;
 using namespace infos::drivers;
 using namespace infos::drivers::block;
 using namespace infos::kernel;
+using namespace infos::locking;
 using namespace infos::util;
 using namespace tarfs;
 
@@ -84,6 +88,120 @@ namespace tarfs {
 	} __packed;
 }
 
+/**
+ * Decodes a fixed-width octal field from a TAR header.  Unlike octal2ui, this
+ * never reads past the end of the field, and accepts leading spaces and a
+ * trailing space or NUL, as written by the various tar implementations.
+ * @param data The field data.
+ * @param len The width of the field.
+ * @return Returns the decoded value.
+ */
+static inline uint64_t octal_field(const char *data, size_t len)
+{
+	uint64_t value = 0;
+	size_t i = 0;
+
+	while (i < len && data[i] == ' ') i++;
+
+	while (i < len && data[i] >= '0' && data[i] <= '7') {
+		value = (value << 3) | (data[i] - '0');
+		i++;
+	}
+
+	return value;
+}
+
+/**
+ * A minimal SHA-256 implementation (FIPS 180-4), used to check archive chunks
+ * against a verification manifest.
+ */
+namespace {
+	struct sha256_ctx {
+		uint32_t state[8];
+		uint64_t length;
+		uint8_t block[64];
+		unsigned int block_used;
+	};
+
+	const uint32_t sha256_k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+
+	inline uint32_t ror32(uint32_t v, unsigned int n)
+	{
+		return (v >> n) | (v << (32 - n));
+	}
+
+	void sha256_compress(sha256_ctx& ctx, const uint8_t *data)
+	{
+		uint32_t w[64];
+
+		for (unsigned int i = 0; i < 16; i++) {
+			w[i] = (uint32_t) data[i * 4] << 24 | (uint32_t) data[i * 4 + 1] << 16 | (uint32_t) data[i * 4 + 2] << 8 | data[i * 4 + 3];
+		}
+
+		for (unsigned int i = 16; i < 64; i++) {
+			uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = ctx.state[0], b = ctx.state[1], c = ctx.state[2], d = ctx.state[3];
+		uint32_t e = ctx.state[4], f = ctx.state[5], g = ctx.state[6], h = ctx.state[7];
+
+		for (unsigned int i = 0; i < 64; i++) {
+			uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		ctx.state[0] += a; ctx.state[1] += b; ctx.state[2] += c; ctx.state[3] += d;
+		ctx.state[4] += e; ctx.state[5] += f; ctx.state[6] += g; ctx.state[7] += h;
+	}
+
+	void sha256(const uint8_t *data, size_t size, uint8_t *digest)
+	{
+		sha256_ctx ctx = { { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 }, size * 8, { 0 }, 0 };
+
+		for (; size >= 64; size -= 64, data += 64) {
+			sha256_compress(ctx, data);
+		}
+
+		// Pad the final block(s) with a single one bit, zeroes, and the message
+		// length in bits.
+		memcpy(ctx.block, data, size);
+		ctx.block[size++] = 0x80;
+
+		if (size > 56) {
+			memset(ctx.block + size, 0, 64 - size);
+			sha256_compress(ctx, ctx.block);
+			size = 0;
+		}
+
+		memset(ctx.block + size, 0, 56 - size);
+		for (unsigned int i = 0; i < 8; i++) {
+			ctx.block[56 + i] = ctx.length >> (56 - i * 8);
+		}
+		sha256_compress(ctx, ctx.block);
+
+		for (unsigned int i = 0; i < 8; i++) {
+			digest[i * 4] = ctx.state[i] >> 24;
+			digest[i * 4 + 1] = ctx.state[i] >> 16;
+			digest[i * 4 + 2] = ctx.state[i] >> 8;
+			digest[i * 4 + 3] = ctx.state[i];
+		}
+	}
+}
+
 /**
  * Reads the contents of the file into the buffer, from the specified file offset.
  * @param buffer The buffer to read the data into.
@@ -91,186 +209,1074 @@ namespace tarfs {
  * @param off The offset within the file.
  * @return Returns the number of bytes read into the buffer.
  */
-int TarFSFile::pread(void* buffer, size_t size, off_t off)
+int TarFSFile::pread(void* buffer, size_t size, off_t off)
+{
+	if (off >= this->size()) return 0;
+
+	// Clamp the read to the end of the file.
+	if (off + size > this->size()) {
+		size = this->size() - off;
+	}
+
+	// Small files were captured at mount time (and verified then, if need be).
+	if (_inline_data) {
+		memcpy(buffer, _inline_data + off, size);
+		return size;
+	}
+
+	BlockDevice& bdev = _owner.block_device();
+	uint8_t *out = (uint8_t *) buffer;
+
+	// The archive is laid out in 512-byte records, and only devices with blocks of
+	// that size are mounted (see TarFS::scan_members).
+	assert(bdev.block_size() == BLOCKSIZE);
+
+	unsigned int block = _file_start_block + off / BLOCKSIZE;
+	unsigned int skip = off % BLOCKSIZE;
+	size_t remaining = size;
+
+	// Partial blocks at either end of the range go through a bounce block, but
+	// whole blocks are read straight into the caller's buffer.
+	uint8_t bounce[BLOCKSIZE];
+
+	if (skip) {
+		size_t chunk = BLOCKSIZE - skip < remaining ? BLOCKSIZE - skip : remaining;
+
+		// Refuse to return data that does not match the verification manifest.
+		if (!_owner.read_blocks(bounce, block++, 1)) {
+			return -1;
+		}
+
+		memcpy(out, bounce + skip, chunk);
+
+		out += chunk;
+		remaining -= chunk;
+	}
+
+	size_t nr_whole_blocks = remaining / BLOCKSIZE;
+	if (nr_whole_blocks) {
+		if (!_owner.read_blocks(out, block, nr_whole_blocks)) {
+			return -1;
+		}
+
+		block += nr_whole_blocks;
+		out += nr_whole_blocks * BLOCKSIZE;
+		remaining -= nr_whole_blocks * BLOCKSIZE;
+	}
+
+	if (remaining) {
+		if (!_owner.read_blocks(bounce, block, 1)) {
+			return -1;
+		}
+
+		memcpy(out, bounce, remaining);
+	}
+
+	return size;
+}
+
+
+/**
+ * Reads all the file headers in the TAR file, and builds an in-memory
+ * representation.
+ * @return Returns the root TarFSNode that corresponds to the TAR file structure.
+ */
+//TarFSNode* TarFS::build_tree()
+//{
+//    // Create the root node.
+//    TarFSNode *root = new TarFSNode(NULL, "", *this);
+//
+//    // TO BE FILLED IN
+//    int file_number;
+//    int block_number = block_device().block_count();
+//    struct posix_header *file_hdr = (struct posix_header *) new char [_owner.block_device().block_size()];
+//    String directory = container[0:100];
+//    // entity/TarFSNode = root
+//    while (True){
+//    }
+//}
+//    for(int i = 0; i < file_number; i++){
+//        //let *file_hdr point to the current file
+//        //file_hdr->name split into String[]
+//        //if(entity.children.names ! contain String[j]){
+//        //  for(int j = 0; j < len(String[])-1; j++){
+//        //      create an file entity which is a TarFSNode names String[j]
+//        //      entity.parent = entity
+//        //      initialise entity = the struct which has name String[path/j]
+//        //  }
+//        //}else{
+//
+//    //}
+//    //entity.child = TarFSNode(*file_hdr)
+//    //
+//
+//    // You must read the TAR file, and build a tree of TarFSNodes that represents each file present in the archive.
+//
+//    return root;
+//}
+
+/**
+ * Deletes a node, and everything below it.  Metadata records are not freed, as they
+ * belong to the TarFS that captured them.
+ */
+static void delete_tree(TarFSNode *node)
+{
+    for (const auto& child : node->children()) {
+        delete_tree(child.value);
+    }
+
+    delete node;
+}
+
+/**
+ * Adds a member's node to its directory.  As in an extracted archive, a later member
+ * replaces whatever an earlier one put at the same path, except that a directory
+ * header for a directory that already exists only updates its metadata, keeping the
+ * directory's contents.  A node that is replaced is only unlinked, as lookups made
+ * before a refresh may still refer to it, and is freed with the TarFS.
+ * @param parent The directory to add the node to.
+ * @param name The name of the member.
+ * @param node The member's node, which is deleted if it is not needed.
+ */
+void TarFS::splice_child(TarFSNode *parent, const String& name, TarFSNode *node)
+{
+    TarFSNode *existing = parent->find_child_locked(name);
+
+    if (existing) {
+        if (existing->is_directory() && node->is_directory()) {
+            existing->set_entry(node->stat());
+            delete node;
+            return;
+        }
+
+        parent->remove_child(name);
+        _retired.append(existing);
+    }
+
+    parent->add_child(name, node);
+}
+
+/**
+ * Releases the tree, and everything that was captured from the archive for it.
+ */
+TarFS::~TarFS()
+{
+    if (_root_node) {
+        delete_tree(_root_node);
+    }
+
+    for (TarFSNode *node : _retired) {
+        delete_tree(node);
+    }
+
+    for (TarFSEntry *chunk : _entry_chunks) {
+        delete[] chunk;
+    }
+
+    for (uint8_t *chunk : _inline_chunks) {
+        delete[] chunk;
+    }
+
+    delete[] _manifest;
+    delete[] _verify_cache;
+    delete[] _verify_slots;
+}
+
+TarFSNode* TarFS::build_tree()
+{
+    // Create the root node.
+    TarFSNode *root = new TarFSNode(NULL, "", *this);
+    root->set_entry(directory_entry(NULL));
+
+    scan_members(root, 0);
+    return root;
+}
+
+/**
+ * Scans the archive's headers from the given block to the end of the archive, and
+ * adds a node to the tree for each member, or queues the members to be added later.
+ * The block where the archive ends is remembered, so that members appended later
+ * can be picked up from there.
+ * @param root The root of the tree.
+ * @param first_block The block of the first header to read.
+ * @param pending If not NULL, the list that the members are queued on, in order,
+ * instead of being added to the tree.
+ * @return Returns the number of members found.
+ */
+unsigned int TarFS::scan_members(TarFSNode *root, unsigned int first_block, List<TarFSMember> *pending)
+{
+    // Block numbers are archive record numbers, which only holds if the device's blocks
+    // are the size of a record.
+    if (block_device().block_size() != BLOCKSIZE) {
+        mm_log.messagef(LogLevel::ERROR, "tarfs: unsupported device block size %u", (unsigned int) block_device().block_size());
+        return 0;
+    }
+
+    // Initialises the file header, file path and file name to begin analysing Tar nodes.
+    // Each header is read together with the block after it, which holds the contents
+    // of a small file (or the second zero block at the end of the archive), and there
+    // is room behind it for the rest of the largest file that can be inlined.
+    unsigned int nr_data_blocks = (_inline_max_size + BLOCKSIZE - 1) / BLOCKSIZE;
+    uint8_t *scan_buffer = new uint8_t[(1 + (nr_data_blocks > 1 ? nr_data_blocks : 1)) * BLOCKSIZE];
+    posix_header *file_hdr = (posix_header *) scan_buffer;
+    uint8_t *data = scan_buffer + BLOCKSIZE;
+    String file_path;
+    unsigned int file_size = 0;
+    size_t nr_blocks = block_device().block_count();
+    unsigned int off, nr_members = 0;
+
+    // Loops through the headers while the offset index is less that the total blocks
+    for (off = first_block; off < nr_blocks; off+=file_size+1){
+        // The tree is built from the headers, so they must be checked before use.
+        unsigned int nr_read = _inline_max_size > 0 && off + 1 < nr_blocks ? 2 : 1;
+        if (!read_blocks(file_hdr, off, nr_read)) {
+            mm_log.messagef(LogLevel::ERROR, "tarfs: header block %u failed verification", off);
+            break;
+        }
+
+        // Check if the zero block is present in the file header which shows the archive end
+        // then break.  The archive ends with two zero blocks, or with the device.
+        if (is_zero_block((uint8_t *) file_hdr)) {
+            if (nr_read < 2 && off + 1 < nr_blocks) {
+                if (!read_blocks(data, off + 1, 1)) {
+                    mm_log.messagef(LogLevel::ERROR, "tarfs: block %u failed verification", off + 1);
+                    break;
+                }
+
+                nr_read = 2;
+            }
+
+            if (nr_read < 2 || is_zero_block(data)) {
+                break;
+            }
+        }
+
+        // A member with an empty path cannot be placed in the tree, and ends the scan.
+        file_path = String(file_hdr->name);
+        if (file_path.split('/', true).empty())
+            break;
+
+        // Decode everything we need from the header now, so that nothing has to
+        // read or parse it again after the mount.
+        TarFSEntry *entry = capture_entry(file_hdr, off);
+        capture_inline_data(entry, data, nr_read - 1);
+
+        // Skip over the data blocks of this member
+        file_size = (entry->size % BLOCKSIZE) ? (entry->size/BLOCKSIZE + 1) : entry->size/BLOCKSIZE;
+
+        // The link name is not necessarily NUL-terminated.
+        char link_name[sizeof(file_hdr->linkname) + 1];
+        memcpy(link_name, file_hdr->linkname, sizeof(file_hdr->linkname));
+        link_name[sizeof(file_hdr->linkname)] = 0;
+
+        if (pending) {
+            TarFSMember member;
+            member.path = file_path;
+            member.link_name = link_name;
+            member.entry = entry;
+            pending->append(member);
+        } else {
+            add_member(root, file_path, entry, link_name);
+        }
+
+        nr_members++;
+    }
+
+    // An appending writer overwrites the zero blocks that end the archive, so the next
+    // scan starts from them.
+    _scan_end = off;
+
+    delete[] scan_buffer;
+    return nr_members;
+}
+
+/**
+ * Adds a node for an archive member to the tree, creating any directories on its
+ * path that do not have a header of their own.
+ * @param root The root of the tree.
+ * @param file_path The member's path in the archive.
+ * @param entry The member's metadata record.
+ * @param link_name The member's link name, for a hard or symbolic link.
+ */
+void TarFS::add_member(TarFSNode *root, const String& file_path, TarFSEntry *entry, const char *link_name)
+{
+    TarFSNode *lead = root;
+
+    List <String> file_path_parts = file_path.split('/', true);
+    String file_name = file_path_parts.last();
+
+    // If the file path is greater than one
+    // that the file is in a lower hierarchy directory than
+    // the current one
+    if (file_path_parts.count() > 1) {
+        TarFSNode *temp_node = root;
+
+        // Walk down the path, creating any intermediate directories that do not
+        // have a header of their own.
+        for(unsigned int i =0; i< file_path_parts.count() - 1;i++)
+        {
+            String cur = file_path_parts.at(i);
+            TarFSNode *next = temp_node->find_child_locked(cur);
+            if (next) {
+                next = next->resolve_locked();
+            }
+
+            if(!next)
+            {
+                next = new TarFSNode(temp_node, cur, *this);
+                next->set_entry(directory_entry(entry));
+                splice_child(temp_node, cur, next);
+            }
+            temp_node = next;
+
+        }
+        lead = temp_node;
+    }
+
+    // Builds the tree by initialising and adding the current positioned node to the lead_node as a child.
+    TarFSNode *cur_node = new TarFSNode(lead, file_name, *this);
+    cur_node->set_entry(entry);
+
+    if (entry->typeflag == '1' || entry->typeflag == '2') {
+        if (entry->typeflag == '1') {
+            // A hard link shares the metadata, and therefore the data extent, of
+            // its target, which always appears earlier in the archive.
+            TarFSNode *target = root->lookup_locked(link_name, false);
+            if (target && target->stat()) {
+                cur_node->set_entry(target->stat());
+
+                // A hard link to a symbolic link is the same symbolic link.
+                if (target->is_symlink()) {
+                    cur_node->set_link_target(*target->link_target());
+                }
+            } else {
+                mm_log.messagef(LogLevel::WARNING, "tarfs: hard link %s has no target %s", file_path.c_str(), link_name);
+            }
+        } else {
+            cur_node->set_link_target(link_name);
+        }
+    }
+
+    // Add the child node
+    splice_child(lead, file_name, cur_node);
+}
+
+/**
+ * Brings a mounted archive up to date with members that have been appended to it
+ * since it was mounted or last refreshed, e.g. by "tar -r".  Only the new headers
+ * are read, and each new member is spliced into the tree as it would have been by
+ * a full scan.  Lookups only wait while the tree changes, not while the archive is
+ * read.  Only one refresh runs at a time.  Nodes that are replaced stay
+ * valid for anything still holding them, and symbolic links are resolved afresh.
+ * @return Returns the number of members added, or -1 if the archive is not mounted,
+ * is being verified (as the manifest only covers the archive as it was), or is a
+ * layer of a union mount (whose merged tree would not see the change).
+ */
+int TarFS::refresh()
+{
+    if (_root_node == NULL || verifying() || _in_union) {
+        return -1;
+    }
+
+    UniqueLock<Mutex> l(_refresh_lock);
+
+    // The new members are read without holding up lookups, which only have to wait
+    // while they are spliced into the tree.
+    List<TarFSMember> members;
+    unsigned int nr_members = scan_members(_root_node, _scan_end, &members);
+
+    if (nr_members > 0) {
+        UniqueLock<TarFSTreeLock> tl(_tree_lock);
+
+        for (const TarFSMember& member : members) {
+            add_member(_root_node, member.path, member.entry, member.link_name.c_str());
+        }
+
+        _generation++;
+    }
+
+    return nr_members;
+}
+
+/**
+ * Enables integrity verification of everything read from the archive.  The
+ * device is divided into chunks of a fixed number of blocks, and the manifest
+ * holds the SHA-256 digest of each chunk, in order (the last chunk may be
+ * short).  Chunks are checked when they are read, and everything read from the
+ * archive is copied out of the very bytes that were hashed, so the device cannot
+ * hand back something else after the check.  Recently used chunks that passed are
+ * kept (see TARFS_VERIFY_CACHE_BYTES); any other chunk is read and hashed again.
+ * This must be called before the file system is mounted.
+ * @param manifest The trusted chunk digests, which are copied.
+ * @param nr_chunks The number of digests in the manifest.
+ * @param blocks_per_chunk The number of device blocks covered by each digest.
+ * @return Returns TRUE if verification was enabled, FALSE otherwise.
+ */
+bool TarFS::enable_verification(const uint8_t *manifest, unsigned int nr_chunks, unsigned int blocks_per_chunk)
+{
+    if (_root_node || verifying() || nr_chunks == 0 || blocks_per_chunk == 0) {
+        return false;
+    }
+
+    // The manifest must cover the whole device.
+    if ((uint64_t) nr_chunks * blocks_per_chunk < block_device().block_count()) {
+        return false;
+    }
+
+    // The cache holds as many chunks as fit, in whole sets.
+    size_t chunk_size = (size_t) blocks_per_chunk * BLOCKSIZE;
+    unsigned int nr_sets = TARFS_VERIFY_CACHE_BYTES / chunk_size / TARFS_VERIFY_CACHE_WAYS;
+    if (nr_sets == 0) {
+        return false;
+    }
+
+    unsigned int nr_slots = nr_sets * TARFS_VERIFY_CACHE_WAYS;
+    _verify_cache = new uint8_t[nr_slots * chunk_size];
+    _verify_slots = new TarFSVerifySlot[nr_slots];
+
+    for (unsigned int i = 0; i < nr_slots; i++) {
+        _verify_slots[i].chunk = nr_chunks;
+        _verify_slots[i].pins = 0;
+        _verify_slots[i].last_used = 0;
+        _verify_slots[i].valid = false;
+        _verify_slots[i].data = &_verify_cache[i * chunk_size];
+    }
+
+    _nr_verify_sets = nr_sets;
+
+    _nr_chunks = nr_chunks;
+    _blocks_per_chunk = blocks_per_chunk;
+
+    _manifest = new uint8_t[nr_chunks * TARFS_DIGEST_SIZE];
+    memcpy(_manifest, manifest, nr_chunks * TARFS_DIGEST_SIZE);
+
+    return true;
+}
+
+/**
+ * Sets the size of the largest regular file whose contents are captured at mount
+ * time (see TARFS_INLINE_MAX_SIZE).  This must be called before the file system is
+ * mounted.
+ * @param max_size The size in bytes, or zero to read every file from the device.
+ * @return Returns TRUE if the size was set, FALSE otherwise.
+ */
+bool TarFS::set_inline_max_size(unsigned int max_size)
+{
+    if (_root_node || max_size > TARFS_INLINE_CHUNK_SIZE) {
+        return false;
+    }
+
+    _inline_max_size = max_size;
+    return true;
+}
+
+/**
+ * Reads a range of blocks of the archive.  If verification is enabled, the blocks
+ * are copied out of chunks that have been checked against the manifest, and are
+ * never read from the device after the check.
+ * @param buffer The buffer to read the blocks into.
+ * @param first_block The first block in the range.
+ * @param nr_blocks The number of blocks in the range.
+ * @return Returns TRUE if the blocks were read, or FALSE if verification failed.
+ */
+bool TarFS::read_blocks(void *buffer, unsigned int first_block, unsigned int nr_blocks)
+{
+    if (!verifying()) {
+        block_device().read_blocks(buffer, first_block, nr_blocks);
+        return true;
+    }
+
+    if ((uint64_t) first_block + nr_blocks > block_device().block_count()) {
+        return false;
+    }
+
+    uint8_t *out = (uint8_t *) buffer;
+    while (nr_blocks > 0) {
+        unsigned int skip = first_block % _blocks_per_chunk;
+        unsigned int count = _blocks_per_chunk - skip < nr_blocks ? _blocks_per_chunk - skip : nr_blocks;
+
+        if (!read_verified(out, first_block / _blocks_per_chunk, skip, count)) {
+            return false;
+        }
+
+        out += count * BLOCKSIZE;
+        first_block += count;
+        nr_blocks -= count;
+    }
+
+    return true;
+}
+
+/**
+ * Copies blocks out of one chunk of the device, checked against its manifest
+ * digest.  The chunk comes from the verified chunk cache, and is read and hashed
+ * into it on a miss.  If every slot the chunk could use is busy, a private copy is
+ * checked instead.
+ * @param out The buffer to copy the blocks into.
+ * @param chunk The chunk to read from.
+ * @param skip The number of blocks at the start of the chunk to skip.
+ * @param count The number of blocks to copy.
+ * @return Returns TRUE if the blocks were copied, or FALSE if the chunk does not match.
+ */
+bool TarFS::read_verified(uint8_t *out, unsigned int chunk, unsigned int skip, unsigned int count)
+{
+    if (chunk >= _nr_chunks) {
+        return false;
+    }
+
+    bool fill;
+    TarFSVerifySlot *slot = pin_chunk(chunk, fill);
+
+    if (!slot) {
+        uint8_t *data = new uint8_t[(size_t) _blocks_per_chunk * BLOCKSIZE];
+        bool valid = read_chunk(chunk, data);
+
+        if (valid) {
+            memcpy(out, data + skip * BLOCKSIZE, count * BLOCKSIZE);
+        }
+
+        delete[] data;
+        return valid;
+    }
+
+    if (fill) {
+        slot->valid = read_chunk(chunk, slot->data);
+        slot->fill_lock.unlock();
+    } else {
+        // Wait for the reader filling the slot, if there is one.
+        slot->fill_lock.lock();
+        slot->fill_lock.unlock();
+    }
+
+    bool valid = slot->valid;
+    if (valid) {
+        memcpy(out, slot->data + skip * BLOCKSIZE, count * BLOCKSIZE);
+    }
+
+    unpin_chunk(slot);
+    return valid;
+}
+
+/**
+ * Reads one chunk of the device and checks it against its manifest digest.
+ * @param chunk The chunk to read.
+ * @param data The buffer to read the chunk into, which must hold a whole chunk.
+ * @return Returns TRUE if the chunk matches, FALSE otherwise.
+ */
+bool TarFS::read_chunk(unsigned int chunk, uint8_t *data)
+{
+    unsigned int first_block = chunk * _blocks_per_chunk;
+    unsigned int nr_blocks = _blocks_per_chunk;
+
+    if (first_block + nr_blocks > block_device().block_count()) {
+        nr_blocks = block_device().block_count() - first_block;
+    }
+
+    block_device().read_blocks(data, first_block, nr_blocks);
+
+    uint8_t digest[TARFS_DIGEST_SIZE];
+    sha256(data, nr_blocks * BLOCKSIZE, digest);
+
+    if (memcmp(digest, &_manifest[chunk * TARFS_DIGEST_SIZE], TARFS_DIGEST_SIZE) != 0) {
+        mm_log.messagef(LogLevel::ERROR, "tarfs: chunk %u (blocks %u-%u) does not match the manifest", chunk, first_block, first_block + nr_blocks - 1);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Pins the cache slot holding a chunk.  On a miss, the least recently used slot of
+ * the chunk's set that nobody has pinned is claimed for it, with its fill lock
+ * held, and the caller must fill it.
+ * @param chunk The chunk to look up.
+ * @param fill Receives TRUE if the caller must read and check the chunk into the slot.
+ * @return Returns the slot, or NULL if every slot of the set is pinned.
+ */
+TarFSVerifySlot *TarFS::pin_chunk(unsigned int chunk, bool& fill)
+{
+    UniqueLock<Mutex> l(_verify_lock);
+
+    TarFSVerifySlot *set = &_verify_slots[(chunk % _nr_verify_sets) * TARFS_VERIFY_CACHE_WAYS];
+    TarFSVerifySlot *victim = NULL;
+
+    for (unsigned int way = 0; way < TARFS_VERIFY_CACHE_WAYS; way++) {
+        TarFSVerifySlot *slot = &set[way];
+
+        if (slot->chunk == chunk) {
+            slot->pins++;
+            slot->last_used = ++_verify_clock;
+            fill = false;
+            return slot;
+        }
+
+        if (slot->pins == 0 && (victim == NULL || slot->last_used < victim->last_used)) {
+            victim = slot;
+        }
+    }
+
+    if (victim == NULL) {
+        return NULL;
+    }
+
+    // Nobody has the slot pinned, so nobody holds its fill lock either.
+    victim->chunk = chunk;
+    victim->pins = 1;
+    victim->last_used = ++_verify_clock;
+    victim->valid = false;
+    victim->fill_lock.lock();
+
+    fill = true;
+    return victim;
+}
+
+/**
+ * Unpins a cache slot.  A slot whose chunk did not match is emptied, so that the
+ * chunk is read and checked again next time.
+ * @param slot The slot to unpin.
+ */
+void TarFS::unpin_chunk(TarFSVerifySlot *slot)
+{
+    UniqueLock<Mutex> l(_verify_lock);
+
+    if (!slot->valid) {
+        slot->chunk = _nr_chunks;
+    }
+
+    slot->pins--;
+}
+
+/**
+ * Allocates a metadata record from the current chunk of the entry table,
+ * starting a new chunk when the current one is full.  Records never move once
+ * allocated, so nodes can refer to them directly.
+ * @return Returns a new, zeroed metadata record.
+ */
+TarFSEntry *TarFS::new_entry()
+{
+    if (_entry_chunk_used == TARFS_ENTRY_CHUNK_SIZE) {
+        _entry_chunk = new TarFSEntry[TARFS_ENTRY_CHUNK_SIZE];
+        _entry_chunk_used = 0;
+        _entry_chunks.append(_entry_chunk);
+    }
+
+    TarFSEntry *entry = &_entry_chunk[_entry_chunk_used++];
+    memset(entry, 0, sizeof(*entry));
+
+    return entry;
+}
+
+/**
+ * Decodes a TAR header into a new metadata record.
+ * @param hdr The header to decode.
+ * @param header_block The block number that the header was read from.
+ * @return Returns the new metadata record.
+ */
+TarFSEntry *TarFS::capture_entry(const posix_header *hdr, unsigned int header_block)
+{
+    TarFSEntry *entry = new_entry();
+
+    entry->size = octal_field(hdr->size, sizeof(hdr->size));
+    entry->mode = octal_field(hdr->mode, sizeof(hdr->mode));
+    entry->uid = octal_field(hdr->uid, sizeof(hdr->uid));
+    entry->gid = octal_field(hdr->gid, sizeof(hdr->gid));
+    entry->mtime = octal_field(hdr->mtime, sizeof(hdr->mtime));
+    entry->data_block = header_block + 1;
+    entry->typeflag = hdr->typeflag;
+
+    // Old-style archives mark directories only with a trailing slash.
+    size_t name_len = strnlen(hdr->name, sizeof(hdr->name));
+    if (entry->typeflag != '5' && name_len > 0 && hdr->name[name_len - 1] == '/') {
+        entry->typeflag = '5';
+    }
+
+    return entry;
+}
+
+/**
+ * Creates a metadata record for a directory that has no header of its own, i.e.
+ * the root, or an intermediate directory that is only implied by a member's path.
+ * @param template_entry The entry that implied the directory, whose ownership and
+ * timestamp are inherited.  May be NULL.
+ * @return Returns the new metadata record.
+ */
+TarFSEntry *TarFS::directory_entry(const TarFSEntry *template_entry)
+{
+    TarFSEntry *entry = new_entry();
+
+    entry->mode = 0755;
+    entry->typeflag = '5';
+
+    if (template_entry) {
+        entry->uid = template_entry->uid;
+        entry->gid = template_entry->gid;
+        entry->mtime = template_entry->mtime;
+    }
+
+    return entry;
+}
+
+/**
+ * Allocates space for the contents of a small file from the current chunk of the
+ * inline data arena, starting a new chunk when the current one is too full.
+ * @param size The number of bytes to allocate.
+ * @return Returns the space, which never moves.
+ */
+uint8_t *TarFS::new_inline_data(unsigned int size)
+{
+    if (size > TARFS_INLINE_CHUNK_SIZE - _inline_chunk_used) {
+        _inline_chunk = new uint8_t[TARFS_INLINE_CHUNK_SIZE];
+        _inline_chunk_used = 0;
+        _inline_chunks.append(_inline_chunk);
+        _inline_arena_size += TARFS_INLINE_CHUNK_SIZE;
+    }
+
+    uint8_t *data = &_inline_chunk[_inline_chunk_used];
+    _inline_chunk_used += size;
+
+    return data;
+}
+
+/**
+ * Captures the contents of a small regular file into the inline data arena, so that
+ * it can be read without device I/O.  Anything else is left to be read from the
+ * device as usual.
+ * @param entry The metadata record of the file.
+ * @param data A buffer holding the blocks after the file's header that have already
+ * been read (with read_blocks, so verified if need be), with room for the rest of
+ * the largest file that can be inlined.
+ * @param nr_blocks_read The number of blocks already in the buffer.
+ */
+void TarFS::capture_inline_data(TarFSEntry *entry, uint8_t *data, unsigned int nr_blocks_read)
+{
+    if (entry->size == 0 || entry->size > _inline_max_size) {
+        return;
+    }
+
+    if (entry->typeflag != '0' && entry->typeflag != '\0' && entry->typeflag != '7') {
+        return;
+    }
+
+    unsigned int nr_blocks = (entry->size + BLOCKSIZE - 1) / BLOCKSIZE;
+    if (entry->data_block + nr_blocks > block_device().block_count()) {
+        return;
+    }
+
+    // Inline contents are never checked again, so every byte captured has to come
+    // through a verified read: the blocks already in the buffer did, and so does the
+    // rest.  A file that fails is left on the device, where reading it fails too.
+    if (nr_blocks > nr_blocks_read && !read_blocks(data + nr_blocks_read * BLOCKSIZE, entry->data_block + nr_blocks_read, nr_blocks - nr_blocks_read)) {
+        return;
+    }
+
+    uint8_t *inline_data = new_inline_data(entry->size);
+    memcpy(inline_data, data, entry->size);
+
+    entry->inline_data = inline_data;
+    _nr_inline_files++;
+}
+
+/**
+ * Returns TRUE if the given archive member name is a whiteout, which hides an entry
+ * of the lower layers in a union mount rather than being an entry itself.
+ */
+static inline bool is_whiteout(const String& name)
+{
+    return strncmp(name.c_str(), TARFS_WHITEOUT_PREFIX, sizeof(TARFS_WHITEOUT_PREFIX) - 1) == 0;
+}
+
+/**
+ * Adds a layer on top of the layers already in this union.  Layers must be added
+ * from the bottom up, before the union is mounted.
+ * @param layer The layer to add.
+ * @return Returns TRUE if the layer was added, or FALSE if the union is already
+ * mounted, has no room for another layer, or the layer is already in a union.
+ */
+bool TarFSUnion::add_layer(TarFS& layer)
+{
+    if (_root_node || _nr_layers == TARFS_MAX_LAYERS || layer._in_union) {
+        return false;
+    }
+
+    layer._in_union = true;
+    _layers[_nr_layers++] = &layer;
+    return true;
+}
+
+/**
+ * Mounts the union, by mounting each layer and merging their trees from the bottom
+ * up into a single tree, and then indexing every path in it.
+ * @return Returns the root node of the merged tree, or NULL if there are no layers.
+ */
+PFSNode *TarFSUnion::mount()
+{
+    if (_root_node || _nr_layers == 0) {
+        return _root_node;
+    }
+
+    TarFS& bottom = *_layers[0];
+    TarFSNode *bottom_root = (TarFSNode *) bottom.mount();
+
+    _root_node = new TarFSNode(NULL, "", bottom);
+    _root_node->set_entry(bottom_root->stat());
+    merge_directory(_root_node, bottom_root, bottom);
+
+    for (unsigned int i = 1; i < _nr_layers; i++) {
+        TarFSNode *layer_root = (TarFSNode *) _layers[i]->mount();
+
+        _root_node->set_entry(layer_root->stat());
+        merge_directory(_root_node, layer_root, *_layers[i]);
+    }
+
+    char *path = new char[TARFS_MAX_INDEXED_PATH];
+    path[0] = 0;
+
+    _paths.add(String(path).get_hash(), _root_node);
+    _nr_nodes = 1;
+    index_paths(_root_node, path, 0);
+
+    delete[] path;
+    return _root_node;
+}
+
+/**
+ * Merges one layer's directory into the directory of the merged tree at the same
+ * path, which holds what the layers below put there.  Whiteouts are applied first,
+ * so that they only ever hide entries of the lower layers.
+ * @param merged The directory of the merged tree.
+ * @param upper The layer's directory.
+ * @param layer The layer that the directory belongs to.
+ */
+void TarFSUnion::merge_directory(TarFSNode *merged, TarFSNode *upper, TarFS& layer)
+{
+    // An opaque directory hides everything the layers below put in it.
+    if (upper->find_child(TARFS_WHITEOUT_OPAQUE)) {
+        unsigned int nr_children = merged->children().count(), i = 0;
+        TarFSNode **children = new TarFSNode *[nr_children];
+
+        for (const auto& child : merged->children()) {
+            children[i++] = child.value;
+        }
+
+        for (i = 0; i < nr_children; i++) {
+            merged->remove_child(children[i]->name());
+            delete_tree(children[i]);
+        }
+
+        delete[] children;
+    }
+
+    for (const auto& child : upper->children()) {
+        const String& name = child.value->name();
+        if (!is_whiteout(name) || name == TARFS_WHITEOUT_OPAQUE) {
+            continue;
+        }
+
+        TarFSNode *hidden = merged->remove_child(name.c_str() + sizeof(TARFS_WHITEOUT_PREFIX) - 1);
+        if (hidden) {
+            delete_tree(hidden);
+        }
+    }
+
+    for (const auto& child : upper->children()) {
+        const String& name = child.value->name();
+        if (is_whiteout(name)) {
+            continue;
+        }
+
+        // A directory that is in both layers has its contents merged, and takes the
+        // upper layer's metadata.  Anything else in the upper layer replaces what is
+        // below it outright.
+        TarFSNode *lower = merged->find_child(name);
+        if (lower && lower->is_directory() && child.value->is_directory()) {
+            lower->set_entry(child.value->stat());
+            merge_directory(lower, child.value, layer);
+            continue;
+        }
+
+        if (lower) {
+            merged->remove_child(name);
+            delete_tree(lower);
+        }
+
+        merged->add_child(name, copy_tree(merged, child.value, layer));
+    }
+}
+
+/**
+ * Copies a layer's node, and everything below it, into the merged tree.  The copies
+ * share the layer's metadata records, and belong to the layer, so that their files
+ * are read from the layer's device.
+ * @param parent The node of the merged tree that the copy goes under.
+ * @param node The layer's node.
+ * @param layer The layer that the node belongs to.
+ * @return Returns the copy.
+ */
+TarFSNode *TarFSUnion::copy_tree(TarFSNode *parent, TarFSNode *node, TarFS& layer)
 {
-	if (off >= this->size()) return 0;
-	// If
-	if (off + size > this->size()){
-	    size = this->size() - off;
-	}
-    int block_size = _owner.block_device().block_size();
-
-    int block_number = size/block_size;
-    block_number = size % block_size ? block_number++:block_number;
-	char* content = new char[block_number * block_size];
-	int start_block = off/block_size;
-    _owner.block_device().read_blocks(content, _file_start_block+start_block, block_number);
-//    char* content_copy = new char[size];
-//    content_copy = content + off % block_size;
-//    //
-//    buffer = content_copy;
-    while(size>0){
-        *buffer++ = *(content++ +off%block_size);
-        size--;
+    TarFSNode *copy = new TarFSNode(parent, node->name(), layer);
+    copy->set_entry(node->stat());
+
+    if (node->is_symlink()) {
+        copy->set_link_target(*node->link_target());
     }
 
-	// buffer is a pointer to the buffer that should receive the data.
-	// size is the amount of data to read from the file.
-	// off is the zero-based offset within the file to start reading from.
-    // reads count blocks into buffer, starting from block offset.
-	
-	return size;
-}
+    for (const auto& child : node->children()) {
+        // Nothing below a directory that is new in this layer can be hidden, so its
+        // whiteouts are dropped.
+        if (is_whiteout(child.value->name())) {
+            continue;
+        }
+
+        copy->add_child(child.value->name(), copy_tree(copy, child.value, layer));
+    }
 
+    return copy;
+}
 
 /**
- * Reads all the file headers in the TAR file, and builds an in-memory
- * representation.
- * @return Returns the root TarFSNode that corresponds to the TAR file structure.
+ * Adds the children of a node of the merged tree, and everything below them, to the
+ * path index.  Where two paths have the same hash, only the first is indexed, and
+ * the other is found by walking the tree.
+ * @param node The node whose children to index.
+ * @param path A buffer holding the node's path from the root, without a leading
+ * slash, with room for TARFS_MAX_INDEXED_PATH bytes.
+ * @param length The length of the node's path.
  */
-//TarFSNode* TarFS::build_tree()
-//{
-//    // Create the root node.
-//    TarFSNode *root = new TarFSNode(NULL, "", *this);
-//
-//    // TO BE FILLED IN
-//    int file_number;
-//    int block_number = block_device().block_count();
-//    struct posix_header *file_hdr = (struct posix_header *) new char [_owner.block_device().block_size()];
-//    String directory = container[0:100];
-//    // entity/TarFSNode = root
-//    while (True){
-//    }
-//}
-//    for(int i = 0; i < file_number; i++){
-//        //let *file_hdr point to the current file
-//        //file_hdr->name split into String[]
-//        //if(entity.children.names ! contain String[j]){
-//        //  for(int j = 0; j < len(String[])-1; j++){
-//        //      create an file entity which is a TarFSNode names String[j]
-//        //      entity.parent = entity
-//        //      initialise entity = the struct which has name String[path/j]
-//        //  }
-//        //}else{
-//
-//    //}
-//    //entity.child = TarFSNode(*file_hdr)
-//    //
-//
-//    // You must read the TAR file, and build a tree of TarFSNodes that represents each file present in the archive.
-//
-//    return root;
-//}
-
-TarFSNode* TarFS::build_tree()
+void TarFSUnion::index_paths(TarFSNode *node, char *path, unsigned int length)
 {
-    // Create the root node.
-    TarFSNode *root = new TarFSNode(NULL, "", *this);
+    for (const auto& child : node->children()) {
+        const String& name = child.value->name();
+        unsigned int name_length = strlen(name.c_str());
+        unsigned int child_length = length + (length ? 1 : 0) + name_length;
 
-    // Initialises the file header, file path and file name to begin analysing Tar nodes
-    posix_header *file_hdr = (posix_header *) new char[block_device().block_size()];
-    String file_path;
-    String file_name;
-    unsigned int file_size = 0;
-    size_t nr_blocks = block_device().block_count();
-    //mm_log.messagef(LogLevel::IMPORTANT, "str %d",nr_blocks);
+        _nr_nodes++;
 
-    // Loops through the headers while the offset index is less that the total blocks
-    for (unsigned int off = 0; off < nr_blocks; off+=file_size+1){
-        TarFSNode *lead = root;
-        block_device().read_blocks(file_hdr, off, 1);
+        // Paths that do not fit are left out, and are found by walking the tree.
+        if (child_length >= TARFS_MAX_INDEXED_PATH) {
+            continue;
+        }
 
-        // Check if the zero block is present in the file header which shows the archive end
-        // then break
-        if (is_zero_block((uint8_t *) file_hdr)) {
-            uint8_t *block_zero = new uint8_t[block_device().block_size()];
-            block_device().read_blocks(block_zero, off + 1, 1);
+        if (length) {
+            path[length] = '/';
+        }
 
-            // Checks if the and offset adjusted block_zero is the block with the archive end and breaks the loop if so.
-            // Deallocates the memory for this either way to avoid memory leaks
-            if (is_zero_block(block_zero)) {
-                delete(block_zero);
-                break;
-            }
-            delete(block_zero);
+        memcpy(&path[child_length - name_length], name.c_str(), name_length + 1);
+
+        String::hash_type hash = String(path).get_hash();
+        if (!_paths.contains_key(hash)) {
+            _paths.add(hash, child.value);
         }
 
-        // Split the full path into a list of parts of string and updates the file_name as the last element of the list
-        // if the path is not empty
-        file_path = String(file_hdr->name);
-        List <String> file_path_parts = file_path.split('/', true);
-        //mm_log.messagef(LogLevel::IMPORTANT, "file path %s",file_path.c_str());
+        index_paths(child.value, path, child_length);
+    }
 
-        if (!file_path_parts.empty())
-            file_name = file_path_parts.last();
-        else
-            return root;
+    path[length] = 0;
+}
 
-        // If the file path is greater than one
-        // that the file is in a lower hierarchy directory than
-        // the current one
-        if (file_path_parts.count() > 1) {
+/**
+ * Returns TRUE if a node of the merged tree is at exactly the given path, i.e. its
+ * name and the names of its ancestors, joined with slashes, make up the path.
+ * @param node The node.
+ * @param path The path, from the root, without a leading slash.
+ */
+static bool has_path(const TarFSNode *node, const char *path)
+{
+    size_t length = strlen(path);
 
-            String file_directory = file_path_parts.at(file_path_parts.count() - 2);
-            String lead_node_name = (String) lead->name();
+    for (; node->parent(); node = node->parent()) {
+        const char *name = node->name().c_str();
+        size_t name_length = strlen(name);
 
-            TarFSNode *temp_node = root;
+        if (name_length > length || memcmp(&path[length - name_length], name, name_length) != 0) {
+            return false;
+        }
 
-            // Sets the updates the lead_node and its name if the name of the file_directory and the name of the
-            // lead_node are different
-            for(unsigned int i =0; i< file_path_parts.count() - 1;i++)
-            {
-                String cur = file_path_parts.at(i);
-                if(!temp_node->get_child(cur))
-                {
-                    TarFSNode *new_node = new TarFSNode(temp_node, cur, *this);
-                    new_node->set_block_offset(off);
-                    new_node->size(0);//size 0 as this is not a file, its a folder, internal node within the tree
-                    temp_node->add_child(cur,new_node);
-                }
-                temp_node = (TarFSNode *) temp_node->get_child(cur);
+        length -= name_length;
 
+        // Every name but the first is preceded by a slash.
+        if (node->parent()->parent()) {
+            if (length == 0 || path[length - 1] != '/') {
+                return false;
             }
-            lead = temp_node;
-            lead_node_name = String(temp_node->name());
-        }
-        else if (file_path_parts.count() == 1) {
-            // Case where the file is in the same directory hierarchy as the current one
-            lead = root;
-            lead->size(octal2ui(file_hdr->size));
 
-            //mm_log.messagef(LogLevel::IMPORTANT, "lead_node_name %s, file size %d",file_path_parts.at(0).c_str(), octal2ui(file_hdr->size));
+            length--;
         }
+    }
+
+    return length == 0;
+}
+
+/**
+ * Looks up a path in the union, following symbolic links.  A path that names a node
+ * directly is found with a single probe of the path index, which is checked against
+ * the node's own path; only paths that go through a symbolic link, contain "." or
+ * "..", or share a hash with another path, walk the merged tree.
+ * @param path The path to look up, from the root of the union.
+ * @return Returns the node at the path, or NULL if there is no such node.
+ */
+TarFSNode *TarFSUnion::lookup(const String& path)
+{
+    if (!_root_node) {
+        return NULL;
+    }
+
+    const char *relative = path.c_str();
+    while (*relative == '/') relative++;
+
+    TarFSNode *node;
+    if (_paths.try_get_value(String(relative).get_hash(), node) && has_path(node, relative)) {
+        return node->resolve();
+    }
+
+    return _root_node->lookup(relative, true);
+}
 
-        // Updates the file size accounting for an extra beginning or end section
-        file_size = octal2ui(file_hdr->size);
-        unsigned int temp = file_size;
-        file_size = (file_size % BLOCKSIZE) ? (file_size/BLOCKSIZE + 1) : file_size/BLOCKSIZE;
+void TarFSTreeLock::lock_shared()
+{
+    for (;;) {
+        while (__atomic_load_n(&_writing, __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
 
-        // Builds the tree by initialising and adding the current positioned node to the lead_node as a child
-        TarFSNode *cur_node = new TarFSNode(lead, file_name, *this);
-        cur_node->set_block_offset(off);
-        cur_node->size(temp);
+        __atomic_add_fetch(&_readers, 1, __ATOMIC_SEQ_CST);
 
-        // Add the child node
-        lead->add_child(file_name, cur_node);
+        // A writer that came in between has to be let through first.
+        if (!__atomic_load_n(&_writing, __ATOMIC_SEQ_CST)) {
+            return;
+        }
 
-        // Updates the lead node when the last point in the path is reached to next directory to search for files
-        if (file_path.c_str()[file_path.length() - 1] == '/')
-            lead = cur_node;
+        __atomic_sub_fetch(&_readers, 1, __ATOMIC_RELEASE);
     }
-    //mm_log.messagef(LogLevel::IMPORTANT, "str %d",block_device().block_count());
-    return root;
 }
 
+void TarFSTreeLock::unlock_shared()
+{
+    __atomic_sub_fetch(&_readers, 1, __ATOMIC_RELEASE);
+}
+
+void TarFSTreeLock::lock()
+{
+    _writer.lock();
+    __atomic_store_n(&_writing, true, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&_readers, __ATOMIC_SEQ_CST)) {
+        asm volatile("pause");
+    }
+}
 
+void TarFSTreeLock::unlock()
+{
+    __atomic_store_n(&_writing, false, __ATOMIC_RELEASE);
+    _writer.unlock();
+}
 
 /**
  * Returns the size of this TarFS File
  */
 unsigned int TarFSFile::size() const
 {
-    return octal2ui(_hdr->size) ;
+    return _file_size;
 }
 
 /* --- YOU DO NOT NEED TO CHANGE ANYTHING BELOW THIS LINE --- */
@@ -291,28 +1297,44 @@ PFSNode *TarFS::mount()
 }
 
 /**
- * Constructs a TarFS File object, given the owning file system and the block
+ * Constructs a TarFS File object, given the owning file system and the metadata
+ * captured for the file when the archive was mounted.
  */
-TarFSFile::TarFSFile(TarFS& owner, unsigned int file_header_block)
-: _hdr(NULL),
-_owner(owner),
-_file_start_block(file_header_block),
-_cur_pos(0)
+TarFSFile::TarFSFile(TarFS& owner, unsigned int file_data_block, unsigned int file_size, const uint8_t *inline_data)
+: _owner(owner),
+_file_start_block(file_data_block),
+_file_size(file_size),
+_cur_pos(0),
+_inline_data(inline_data)
 {
-	// Allocate storage for the header.
-	_hdr = (struct posix_header *) new char[_owner.block_device().block_size()];
-	
-	// Read the header block into the header structure.
-	_owner.block_device().read_blocks(_hdr, _file_start_block, 1);
-	
-	// Increment the starting block for file data.
-	_file_start_block++;
 }
 
 TarFSFile::~TarFSFile()
 {
-	// Delete the header structure that was allocated in the constructor.
-	delete _hdr;
+}
+
+/**
+ * TarFSFile objects are allocated from their own slab cache.  Small-file-heavy
+ * workloads open and close files constantly, and the cache's per-CPU magazines
+ * keep that churn off the general heap.
+ */
+static slab::ObjectCache tarfs_file_cache("tarfs-file", sizeof(TarFSFile));
+
+void *TarFSFile::operator new(size_t size)
+{
+	assert(size == sizeof(TarFSFile));
+
+	// operator new must not return NULL, so running out of memory here is fatal.
+	void *object = tarfs_file_cache.alloc();
+	if (!object) mm_log.messagef(LogLevel::FATAL, "tarfs: out of memory allocating a file");
+	assert(object);
+
+	return object;
+}
+
+void TarFSFile::operator delete(void *ptr)
+{
+	tarfs_file_cache.free(ptr);
 }
 
 /**
@@ -342,7 +1364,9 @@ int TarFSFile::read(void* buffer, size_t size)
 	// Increment the current file position by the number of bytes that was read.
 	// The number of bytes actually read may be less than 'size', so it's important
 	// we only advance the current position by the actual number of bytes read.
-	_cur_pos += rc;
+	if (rc > 0) {
+		_cur_pos += rc;
+	}
 
 	// Return the number of bytes read.
 	return rc;
@@ -371,12 +1395,37 @@ void TarFSFile::seek(off_t offset, SeekType type)
 	}
 }
 
-TarFSNode::TarFSNode(TarFSNode *parent, const String& name, TarFS& owner) : PFSNode(parent, owner), _name(name), _size(0), _has_block_offset(false), _block_offset(0)
+TarFSNode::TarFSNode(TarFSNode *parent, const String& name, TarFS& owner) : PFSNode(parent, owner), _parent(parent), _listing(NULL), _name(name), _entry(NULL), _link_target(NULL), _resolved(NULL), _resolved_stamp(0)
 {
 }
 
 TarFSNode::~TarFSNode()
 {
+	invalidate_listing();
+	delete _link_target;
+}
+
+/**
+ * A mount creates one TarFSNode per archive member, so they come from a slab
+ * cache rather than the general heap.
+ */
+static slab::ObjectCache tarfs_node_cache("tarfs-node", sizeof(TarFSNode));
+
+void *TarFSNode::operator new(size_t size)
+{
+	assert(size == sizeof(TarFSNode));
+
+	// operator new must not return NULL, so running out of memory here is fatal.
+	void *object = tarfs_node_cache.alloc();
+	if (!object) mm_log.messagef(LogLevel::FATAL, "tarfs: out of memory allocating a node");
+	assert(object);
+
+	return object;
+}
+
+void TarFSNode::operator delete(void *ptr)
+{
+	tarfs_node_cache.free(ptr);
 }
 
 /**
@@ -385,13 +1434,13 @@ TarFSNode::~TarFSNode()
  */
 File* TarFSNode::open()
 {
-	// This is only a file if it has been associated with a block offset.
-	if (!_has_block_offset) {
+	// This is only a file if it has a metadata record, and is not a directory.
+	if (!_entry || is_directory()) {
 		return NULL;
 	}
 
-	// Create a new file object, with a header from this node's block offset.
-	return new TarFSFile((TarFS&) owner(), _block_offset);
+	// Create a new file object from the metadata captured at mount time.
+	return new TarFSFile((TarFS&) owner(), _entry->data_block, _entry->size, _entry->inline_data);
 }
 
 /**
@@ -403,12 +1452,52 @@ Directory* TarFSNode::opendir()
 	return new TarFSDirectory(*this);
 }
 
+/**
+ * Opens this node for directory operations, restricted to a window of the
+ * name-sorted listing.  This lets very large directories be streamed a page
+ * at a time.
+ * @param first The index of the first entry to return.
+ * @param count The maximum number of entries to return.
+ * @return 
+ */
+Directory* TarFSNode::opendir_page(unsigned int first, unsigned int count)
+{
+	return new TarFSDirectory(*this, first, count);
+}
+
 /**
  * Attempts to retrieve a child node of the given name.
  * @param name
  * @return 
  */
 PFSNode* TarFSNode::get_child(const String& name)
+{
+	TarFSTreeLock::Reader r(tree_lock());
+	TarFSNode *child = find_child_locked(name);
+
+	// Path lookup goes through symbolic links.
+	if (child && child->is_symlink()) {
+		return child->resolve_locked();
+	}
+
+	return child;
+}
+
+/**
+ * Retrieves the child node of the given name, without following symbolic links.
+ * @param name
+ * @return Returns the child node, or NULL if there is no such child.
+ */
+TarFSNode* TarFSNode::find_child(const String& name)
+{
+	TarFSTreeLock::Reader r(tree_lock());
+	return find_child_locked(name);
+}
+
+/**
+ * As find_child, for a caller that holds the tree lock.
+ */
+TarFSNode* TarFSNode::find_child_locked(const String& name)
 {
 	TarFSNode *child;
 
@@ -421,6 +1510,107 @@ PFSNode* TarFSNode::get_child(const String& name)
 	return child;
 }
 
+/**
+ * Looks up a path relative to this node.  Absolute paths are looked up from the
+ * root of the tree that this node is in.
+ * @param path The path to look up.
+ * @param follow Whether a symbolic link in the final path component is followed.
+ * Links in the intermediate components are always followed.
+ * @param depth The number of symbolic links already followed to get here.
+ * @return Returns the node at the path, or NULL if there is no such node.
+ */
+TarFSNode* TarFSNode::lookup(const String& path, bool follow, unsigned int depth)
+{
+	TarFSTreeLock::Reader r(tree_lock());
+	return lookup_locked(path, follow, depth);
+}
+
+/**
+ * As lookup, for a caller that holds the tree lock.
+ */
+TarFSNode* TarFSNode::lookup_locked(const String& path, bool follow, unsigned int depth)
+{
+	TarFSNode *node = this;
+
+	if (path.c_str()[0] == '/') {
+		while (node->_parent) node = node->_parent;
+	}
+
+	List<String> parts = path.split('/', true);
+	unsigned int nr_parts = parts.count(), i = 0;
+
+	for (const auto& part : parts) {
+		bool last = (++i == nr_parts);
+
+		if (part == ".") {
+			continue;
+		} else if (part == "..") {
+			if (node->_parent) node = node->_parent;
+			continue;
+		}
+
+		TarFSNode *next = node->find_child_locked(part);
+		if (next && next->is_symlink() && (follow || !last)) {
+			next = next->resolve_locked(depth);
+		}
+
+		if (!next) {
+			return NULL;
+		}
+
+		node = next;
+	}
+
+	return node;
+}
+
+/**
+ * Resolves this symbolic link to the node it ultimately refers to.  The result is
+ * remembered, whether or not the link resolves, so repeated lookups through a chain
+ * of links, or of a link that dangles or loops, cost a single step.
+ * @param depth The number of symbolic links already followed to get here.
+ * @return Returns the target node, or NULL if the link dangles or loops.
+ */
+TarFSNode* TarFSNode::resolve(unsigned int depth)
+{
+	TarFSTreeLock::Reader r(tree_lock());
+	return resolve_locked(depth);
+}
+
+/**
+ * As resolve, for a caller that holds the tree lock.
+ */
+TarFSNode* TarFSNode::resolve_locked(unsigned int depth)
+{
+	if (!is_symlink()) {
+		return this;
+	}
+
+	// A refresh may have replaced the node that the link was resolved to.
+	unsigned int stamp = ((TarFS&) owner())._generation + 1;
+	if (stamp != 0 && __atomic_load_n(&_resolved_stamp, __ATOMIC_ACQUIRE) == stamp) {
+		return __atomic_load_n(&_resolved, __ATOMIC_RELAXED);
+	}
+
+	if (depth >= TARFS_MAX_SYMLINK_DEPTH) {
+		return NULL;
+	}
+
+	// Relative targets are relative to the directory containing the link.
+	TarFSNode *base = _parent ? _parent : this;
+	TarFSNode *target = base->lookup_locked(*_link_target, true, depth + 1);
+
+	// A link reached through others may only have failed because they used up the
+	// depth limit, so only a failure with the whole limit to hand is remembered.
+	// Readers racing to fill the memo in one generation all store the same target.
+	if (target || depth == 0) {
+		__atomic_store_n(&_resolved, target, __ATOMIC_RELAXED);
+		__atomic_store_n(&_resolved_stamp, stamp, __ATOMIC_RELEASE);
+	}
+
+	return target;
+}
+
 /**
  * Creates a subdirectory in this node.  This is a read-only file-system,
  * and so this routine does not need to be implemented.
@@ -434,14 +1624,49 @@ PFSNode* TarFSNode::mkdir(const String& name)
 }
 
 /**
- * A helper routine that updates this node with the offset of the block
- * that contains the header of the file that this node represents.
- * @param offset The block offset that corresponds to this node.
+ * A helper routine that associates this node with the metadata record of the
+ * archive member that it represents.
+ * @param entry The metadata record that corresponds to this node.
+ */
+void TarFSNode::set_entry(const TarFSEntry *entry)
+{
+	_entry = entry;
+}
+
+/**
+ * Makes this node a symbolic link to the given path.
+ * @param target The path that the link refers to.
+ */
+void TarFSNode::set_link_target(const String& target)
+{
+	delete _link_target;
+	_link_target = new String(target);
+	_resolved = NULL;
+	_resolved_stamp = 0;
+}
+
+/**
+ * Returns the lock that guards the tree this node is in.
+ */
+TarFSTreeLock& TarFSNode::tree_lock()
+{
+	return ((TarFS&) owner())._tree_lock;
+}
+
+/**
+ * Returns TRUE if this node represents a symbolic link.
  */
-void TarFSNode::set_block_offset(unsigned int offset)
+bool TarFSNode::is_symlink() const
 {
-	_has_block_offset = true;
-	_block_offset = offset;
+	return _link_target != NULL;
+}
+
+/**
+ * Returns TRUE if this node represents a directory.
+ */
+bool TarFSNode::is_directory() const
+{
+	return _entry && _entry->typeflag == '5';
 }
 
 /**
@@ -453,29 +1678,169 @@ void TarFSNode::set_block_offset(unsigned int offset)
 void TarFSNode::add_child(const String& name, TarFSNode *child)
 {
 	_children.add(name.get_hash(), child);
+
+	// The cached listing no longer matches the children map.
+	invalidate_listing();
+}
+
+/**
+ * A helper routine that removes a child node from the internal children map of
+ * this node.  The child itself is not deleted.
+ * @param name The name of the child node.
+ * @return Returns the child node that was removed, or NULL if there was none.
+ */
+TarFSNode *TarFSNode::remove_child(const String& name)
+{
+	TarFSNode *child;
+	if (!_children.try_get_value(name.get_hash(), child)) {
+		return NULL;
+	}
+
+	_children.remove(name.get_hash());
+
+	// The cached listing no longer matches the children map.
+	invalidate_listing();
+
+	return child;
+}
+
+/**
+ * Sorts an array of nodes by name, in place.  This is a heapsort, so that
+ * building the listing of a huge directory needs no extra memory and has no
+ * quadratic worst case.
+ * @param nodes The array of nodes to sort.
+ * @param nr_nodes The number of nodes in the array.
+ */
+static void sort_nodes_by_name(TarFSNode **nodes, unsigned int nr_nodes)
+{
+	auto sift_down = [nodes](unsigned int root, unsigned int end) {
+		while (2 * root + 1 < end) {
+			unsigned int child = 2 * root + 1;
+			if (child + 1 < end && strcmp(nodes[child]->name().c_str(), nodes[child + 1]->name().c_str()) < 0) {
+				child++;
+			}
+
+			if (strcmp(nodes[root]->name().c_str(), nodes[child]->name().c_str()) >= 0) {
+				return;
+			}
+
+			TarFSNode *tmp = nodes[root];
+			nodes[root] = nodes[child];
+			nodes[child] = tmp;
+			root = child;
+		}
+	};
+
+	for (unsigned int i = nr_nodes / 2; i > 0; i--) {
+		sift_down(i - 1, nr_nodes);
+	}
+
+	for (unsigned int end = nr_nodes; end > 1; end--) {
+		TarFSNode *tmp = nodes[0];
+		nodes[0] = nodes[end - 1];
+		nodes[end - 1] = tmp;
+		sift_down(0, end - 1);
+	}
+}
+
+/**
+ * Returns the cached listing of this node's children, building it on first use.
+ * The caller receives a reference, and must release it with TarFSListing::put().
+ * @return Returns the (sorted) listing of this node's children.
+ */
+TarFSListing *TarFSNode::listing()
+{
+	TarFSTreeLock::Reader r(tree_lock());
+	TarFSListing *cached = __atomic_load_n(&_listing, __ATOMIC_ACQUIRE);
+
+	if (cached == NULL) {
+		unsigned int nr_entries = _children.count();
+		TarFSNode **nodes = new TarFSNode *[nr_entries];
+
+		unsigned int i = 0;
+		for (const auto& child : _children) {
+			nodes[i++] = child.value;
+		}
+
+		sort_nodes_by_name(nodes, nr_entries);
+
+		TarFSListing *listing = new TarFSListing(nr_entries);
+		for (i = 0; i < nr_entries; i++) {
+			listing->_entries[i].name = nodes[i]->name();
+			listing->_entries[i].size = nodes[i]->size();
+		}
+
+		delete[] nodes;
+
+		// Another lookup may have built the listing at the same time.
+		if (__atomic_compare_exchange_n(&_listing, &cached, listing, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			cached = listing;
+		} else {
+			listing->put();
+		}
+	}
+
+	cached->get();
+	return cached;
+}
+
+/**
+ * Drops this node's cached listing, so that it is rebuilt on the next opendir.
+ * Directories that are still open on the old listing keep it alive.
+ */
+void TarFSNode::invalidate_listing()
+{
+	if (_listing) {
+		_listing->put();
+		_listing = NULL;
+	}
 }
 
-TarFSDirectory::TarFSDirectory(TarFSNode& node) : _entries(NULL), _nr_entries(0), _cur_entry(0)
+TarFSListing::TarFSListing(unsigned int nr_entries) : _entries(NULL), _nr_entries(nr_entries), _refs(1)
 {
-	_nr_entries = node.children().count();
 	_entries = new DirectoryEntry[_nr_entries];
+}
+
+TarFSListing::~TarFSListing()
+{
+	delete[] _entries;
+}
+
+void TarFSListing::get()
+{
+	__atomic_add_fetch(&_refs, 1, __ATOMIC_RELAXED);
+}
 
-	int i = 0;
-	for (const auto& child : node.children()) {
-		_entries[i].name = child.value->name();
-		_entries[i++].size = child.value->size();
+void TarFSListing::put()
+{
+	if (__atomic_sub_fetch(&_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		delete this;
 	}
 }
 
+TarFSDirectory::TarFSDirectory(TarFSNode& node) : _listing(node.listing()), _cur_entry(0), _end_entry(0)
+{
+	_end_entry = _listing->count();
+}
+
+TarFSDirectory::TarFSDirectory(TarFSNode& node, unsigned int first, unsigned int count) : _listing(node.listing()), _cur_entry(0), _end_entry(0)
+{
+	unsigned int nr_entries = _listing->count();
+
+	// Clamp the requested window to the listing.
+	_cur_entry = first < nr_entries ? first : nr_entries;
+	_end_entry = count < nr_entries - _cur_entry ? _cur_entry + count : nr_entries;
+}
+
 TarFSDirectory::~TarFSDirectory()
 {
-	delete _entries;
+	_listing->put();
 }
 
 bool TarFSDirectory::read_entry(infos::fs::DirectoryEntry& entry)
 {
-	if (_cur_entry < _nr_entries) {
-		entry = _entries[_cur_entry++];
+	if (_cur_entry < _end_entry) {
+		entry = _listing->at(_cur_entry++);
 		return true;
 	} else {
 		return false;
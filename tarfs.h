@@ -16,29 +16,174 @@
 
 #include <infos/drivers/block/block-device.h>
 
+#include <infos/locking/mutex.h>
+
 #include <infos/util/string.h>
 #include <infos/util/map.h>
 #include <infos/util/list.h>
 
 #define BLOCKSIZE 512
 
+// The maximum number of symbolic links followed while resolving one path.
+#define TARFS_MAX_SYMLINK_DEPTH 8
+
+// The maximum number of layers in a union mount.
+#define TARFS_MAX_LAYERS 32
+
+// In a union mount, a member named with this prefix hides the lower layers' entry
+// of the same name without it, and a member with the opaque name hides everything
+// the lower layers put in its directory.
+#define TARFS_WHITEOUT_PREFIX ".wh."
+#define TARFS_WHITEOUT_OPAQUE ".wh..wh..opq"
+
+// The longest path from the root of a union mount that is kept in its path index.
+// Deeper nodes are still found, by walking the merged tree.
+#define TARFS_MAX_INDEXED_PATH 1024
+
 namespace tarfs {
 
     class TarFSNode;
     class TarFSFile;
+    class TarFSListing;
+    class TarFSUnion;
 
     struct posix_header;
 
+    /**
+     * The decoded metadata of one archive entry, captured once while the archive is
+     * scanned at mount time.  Records are fixed-size and are handed out from
+     * contiguous chunks owned by the TarFS, so answering a stat-like query is a
+     * plain memory lookup rather than a header read and octal parse.  A small file
+     * also has its contents captured, in an arena owned by the TarFS.
+     */
+    struct TarFSEntry {
+        uint32_t size;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        uint64_t mtime;
+        uint32_t data_block;
+        char typeflag;
+        uint8_t reserved[3];
+        const uint8_t *inline_data;
+    };
+
+    /**
+     * A member found by a refresh, waiting to be added to the tree.
+     */
+    struct TarFSMember {
+        infos::util::String path;
+        infos::util::String link_name;
+        TarFSEntry *entry;
+    };
+
+#define TARFS_ENTRY_CHUNK_SIZE 1024
+
+// Regular files of at most this many bytes have their contents read into memory at
+// mount time, so that reading them needs no device I/O.  Zero disables inlining.
+#define TARFS_INLINE_MAX_SIZE 512
+
+// The size of each chunk of the arena that inline file contents are kept in.
+#define TARFS_INLINE_CHUNK_SIZE 16384
+
+// The size of a SHA-256 digest, as stored in a verification manifest.
+#define TARFS_DIGEST_SIZE 32
+
+// The memory kept for the contents of verified chunks, so that reading them again
+// needs neither device I/O nor another hash, and the number of slots each chunk can
+// be cached in.  A manifest whose chunks are too large to fill one set of slots is
+// refused.
+#define TARFS_VERIFY_CACHE_BYTES (8 << 20)
+#define TARFS_VERIFY_CACHE_WAYS 8
+
+    /**
+     * One slot of the verified chunk cache.  A reader that misses claims a slot, and
+     * holds its fill lock while it reads and hashes the chunk into it, so readers of
+     * the same chunk wait for it rather than doing the work again.  A slot is pinned
+     * while anyone copies out of it, and only unpinned slots are reused.  Everything
+     * but the contents is protected by the TarFS's verification lock.
+     */
+    struct TarFSVerifySlot {
+        unsigned int chunk;
+        unsigned int pins;
+        uint64_t last_used;
+        bool valid;
+        uint8_t *data;
+        infos::locking::Mutex fill_lock;
+    };
+
+    /**
+     * A lock that lets any number of lookups walk a TarFS tree at once, and keeps them
+     * out while a refresh changes the tree.  Lookups hold it briefly and never sleep
+     * while they do, so they spin rather than block.
+     */
+    class TarFSTreeLock {
+    public:
+        TarFSTreeLock() : _readers(0), _writing(false) {
+        }
+
+        void lock_shared();
+        void unlock_shared();
+
+        void lock();
+        void unlock();
+
+        class Reader {
+        public:
+            Reader(TarFSTreeLock& lock) : _lock(lock) {
+                _lock.lock_shared();
+            }
+
+            ~Reader() {
+                _lock.unlock_shared();
+            }
+
+        private:
+            TarFSTreeLock& _lock;
+        };
+
+    private:
+        unsigned int _readers;
+        bool _writing;
+        infos::locking::Mutex _writer;
+    };
+
     class TarFS : public infos::fs::BlockBasedFilesystem {
         friend class TarFSNode;
         friend class TarFSFile;
+        friend class TarFSUnion;
 
     public:
 
-        TarFS(infos::drivers::block::BlockDevice& bdev) : BlockBasedFilesystem(bdev), _root_node(NULL) {
+        TarFS(infos::drivers::block::BlockDevice& bdev) : BlockBasedFilesystem(bdev), _root_node(NULL), _entry_chunk(NULL), _entry_chunk_used(TARFS_ENTRY_CHUNK_SIZE),
+            _inline_chunk(NULL), _inline_chunk_used(TARFS_INLINE_CHUNK_SIZE), _inline_max_size(TARFS_INLINE_MAX_SIZE), _nr_inline_files(0), _inline_arena_size(0),
+            _scan_end(0), _generation(0), _in_union(false), _manifest(NULL), _nr_chunks(0), _blocks_per_chunk(0), _verify_cache(NULL), _verify_slots(NULL),
+            _nr_verify_sets(0), _verify_clock(0) {
         }
 
+        virtual ~TarFS();
+
         infos::fs::PFSNode *mount() override;
+        int refresh();
+
+        bool enable_verification(const uint8_t *manifest, unsigned int nr_chunks, unsigned int blocks_per_chunk);
+        bool set_inline_max_size(unsigned int max_size);
+
+        /**
+         * Returns the number of files whose contents were captured at mount time, and
+         * the memory taken by the arena that holds them, in bytes.
+         */
+        unsigned int nr_inline_files() const {
+            return _nr_inline_files;
+        }
+
+        uint64_t inline_arena_size() const {
+            return _inline_arena_size;
+        }
+
+        bool verifying() const {
+            return _manifest != NULL;
+        }
 
         const infos::util::String name() const {
             return "tarfs";
@@ -46,6 +191,22 @@ namespace tarfs {
 
     private:
         TarFSNode *build_tree();
+        unsigned int scan_members(TarFSNode *root, unsigned int first_block, infos::util::List<TarFSMember> *pending = NULL);
+        void add_member(TarFSNode *root, const infos::util::String& file_path, TarFSEntry *entry, const char *link_name);
+        void splice_child(TarFSNode *parent, const infos::util::String& name, TarFSNode *node);
+
+        TarFSEntry *new_entry();
+        TarFSEntry *capture_entry(const posix_header *hdr, unsigned int header_block);
+        TarFSEntry *directory_entry(const TarFSEntry *template_entry);
+
+        uint8_t *new_inline_data(unsigned int size);
+        void capture_inline_data(TarFSEntry *entry, uint8_t *data, unsigned int nr_blocks_read);
+
+        bool read_blocks(void *buffer, unsigned int first_block, unsigned int nr_blocks);
+        bool read_verified(uint8_t *out, unsigned int chunk, unsigned int skip, unsigned int count);
+        bool read_chunk(unsigned int chunk, uint8_t *data);
+        TarFSVerifySlot *pin_chunk(unsigned int chunk, bool& fill);
+        void unpin_chunk(TarFSVerifySlot *slot);
 
         static bool is_zero_block(const uint8_t *buffer, size_t size = 512) {
             for (unsigned int i = 0; i < size; i++) {
@@ -56,14 +217,55 @@ namespace tarfs {
         }
 
         TarFSNode *_root_node;
+
+        // Every chunk of metadata records, so that they can be freed with the TarFS.
+        infos::util::List<TarFSEntry *> _entry_chunks;
+        TarFSEntry *_entry_chunk;
+        unsigned int _entry_chunk_used;
+
+        // The arena that the contents of small files are captured into.
+        infos::util::List<uint8_t *> _inline_chunks;
+        uint8_t *_inline_chunk;
+        unsigned int _inline_chunk_used;
+        unsigned int _inline_max_size, _nr_inline_files;
+        uint64_t _inline_arena_size;
+
+        // The block where the archive ended when it was last scanned, and a count of
+        // the refreshes that changed the tree, which outdates resolved symbolic links.
+        unsigned int _scan_end;
+        unsigned int _generation;
+
+        // Lookups share the tree, and a refresh has it to itself.  Nodes replaced by a
+        // refresh are kept here until the TarFS goes, as lookups may still hold them.
+        TarFSTreeLock _tree_lock;
+        infos::util::List<TarFSNode *> _retired;
+        infos::locking::Mutex _refresh_lock;
+
+        // Whether this TarFS is a layer of a union mount, which cannot be refreshed.
+        bool _in_union;
+
+        // Integrity verification state: the trusted digest of each chunk of the
+        // device, and a set-associative cache of the contents of chunks that have been
+        // checked, with _nr_chunks marking an empty slot.  The lock only covers the
+        // slots' bookkeeping, never device I/O or hashing.
+        uint8_t *_manifest;
+        unsigned int _nr_chunks, _blocks_per_chunk;
+        uint8_t *_verify_cache;
+        TarFSVerifySlot *_verify_slots;
+        unsigned int _nr_verify_sets;
+        uint64_t _verify_clock;
+        infos::locking::Mutex _verify_lock;
     };
 
     class TarFSFile : public infos::fs::File {
     public:
 
-        TarFSFile(TarFS& owner, unsigned int file_header_block);
+        TarFSFile(TarFS& owner, unsigned int file_data_block, unsigned int file_size, const uint8_t *inline_data = NULL);
         virtual ~TarFSFile();
 
+        static void *operator new(size_t size);
+        static void operator delete(void *ptr);
+
         void close() override;
 
         int read(void* buffer, size_t size) override;
@@ -79,42 +281,92 @@ namespace tarfs {
         unsigned int size() const;
 
     private:
-        struct posix_header *_hdr;
-
         TarFS& _owner;
-        unsigned int _file_start_block, _cur_pos;
+        unsigned int _file_start_block, _file_size, _cur_pos;
+        const uint8_t *_inline_data;
+    };
+
+    /**
+     * An immutable, name-sorted snapshot of a directory's children.  It is built once
+     * and shared by every TarFSDirectory opened on the node, so repeated listings do
+     * not allocate or copy names.  The listing is reference counted, so a directory
+     * that is still open keeps it alive if the node drops it.
+     */
+    class TarFSListing {
+    public:
+        TarFSListing(unsigned int nr_entries);
+
+        void get();
+        void put();
+
+        const infos::fs::DirectoryEntry& at(unsigned int index) const {
+            return _entries[index];
+        }
+
+        unsigned int count() const {
+            return _nr_entries;
+        }
+
+    private:
+        ~TarFSListing();
+
+        friend class TarFSNode;
+
+        infos::fs::DirectoryEntry *_entries;
+        unsigned int _nr_entries;
+        unsigned int _refs;
     };
 
     class TarFSDirectory : public infos::fs::Directory {
     public:
         TarFSDirectory(TarFSNode& node);
+        TarFSDirectory(TarFSNode& node, unsigned int first, unsigned int count);
         virtual ~TarFSDirectory();
 
         bool read_entry(infos::fs::DirectoryEntry& entry) override;
         void close() override;
 
     private:
-        infos::fs::DirectoryEntry *_entries;
-        unsigned int _nr_entries, _cur_entry;
+        TarFSListing *_listing;
+        unsigned int _cur_entry, _end_entry;
     };
 
     class TarFSNode : public infos::fs::PFSNode {
+        friend class TarFSUnion;
+
     public:
         typedef infos::util::Map<infos::util::String::hash_type, TarFSNode *> TarFSNodeMap;
 
         TarFSNode(TarFSNode *parent, const infos::util::String& name, TarFS& owner);
         virtual ~TarFSNode();
 
+        static void *operator new(size_t size);
+        static void operator delete(void *ptr);
+
         infos::fs::File* open() override;
         infos::fs::Directory* opendir() override;
+        infos::fs::Directory* opendir_page(unsigned int first, unsigned int count);
 
         PFSNode* get_child(const infos::util::String& name) override;
 
+        TarFSNode *find_child(const infos::util::String& name);
+        TarFSNode *lookup(const infos::util::String& path, bool follow, unsigned int depth = 0);
+        TarFSNode *resolve(unsigned int depth = 0);
+
+        TarFSNode *find_child_locked(const infos::util::String& name);
+        TarFSNode *lookup_locked(const infos::util::String& path, bool follow, unsigned int depth = 0);
+        TarFSNode *resolve_locked(unsigned int depth = 0);
+
         PFSNode* mkdir(const infos::util::String& name) override;
 
-        void set_block_offset(unsigned int offset);
+        void set_entry(const TarFSEntry *entry);
+        void set_link_target(const infos::util::String& target);
 
         void add_child(const infos::util::String& name, TarFSNode *child);
+        TarFSNode *remove_child(const infos::util::String& name);
+
+        TarFSListing *listing();
+        void invalidate_listing();
 
         const TarFSNodeMap& children() const {
             return _children;
@@ -124,20 +376,98 @@ namespace tarfs {
             return _name;
         }
 
+        TarFSNode *parent() const {
+            return _parent;
+        }
+
+        /**
+         * Returns the metadata record for this node, or NULL if the node has none.
+         */
+        const TarFSEntry *stat() const {
+            return _entry;
+        }
+
         unsigned int size() const {
-            return _size;
+            return _entry ? _entry->size : 0;
         }
 
-        void size(unsigned int size) {
-            _size = size;
+        bool is_directory() const;
+        bool is_symlink() const;
+
+        /**
+         * Returns the target path of this symbolic link, or NULL if it is not one.
+         */
+        const infos::util::String *link_target() const {
+            return _link_target;
         }
 
     private:
+        TarFSTreeLock& tree_lock();
+
+        TarFSNode *_parent;
         TarFSNodeMap _children;
+        TarFSListing *_listing;
         const infos::util::String _name;
-        unsigned int _size;
-        bool _has_block_offset;
-        unsigned int _block_offset;
+        const TarFSEntry *_entry;
+
+        // The target path of a symbolic link, the node it was last resolved to (NULL if
+        // it did not resolve), and one more than the generation of the tree that it was
+        // resolved in (zero if it has not been).  Lookups share the tree lock, so the
+        // memo is published with _resolved_stamp stored last, with release semantics.
+        infos::util::String *_link_target;
+        TarFSNode *_resolved;
+        unsigned int _resolved_stamp;
+    };
+
+    /**
+     * A read-only union of TarFS layers, stacked like the layers of a container image:
+     * where layers have the same path, the upper one wins, and whiteouts in a layer hide
+     * the entries of the layers below it.  The layers are merged into a single tree at
+     * mount time, so resolving a path never has to look at each layer in turn.  Files
+     * are still read from the device of the layer that provides them.
+     */
+    class TarFSUnion : public infos::fs::Filesystem {
+    public:
+        TarFSUnion() : _nr_layers(0), _root_node(NULL), _nr_nodes(0) {
+        }
+
+        bool add_layer(TarFS& layer);
+
+        infos::fs::PFSNode *mount() override;
+
+        TarFSNode *lookup(const infos::util::String& path);
+
+        unsigned int nr_layers() const {
+            return _nr_layers;
+        }
+
+        /**
+         * Returns the number of nodes in the merged tree.  Each is a copy of a node of
+         * one of the layers, which keep their own trees, so this is the union's cost
+         * in nodes on top of the layers'.
+         */
+        uint64_t nr_nodes() const {
+            return _nr_nodes;
+        }
+
+        const infos::util::String name() const {
+            return "tarfs-union";
+        }
+
+    private:
+        void merge_directory(TarFSNode *merged, TarFSNode *upper, TarFS& layer);
+        TarFSNode *copy_tree(TarFSNode *parent, TarFSNode *node, TarFS& layer);
+        void index_paths(TarFSNode *node, char *path, unsigned int length);
+
+        // The layers, from the bottom up.
+        TarFS *_layers[TARFS_MAX_LAYERS];
+        unsigned int _nr_layers;
+
+        TarFSNode *_root_node;
+
+        // Every node in the merged tree, by the hash of its path from the root.
+        TarFSNode::TarFSNodeMap _paths;
+        uint64_t _nr_nodes;
     };
 }
 
@@ -0,0 +1,109 @@
+/*
+ * Many threads allocating and freeing blocks of mixed orders from one buddy
+ * allocator at once, with no lock around it.  Every page is owned by at most one
+ * thread at a time, every block is aligned to its order, and once everything is
+ * freed the memory coalesces back into the blocks it started as.  The time taken
+ * is reported for 1 to 16 threads.
+ */
+#include "host.h"
+#include "../buddy.h"
+
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace infos::mm;
+using namespace buddy;
+
+static const uint64_t nr_pages = (1 << 16) + 1000;
+static const int nr_operations = 100000;
+static const int max_held = 64;
+
+static BuddyPageAllocator allocator;
+static uint8_t owners[nr_pages];
+
+static void claim(PageDescriptor *pgd, int order, uint8_t owner)
+{
+	uint64_t pfn = host_pfn(pgd);
+	CHECK(pfn % (1u << order) == 0);
+
+	for (uint64_t i = 0; i < (1u << order); i++) {
+		CHECK(__atomic_exchange_n(&owners[pfn + i], owner, __ATOMIC_RELAXED) == 0);
+	}
+}
+
+static void release(PageDescriptor *pgd, int order)
+{
+	uint64_t pfn = host_pfn(pgd);
+	for (uint64_t i = 0; i < (1u << order); i++) {
+		__atomic_store_n(&owners[pfn + i], 0, __ATOMIC_RELAXED);
+	}
+
+	allocator.free_pages(pgd, order);
+}
+
+static void run(int thread)
+{
+	std::mt19937 rng(thread + 1);
+	std::vector<std::pair<PageDescriptor *, int>> held;
+
+	for (int i = 0; i < nr_operations; i++) {
+		if (held.empty() || (held.size() < max_held && rng() % 2)) {
+			// Only single pages may be movable.
+			int order = rng() % 6;
+			unsigned int flags = order ? (rng() % 2 ? AllocFlags::RECLAIMABLE : AllocFlags::UNMOVABLE) : (rng() % 3 ? AllocFlags::MOVABLE : AllocFlags::UNMOVABLE);
+
+			PageDescriptor *pgd = allocator.alloc_pages(order, flags);
+			if (pgd) {
+				claim(pgd, order, thread + 1);
+				held.push_back({ pgd, order });
+			}
+		} else {
+			size_t k = rng() % held.size();
+			release(held[k].first, held[k].second);
+			held[k] = held.back();
+			held.pop_back();
+		}
+	}
+
+	for (auto& block : held) {
+		release(block.first, block.second);
+	}
+}
+
+int main()
+{
+	PageDescriptor *pages = host_init_memory(nr_pages, &allocator);
+	allocator.init(pages, nr_pages);
+	allocator.reserve_page(pages + 5);
+	allocator.reserve_page(pages + nr_pages - 1);
+
+	uint64_t nr_free = allocator.nr_free_pages();
+	CHECK(nr_free == nr_pages - 2);
+
+	for (int nr_threads = 1; nr_threads <= 16; nr_threads *= 2) {
+		std::vector<std::thread> threads;
+		double start = host_now();
+
+		for (int t = 0; t < nr_threads; t++) {
+			threads.emplace_back(run, t);
+		}
+
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		double elapsed = host_now() - start;
+		printf("%2d threads: %.0f ns per operation, %.2f M operations/s in all\n", nr_threads,
+			elapsed / nr_operations * 1e9, nr_threads * nr_operations / elapsed / 1e6);
+
+		CHECK(allocator.nr_free_pages() == nr_free);
+	}
+
+	// Everything has coalesced: the aligned half of memory without a reserved page
+	// comes back as a single block.
+	PageDescriptor *top = allocator.alloc_pages(15, AllocFlags::UNMOVABLE);
+	CHECK(top && host_pfn(top) == 1 << 15);
+
+	return host_finish("buddy-concurrency");
+}
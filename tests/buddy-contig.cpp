@@ -0,0 +1,134 @@
+/*
+ * Contiguous ranges from alloc_contig_range: ranges larger than the largest block,
+ * ranges within a window at an alignment, and how quickly ranges are found on a
+ * fragmented heap.
+ */
+#include "host.h"
+#include "../buddy.h"
+
+#include <random>
+#include <vector>
+
+using namespace infos::mm;
+using namespace buddy;
+
+static const uint64_t nr_pages = (1 << 17) + 333;
+
+static BuddyPageAllocator allocator;
+static uint8_t in_use[nr_pages];
+
+/**
+ * Marks the pages of a range in use, checking that none of them already was.
+ */
+static void claim(PageDescriptor *pgd, uint64_t count)
+{
+	for (uint64_t pfn = host_pfn(pgd); pfn < host_pfn(pgd) + count; pfn++) {
+		CHECK(!in_use[pfn]);
+		in_use[pfn] = 1;
+	}
+}
+
+static void unclaim(PageDescriptor *pgd, uint64_t count)
+{
+	memset(in_use + host_pfn(pgd), 0, count);
+}
+
+int main()
+{
+	PageDescriptor *pages = host_init_memory(nr_pages, &allocator);
+	allocator.init(pages, nr_pages);
+	uint64_t nr_free = allocator.nr_free_pages();
+
+	// A range larger than the largest block is taken out of the free lists: nothing
+	// else can be allocated inside it.
+	const uint64_t big_size = 100000;
+	PageDescriptor *big = allocator.alloc_contig_range(big_size, 0, nr_pages, 1);
+	CHECK(big && host_pfn(big) + big_size <= nr_pages);
+	CHECK(allocator.nr_free_pages() == nr_free - big_size);
+	claim(big, big_size);
+
+	std::vector<PageDescriptor *> rest;
+	while (PageDescriptor *pgd = allocator.alloc_pages(0, AllocFlags::ATOMIC)) {
+		claim(pgd, 1);
+		rest.push_back(pgd);
+	}
+
+	CHECK(rest.size() == nr_pages - big_size);
+	for (PageDescriptor *pgd : rest) {
+		unclaim(pgd, 1);
+		allocator.free_pages(pgd, 0);
+	}
+
+	rest.clear();
+	allocator.free_contig_range(big, big_size);
+	unclaim(big, big_size);
+	CHECK(allocator.nr_free_pages() == nr_free);
+
+	// Ranges in a window, at an alignment, until the window is full.
+	PageDescriptor *first = allocator.alloc_contig_range(777, 5000, 9000, 1024);
+	PageDescriptor *second = allocator.alloc_contig_range(777, 5000, 9000, 1024);
+	CHECK(first && host_pfn(first) % 1024 == 0 && host_pfn(first) >= 5000 && host_pfn(first) + 777 <= 9000);
+	CHECK(second && host_pfn(second) % 1024 == 0 && host_pfn(second) >= 5000 && host_pfn(second) + 777 <= 9000);
+	CHECK(first && second && first != second);
+	CHECK(allocator.alloc_contig_range(3000, 5000, 9000, 1024) == NULL);
+	CHECK(allocator.alloc_contig_range(777, 5000, 5700, 1) == NULL);
+	CHECK(allocator.alloc_contig_range(16, nr_pages, nr_pages + 100, 1) == NULL);
+	allocator.free_contig_range(first, 777);
+	allocator.free_contig_range(second, 777);
+	CHECK(allocator.nr_free_pages() == nr_free);
+
+	// Fragment the heap: take every page, and give back nine in ten at random.
+	std::vector<PageDescriptor *> kept;
+	std::mt19937 rng(7);
+	while (PageDescriptor *pgd = allocator.alloc_pages(0, AllocFlags::MOVABLE | AllocFlags::ATOMIC)) {
+		if (rng() % 10) {
+			rest.push_back(pgd);
+		} else {
+			claim(pgd, 1);
+			kept.push_back(pgd);
+		}
+	}
+
+	for (PageDescriptor *pgd : rest) {
+		allocator.free_pages(pgd, 0);
+	}
+
+	for (uint64_t size : { 4, 16, 32, 64 }) {
+		std::vector<PageDescriptor *> ranges;
+		double start = host_now();
+
+		for (int i = 0; i < 200; i++) {
+			PageDescriptor *range = allocator.alloc_contig_range(size, 0, nr_pages, 1);
+			if (!range) {
+				break;
+			}
+
+			ranges.push_back(range);
+		}
+
+		double elapsed = host_now() - start;
+		printf("fragmented, %2lu pages: %3zu ranges, %.1f us each\n", (unsigned long) size, ranges.size(),
+			ranges.empty() ? 0 : elapsed / ranges.size() * 1e6);
+
+		CHECK(!ranges.empty());
+		for (PageDescriptor *range : ranges) {
+			claim(range, size);
+		}
+
+		for (PageDescriptor *range : ranges) {
+			unclaim(range, size);
+			allocator.free_contig_range(range, size);
+		}
+	}
+
+	// Once everything is back, memory coalesces into the largest blocks again.
+	for (PageDescriptor *pgd : kept) {
+		allocator.free_pages(pgd, 0);
+	}
+
+	CHECK(allocator.nr_free_pages() == nr_free);
+	PageDescriptor *largest = allocator.alloc_pages(MAX_ORDER - 1, AllocFlags::UNMOVABLE);
+	CHECK(largest != NULL);
+
+	return host_finish("buddy-contig");
+}
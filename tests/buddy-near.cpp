@@ -0,0 +1,159 @@
+/*
+ * Locality-hinted allocation with alloc_pages_near: how often a buffer grown a page
+ * at a time stays physically contiguous, compared with alloc_pages, and that near
+ * allocations honour the flags and watermarks as alloc_pages does.
+ */
+#include "host.h"
+#include "../buddy.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace infos::mm;
+using namespace buddy;
+
+static const uint64_t nr_pages = 1 << 16;
+
+static BuddyPageAllocator allocator;
+static int nr_shrinks;
+
+static uint64_t count_shrink(uint64_t, void *)
+{
+	nr_shrinks++;
+	return 0;
+}
+
+/**
+ * Grows eight buffers a page at a time, interleaved with unrelated allocations, on a
+ * fragmented heap.
+ * @param near Whether each page is asked for next to the one before it.
+ * @return Returns the number of pages that were adjacent to the one before them.
+ */
+static uint64_t grow_buffers(bool near)
+{
+	std::mt19937 rng(5);
+
+	// Take most of memory, and give back a random 40% of it.
+	std::vector<PageDescriptor *> background;
+	for (int i = 0; i < 50000; i++) {
+		if (PageDescriptor *pgd = allocator.alloc_pages(0, AllocFlags::MOVABLE)) {
+			background.push_back(pgd);
+		}
+	}
+
+	std::shuffle(background.begin(), background.end(), rng);
+	size_t nr_given_back = background.size() * 4 / 10;
+	for (size_t i = 0; i < nr_given_back; i++) {
+		allocator.free_pages(background[i], 0);
+	}
+
+	background.erase(background.begin(), background.begin() + nr_given_back);
+
+	const int nr_buffers = 8, buffer_pages = 400;
+	std::vector<std::vector<PageDescriptor *>> buffers(nr_buffers);
+	std::vector<PageDescriptor *> noise;
+	uint64_t nr_adjacent = 0;
+
+	for (int i = 0; i < buffer_pages; i++) {
+		for (int b = 0; b < nr_buffers; b++) {
+			std::vector<PageDescriptor *>& buffer = buffers[b];
+			uint64_t hint = buffer.empty() ? b * nr_pages / nr_buffers : host_pfn(buffer.back()) + 1;
+
+			PageDescriptor *pgd = near ? allocator.alloc_pages_near(0, hint, AllocFlags::MOVABLE) : allocator.alloc_pages(0, AllocFlags::MOVABLE);
+			CHECK(pgd);
+			if (!pgd) {
+				continue;
+			}
+
+			if (!buffer.empty() && host_pfn(pgd) == hint) {
+				nr_adjacent++;
+			}
+
+			buffer.push_back(pgd);
+
+			if (rng() % 4 == 0) {
+				noise.push_back(allocator.alloc_pages(0, AllocFlags::MOVABLE));
+			}
+		}
+	}
+
+	printf("%s: %lu of %d buffer pages adjacent to the one before\n", near ? "alloc_pages_near" : "alloc_pages",
+		(unsigned long) nr_adjacent, nr_buffers * (buffer_pages - 1));
+
+	for (auto& buffer : buffers) {
+		for (PageDescriptor *pgd : buffer) {
+			allocator.free_pages(pgd, 0);
+		}
+	}
+
+	for (PageDescriptor *pgd : noise) {
+		allocator.free_pages(pgd, 0);
+	}
+
+	for (PageDescriptor *pgd : background) {
+		allocator.free_pages(pgd, 0);
+	}
+
+	return nr_adjacent;
+}
+
+int main()
+{
+	PageDescriptor *pages = host_init_memory(nr_pages, &allocator);
+	allocator.init(pages, nr_pages);
+	uint64_t nr_free = allocator.nr_free_pages();
+
+	uint64_t plain = grow_buffers(false);
+	uint64_t near = grow_buffers(true);
+	CHECK(near > plain * 4 + 100);
+	CHECK(allocator.nr_free_pages() == nr_free);
+
+	// A free page at the hint is the one handed out.
+	PageDescriptor *exact = allocator.alloc_pages_near(0, 12345, AllocFlags::MOVABLE);
+	CHECK(exact && host_pfn(exact) == 12345);
+	allocator.free_pages(exact, 0);
+
+	// A zeroed near block is cleared, whatever the page held before.
+	uint8_t *mem = (uint8_t *) infos::kernel::sys.mm().pgalloc().pgd_to_vpa(pages);
+	memset(mem, 0xcc, nr_pages * 4096);
+
+	PageDescriptor *zeroed = allocator.alloc_pages_near(2, 4096, AllocFlags::UNMOVABLE | AllocFlags::ZERO);
+	CHECK(zeroed);
+	if (zeroed) {
+		uint8_t *block = (uint8_t *) infos::kernel::sys.mm().pgalloc().pgd_to_vpa(zeroed);
+		CHECK(std::all_of(block, block + 4 * 4096, [](uint8_t byte) { return byte == 0; }));
+		allocator.free_pages(zeroed, 2);
+	}
+
+	// Near allocations stop at the min watermark, after asking the shrinkers for
+	// memory; only ATOMIC ones go below it.
+	allocator.set_watermarks(1000, 2000, 3000);
+	allocator.register_shrinker(count_shrink, NULL);
+
+	std::vector<PageDescriptor *> held;
+	uint64_t hint = 4096;
+	while (PageDescriptor *pgd = allocator.alloc_pages_near(0, hint, AllocFlags::MOVABLE)) {
+		held.push_back(pgd);
+		hint = host_pfn(pgd) + 1;
+	}
+
+	CHECK(allocator.nr_free_pages() >= 1000);
+	CHECK(nr_shrinks > 0);
+
+	uint64_t nr_atomic = 0;
+	while (PageDescriptor *pgd = allocator.alloc_pages_near(0, hint, AllocFlags::MOVABLE | AllocFlags::ATOMIC)) {
+		held.push_back(pgd);
+		nr_atomic++;
+	}
+
+	CHECK(nr_atomic > 0);
+
+	for (PageDescriptor *pgd : held) {
+		allocator.free_pages(pgd, 0);
+	}
+
+	CHECK(allocator.nr_free_pages() == nr_free);
+
+	return host_finish("buddy-near");
+}
@@ -0,0 +1,182 @@
+/*
+ * Shrinkers and watermarks: a cache that keeps every page it is handed, next to a
+ * working set that grows and shrinks, with and without the cache registered as a
+ * shrinker.
+ */
+#include "host.h"
+#include "../buddy.h"
+
+#include <cmath>
+#include <deque>
+#include <random>
+#include <vector>
+
+using namespace infos::mm;
+using namespace buddy;
+
+static const uint64_t nr_pages = 1 << 16;
+
+static BuddyPageAllocator without_shrinker, with_shrinker;
+
+/**
+ * A cache (like a file-system block cache) that keeps every page it is given until it
+ * is asked to let go of them, oldest first.
+ */
+struct PageCache {
+	BuddyPageAllocator *allocator;
+	std::deque<PageDescriptor *> pages;
+	int nr_shrinks;
+};
+
+static uint64_t shrink_cache(uint64_t target, void *arg)
+{
+	PageCache *cache = (PageCache *) arg;
+	uint64_t nr_freed = 0;
+
+	cache->nr_shrinks++;
+	while (nr_freed < target && !cache->pages.empty()) {
+		cache->allocator->free_pages(cache->pages.front(), 0);
+		cache->pages.pop_front();
+		nr_freed++;
+	}
+
+	return nr_freed;
+}
+
+/**
+ * Reads a block through the cache at every step, while the working set of other
+ * allocations wanders between 30% and 70% of memory.
+ * @param cache The cache, and the allocator the load runs on.
+ * @param nr_requests Is set to the number of working-set allocations made.
+ * @return Returns the number of working-set allocations that failed.
+ */
+static uint64_t run_load(PageCache& cache, uint64_t& nr_requests)
+{
+	struct Allocation {
+		PageDescriptor *pgd;
+		int order;
+	};
+
+	BuddyPageAllocator& allocator = *cache.allocator;
+	std::mt19937 rng(3);
+	std::vector<Allocation> held;
+	uint64_t nr_held = 0, nr_failed = 0;
+	nr_requests = 0;
+
+	for (int step = 0; step < 400000; step++) {
+		if (PageDescriptor *pgd = allocator.alloc_pages(0, AllocFlags::RECLAIMABLE)) {
+			cache.pages.push_back(pgd);
+		}
+
+		uint64_t target = nr_pages * (50 + 20 * std::sin(step / 20000.0)) / 100;
+		if (nr_held < target) {
+			Allocation a = { NULL, (int) (rng() % 4) };
+			a.pgd = allocator.alloc_pages(a.order, a.order ? AllocFlags::UNMOVABLE : AllocFlags::MOVABLE);
+
+			nr_requests++;
+			if (!a.pgd) {
+				nr_failed++;
+				continue;
+			}
+
+			held.push_back(a);
+			nr_held += 1 << a.order;
+		} else if (!held.empty()) {
+			size_t i = rng() % held.size();
+			allocator.free_pages(held[i].pgd, held[i].order);
+			nr_held -= 1 << held[i].order;
+
+			held[i] = held.back();
+			held.pop_back();
+		}
+	}
+
+	printf("shrinker %s: %lu of %lu working-set allocations failed (%.1f%%), the cache holds %zu pages\n",
+		cache.nr_shrinks ? "on" : "off", (unsigned long) nr_failed, (unsigned long) nr_requests,
+		100.0 * nr_failed / nr_requests, cache.pages.size());
+
+	for (const Allocation& a : held) {
+		allocator.free_pages(a.pgd, a.order);
+	}
+
+	return nr_failed;
+}
+
+int main()
+{
+	PageDescriptor *pages = host_init_memory(nr_pages, &without_shrinker);
+	CHECK(without_shrinker.init(pages, nr_pages));
+	uint64_t nr_free = without_shrinker.nr_free_pages();
+
+	PageCache plain = { &without_shrinker, { }, 0 };
+	uint64_t nr_plain_requests;
+	uint64_t nr_plain_failed = run_load(plain, nr_plain_requests);
+	size_t nr_plain_cached = plain.pages.size();
+
+	CHECK(without_shrinker.nr_pages_reclaimed() == 0);
+
+	for (PageDescriptor *pgd : plain.pages) {
+		without_shrinker.free_pages(pgd, 0);
+	}
+
+	CHECK(without_shrinker.nr_free_pages() == nr_free);
+
+	pages = host_init_memory(nr_pages, &with_shrinker);
+	CHECK(with_shrinker.init(pages, nr_pages));
+
+	PageCache shrinking = { &with_shrinker, { }, 0 };
+	CHECK(with_shrinker.register_shrinker(shrink_cache, &shrinking));
+
+	uint64_t nr_shrinking_requests;
+	uint64_t nr_shrinking_failed = run_load(shrinking, nr_shrinking_requests);
+
+	// The cache gave pages back under pressure, and far fewer working-set allocations
+	// failed because of it.
+	CHECK(shrinking.nr_shrinks > 0);
+	CHECK(with_shrinker.nr_reclaim_passes() > 0 && with_shrinker.nr_pages_reclaimed() > 0);
+	CHECK(shrinking.pages.size() < nr_plain_cached);
+	CHECK(nr_shrinking_failed * 10 * nr_plain_requests < nr_plain_failed * nr_shrinking_requests);
+
+	// With the cache full again, allocations through the legacy interface reclaim from
+	// it rather than fail, and stop at the min watermark; only ATOMIC ones go below.
+	while (PageDescriptor *pgd = with_shrinker.alloc_pages(0, AllocFlags::RECLAIMABLE | AllocFlags::ATOMIC)) {
+		shrinking.pages.push_back(pgd);
+	}
+
+	CHECK(with_shrinker.nr_free_pages() == 0);
+
+	std::vector<PageDescriptor *> held;
+	uint64_t nr_reclaimed = with_shrinker.nr_pages_reclaimed();
+	for (int i = 0; i < 1000; i++) {
+		PageDescriptor *pgd = with_shrinker.alloc_pages(0);
+		CHECK(pgd);
+		if (pgd) {
+			held.push_back(pgd);
+		}
+	}
+
+	CHECK(with_shrinker.nr_pages_reclaimed() > nr_reclaimed);
+
+	while (PageDescriptor *pgd = with_shrinker.alloc_pages(0)) {
+		held.push_back(pgd);
+	}
+
+	CHECK(shrinking.pages.empty());
+	CHECK(with_shrinker.nr_free_pages() > 0);
+
+	PageDescriptor *atomic = with_shrinker.alloc_pages(0, AllocFlags::UNMOVABLE | AllocFlags::ATOMIC);
+	CHECK(atomic);
+	if (atomic) {
+		with_shrinker.free_pages(atomic, 0);
+	}
+
+	for (PageDescriptor *pgd : held) {
+		with_shrinker.free_pages(pgd, 0);
+	}
+
+	with_shrinker.unregister_shrinker(shrink_cache, &shrinking);
+
+	CHECK(with_shrinker.nr_free_pages() == nr_free);
+
+	return host_finish("buddy-shrinkers");
+}
@@ -0,0 +1,200 @@
+/*
+ * The zoned buddy allocator, over memory that spans the DMA, normal and high zones:
+ * which zones each kind of request is served from, that fallbacks leave a lower zone
+ * its watermark, and how DMA requests fare under a mixed load compared with a single
+ * allocator.
+ */
+#include "host.h"
+#include "../buddy.h"
+
+#include <random>
+#include <vector>
+
+using namespace infos::mm;
+using namespace buddy;
+
+static const uint64_t nr_pages = BUDDY_ZONE_NORMAL_END_PFN + 0x4000;
+
+static ZonedBuddyAllocator zoned;
+static BuddyPageAllocator single;
+
+struct Allocation {
+	PageDescriptor *pgd;
+	int order;
+	bool dma;
+};
+
+/**
+ * Frees an allocation made by run_mixed_load.
+ */
+static void free_allocation(bool is_zoned, const Allocation& a)
+{
+	if (is_zoned) {
+		zoned.free_pages(a.pgd, a.order);
+	} else if (a.dma) {
+		single.free_contig_range(a.pgd, 1 << a.order);
+	} else {
+		single.free_pages(a.pgd, a.order);
+	}
+}
+
+/**
+ * Runs a mixed load of normal and high-capable requests that keeps memory almost full,
+ * with DMA requests for short-lived buffers, of which only the last few are kept.  The
+ * single allocator serves DMA requests with a contiguous range below the end of the
+ * DMA zone.
+ * @param is_zoned Whether the load runs on the zoned allocator or the single one.
+ * @param nr_dma_failed Is set to the number of DMA requests that failed.
+ * @return Returns the number of DMA requests made.
+ */
+static uint64_t run_mixed_load(bool is_zoned, uint64_t& nr_dma_failed)
+{
+	std::mt19937 rng(41);
+	std::vector<Allocation> held;
+	Allocation dma_buffers[64] = { };
+	uint64_t nr_held = 0, nr_dma = 0;
+	nr_dma_failed = 0;
+
+	// Long-lived allocations take the first 30% of memory.
+	while (nr_held < nr_pages * 3 / 10) {
+		PageDescriptor *pgd = is_zoned ? zoned.alloc_pages(0, AllocFlags::UNMOVABLE) : single.alloc_pages(0, AllocFlags::UNMOVABLE);
+		if (!pgd) {
+			break;
+		}
+
+		held.push_back({ pgd, 0, false });
+		nr_held++;
+	}
+
+	size_t nr_long_lived = held.size();
+	const int nr_ops = 1000000;
+
+	double start = host_now();
+	for (int op = 0; op < nr_ops; op++) {
+		unsigned int kind = rng() % 10;
+
+		if (kind == 9) {
+			Allocation& slot = dma_buffers[nr_dma % 64];
+			if (slot.pgd) {
+				free_allocation(is_zoned, slot);
+			}
+
+			slot = { NULL, (int) (rng() % 3), true };
+			slot.pgd = is_zoned ? zoned.alloc_pages(slot.order, AllocFlags::UNMOVABLE | AllocFlags::DMA)
+				: single.alloc_contig_range(1 << slot.order, 0, BUDDY_ZONE_DMA_END_PFN, 1 << slot.order);
+			if (!slot.pgd) {
+				nr_dma_failed++;
+			}
+
+			nr_dma++;
+		} else if (nr_held < nr_pages * 97 / 100 && rng() % 4 != 0) {
+			// Normal requests are of orders 0 to 2, and high-capable ones of order 0.
+			Allocation a = { NULL, kind >= 7 ? 0 : (int) (rng() % 3), false };
+			a.pgd = is_zoned ? zoned.alloc_pages(a.order, AllocFlags::UNMOVABLE | (kind >= 7 ? AllocFlags::HIGH : 0))
+				: single.alloc_pages(a.order, AllocFlags::UNMOVABLE);
+
+			if (a.pgd) {
+				held.push_back(a);
+				nr_held += 1 << a.order;
+			}
+		} else if (held.size() > nr_long_lived) {
+			size_t i = nr_long_lived + rng() % (held.size() - nr_long_lived);
+			free_allocation(is_zoned, held[i]);
+			nr_held -= 1 << held[i].order;
+
+			held[i] = held.back();
+			held.pop_back();
+		}
+	}
+
+	double elapsed = host_now() - start;
+
+	printf("%s: %lu DMA requests, %lu failed, %.0f ns/op\n", is_zoned ? "zoned" : "single", (unsigned long) nr_dma,
+		(unsigned long) nr_dma_failed, elapsed / nr_ops * 1e9);
+
+	for (const Allocation& a : held) {
+		free_allocation(is_zoned, a);
+	}
+
+	for (const Allocation& a : dma_buffers) {
+		if (a.pgd) {
+			free_allocation(is_zoned, a);
+		}
+	}
+
+	return nr_dma;
+}
+
+int main()
+{
+	PageDescriptor *pages = host_init_memory(nr_pages, &zoned);
+	CHECK(zoned.init(pages, nr_pages));
+
+	CHECK(zoned.zone_nr_pages(Zone::DMA) == BUDDY_ZONE_DMA_END_PFN);
+	CHECK(zoned.zone_nr_pages(Zone::NORMAL) == BUDDY_ZONE_NORMAL_END_PFN - BUDDY_ZONE_DMA_END_PFN);
+	CHECK(zoned.zone_nr_pages(Zone::HIGH) == nr_pages - BUDDY_ZONE_NORMAL_END_PFN);
+
+	// High-capable requests are served from the high zone, then fall back to the
+	// normal zone once it runs out, and never reach the DMA zone while the normal
+	// zone has memory.
+	std::vector<PageDescriptor *> held;
+	for (uint64_t i = 0; i < zoned.zone_nr_pages(Zone::HIGH) + 1000; i++) {
+		PageDescriptor *pgd = zoned.alloc_pages(0, AllocFlags::MOVABLE | AllocFlags::HIGH);
+		CHECK(pgd && host_pfn(pgd) >= BUDDY_ZONE_DMA_END_PFN);
+		if (pgd) {
+			held.push_back(pgd);
+		}
+	}
+
+	CHECK(!held.empty() && host_pfn(held.front()) >= BUDDY_ZONE_NORMAL_END_PFN);
+	CHECK(zoned.nr_zone_fallbacks(Zone::NORMAL) > 0);
+	CHECK(zoned.nr_zone_fallbacks(Zone::DMA) == 0);
+
+	for (PageDescriptor *pgd : held) {
+		zoned.free_pages(pgd, 0);
+	}
+
+	held.clear();
+
+	// Normal requests use up the normal zone, then take DMA pages only down to the
+	// DMA zone's watermark, and never touch the high zone.
+	while (PageDescriptor *pgd = zoned.alloc_pages(4)) {
+		CHECK(host_pfn(pgd) < BUDDY_ZONE_NORMAL_END_PFN);
+		held.push_back(pgd);
+	}
+
+	CHECK(zoned.zone_nr_free(Zone::DMA) >= BUDDY_ZONE_DMA_END_PFN / BUDDY_ZONE_RESERVE_RATIO);
+	CHECK(zoned.nr_watermark_refusals(Zone::DMA) > 0);
+	CHECK(zoned.zone_nr_free(Zone::HIGH) == zoned.zone_nr_pages(Zone::HIGH));
+
+	// A DMA request can still be served from what is left.
+	PageDescriptor *dma = zoned.alloc_pages(2, AllocFlags::UNMOVABLE | AllocFlags::DMA);
+	CHECK(dma && host_pfn(dma) + 4 <= BUDDY_ZONE_DMA_END_PFN);
+	if (dma) {
+		zoned.free_pages(dma, 2);
+	}
+
+	for (PageDescriptor *pgd : held) {
+		zoned.free_pages(pgd, 4);
+	}
+
+	CHECK(zoned.zone_nr_free(Zone::DMA) == zoned.zone_nr_pages(Zone::DMA));
+	CHECK(zoned.zone_nr_free(Zone::NORMAL) == zoned.zone_nr_pages(Zone::NORMAL));
+	CHECK(zoned.zone_nr_free(Zone::HIGH) == zoned.zone_nr_pages(Zone::HIGH));
+
+	uint64_t nr_zoned_failed, nr_single_failed;
+	uint64_t nr_zoned_dma = run_mixed_load(true, nr_zoned_failed);
+	CHECK(nr_zoned_dma > 0 && nr_zoned_failed == 0);
+	CHECK(zoned.zone_nr_free(Zone::DMA) == zoned.zone_nr_pages(Zone::DMA));
+	CHECK(zoned.zone_nr_free(Zone::NORMAL) == zoned.zone_nr_pages(Zone::NORMAL));
+	CHECK(zoned.zone_nr_free(Zone::HIGH) == zoned.zone_nr_pages(Zone::HIGH));
+
+	pages = host_init_memory(nr_pages, &single);
+	CHECK(single.init(pages, nr_pages));
+
+	uint64_t nr_single_dma = run_mixed_load(false, nr_single_failed);
+	CHECK(nr_single_failed * nr_zoned_dma > nr_zoned_failed * nr_single_dma);
+	CHECK(single.nr_free_pages() == nr_pages);
+
+	return host_finish("buddy-zones");
+}
@@ -0,0 +1,59 @@
+/*
+ * The host environment that the tests run in.
+ */
+#include "host.h"
+
+#include <chrono>
+#include <sys/mman.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/drivers/block/block-device.h>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+
+infos::kernel::Kernel infos::kernel::sys;
+ComponentLog mm_log;
+
+const infos::drivers::DeviceClass infos::drivers::block::BlockDevice::BlockDeviceClass = { NULL, "block" };
+
+static PageAllocator host_pgalloc;
+static MemoryManager host_mm;
+
+MemoryManager& Kernel::mm() { return host_mm; }
+PageAllocator& MemoryManager::pgalloc() { return host_pgalloc; }
+
+int host_nr_failures;
+
+PageDescriptor *host_init_memory(uint64_t nr_pages, PageAllocatorAlgorithm *algo)
+{
+	// The memory is aligned to the largest block, as physical memory would be.
+	const uint64_t align = 1ull << (12 + 16);
+	void *mem = mmap(NULL, nr_pages * 4096 + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	void *pgds = mmap(NULL, nr_pages * sizeof(PageDescriptor), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED || pgds == MAP_FAILED) {
+		fprintf(stderr, "host: cannot map %lu pages\n", (unsigned long) nr_pages);
+		abort();
+	}
+
+	host_pgalloc.mem = (uint8_t *) (((uintptr_t) mem + align - 1) & ~(align - 1));
+	host_pgalloc.base = (PageDescriptor *) pgds;
+	host_pgalloc.nr_pages = nr_pages;
+	host_pgalloc.algo = algo;
+
+	for (uint64_t pfn = 0; pfn < nr_pages; pfn++) {
+		host_pgalloc.base[pfn].type = PageDescriptorType::AVAILABLE;
+	}
+
+	return host_pgalloc.base;
+}
+
+uint64_t host_pfn(const PageDescriptor *pgd)
+{
+	return host_pgalloc.pgd_to_pfn(pgd);
+}
+
+double host_now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
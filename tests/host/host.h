@@ -0,0 +1,48 @@
+/*
+ * The host environment that the tests run the allocators and file-system in: a page
+ * allocator over ordinary host memory, and a way of counting failed checks.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <infos/mm/page-allocator.h>
+
+/**
+ * Creates the page descriptors for the given number of pages, all available, and the
+ * memory that they describe.  The memory is only committed as it is touched.
+ * @param nr_pages The number of pages, starting at PFN 0.
+ * @param algo The allocation algorithm that alloc_pages and free_pages go to.
+ * @return Returns the first page descriptor.
+ */
+infos::mm::PageDescriptor *host_init_memory(uint64_t nr_pages, infos::mm::PageAllocatorAlgorithm *algo);
+
+/**
+ * Returns the PFN of a page descriptor.
+ */
+uint64_t host_pfn(const infos::mm::PageDescriptor *pgd);
+
+/**
+ * Returns the time in seconds from an arbitrary start, for reporting how long a test
+ * took.
+ */
+double host_now();
+
+extern int host_nr_failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			host_nr_failures++; \
+		} \
+	} while (0)
+
+/**
+ * Prints the outcome of a test, and returns its exit status.
+ */
+static inline int host_finish(const char *name)
+{
+	printf("%s: %s\n", name, host_nr_failures ? "FAILED" : "passed");
+	return host_nr_failures ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Host stand-in for the InfOS block device interface.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <infos/util/string.h>
+
+namespace infos {
+	namespace drivers {
+		struct DeviceClass {
+			const DeviceClass *parent;
+			const char *name;
+
+			bool is(const DeviceClass& other) const { return this == &other; }
+		};
+
+		class Device {
+		public:
+			virtual ~Device() { }
+			virtual const DeviceClass& device_class() const = 0;
+		};
+
+		namespace block {
+			class BlockDevice : public Device {
+			public:
+				static const DeviceClass BlockDeviceClass;
+
+				const DeviceClass& device_class() const override { return BlockDeviceClass; }
+
+				virtual int read_blocks(void *buffer, size_t offset, size_t count) = 0;
+				virtual int write_blocks(const void *, size_t, size_t) { return -1; }
+				virtual size_t block_size() const = 0;
+				virtual size_t block_count() const = 0;
+			};
+		}
+	}
+}
@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for the InfOS block-based file-system base class.
+ */
+#pragma once
+
+#include <infos/fs/filesystem.h>
+
+namespace infos {
+	namespace fs {
+		class BlockBasedFilesystem : public Filesystem {
+		public:
+			BlockBasedFilesystem(infos::drivers::block::BlockDevice& bdev) : _bdev(bdev) { }
+
+			infos::drivers::block::BlockDevice& block_device() const { return _bdev; }
+
+		private:
+			infos::drivers::block::BlockDevice& _bdev;
+		};
+	}
+}
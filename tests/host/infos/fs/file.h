@@ -0,0 +1,23 @@
+/*
+ * Host stand-in for the InfOS file interface.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+namespace infos {
+	namespace fs {
+		class File {
+		public:
+			enum SeekType { SeekAbsolute, SeekRelative };
+
+			virtual ~File() { }
+			virtual void close() = 0;
+			virtual int read(void *buffer, size_t size) = 0;
+			virtual int pread(void *buffer, size_t size, off_t offset) = 0;
+			virtual int write(const void *buffer, size_t size) = 0;
+			virtual void seek(off_t offset, SeekType type) = 0;
+		};
+	}
+}
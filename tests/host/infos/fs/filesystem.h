@@ -0,0 +1,30 @@
+/*
+ * Host stand-in for the InfOS file-system interface.
+ */
+#pragma once
+
+#include <infos/util/string.h>
+#include <infos/drivers/block/block-device.h>
+
+namespace infos {
+	namespace fs {
+		class PFSNode;
+		class VirtualFilesystem;
+
+		class Filesystem {
+		public:
+			virtual ~Filesystem() { }
+			virtual PFSNode *mount() = 0;
+			virtual const infos::util::String name() const = 0;
+		};
+
+		typedef Filesystem *(*FilesystemFactory)(VirtualFilesystem& vfs, infos::drivers::Device *device);
+
+		struct FilesystemRegistration {
+			const char *name;
+			FilesystemFactory factory;
+		};
+
+#define RegisterFilesystem(_n, _f) infos::fs::FilesystemRegistration __fs_##_n = { #_n, _f }
+	}
+}
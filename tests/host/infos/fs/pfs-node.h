@@ -0,0 +1,31 @@
+/*
+ * Host stand-in for the InfOS physical file-system node.
+ */
+#pragma once
+
+#include <infos/fs/filesystem.h>
+
+namespace infos {
+	namespace fs {
+		class File;
+		class Directory;
+
+		class PFSNode {
+		public:
+			PFSNode(PFSNode *parent, Filesystem& owner) : _parent(parent), _owner(owner) { }
+			virtual ~PFSNode() { }
+
+			virtual File *open() = 0;
+			virtual Directory *opendir() = 0;
+			virtual PFSNode *get_child(const infos::util::String& name) = 0;
+			virtual PFSNode *mkdir(const infos::util::String& name) = 0;
+
+			Filesystem& owner() const { return _owner; }
+			PFSNode *parent() const { return _parent; }
+
+		private:
+			PFSNode *_parent;
+			Filesystem& _owner;
+		};
+	}
+}
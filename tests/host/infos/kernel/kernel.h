@@ -0,0 +1,31 @@
+/*
+ * Host stand-in for the InfOS kernel interface, as far as the tests need it.
+ */
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <sched.h>
+#include <infos/mm/mm.h>
+
+#define __packed __attribute__((packed))
+#define __aligned(x) __attribute__((aligned(x)))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+namespace infos {
+	namespace kernel {
+		class Kernel {
+		public:
+			infos::mm::MemoryManager& mm();
+		};
+
+		extern Kernel sys;
+
+		inline unsigned int current_cpu_id()
+		{
+			int cpu = sched_getcpu();
+			return cpu < 0 ? 0 : cpu;
+		}
+	}
+}
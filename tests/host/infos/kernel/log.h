@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for the InfOS kernel log.  Messages are dropped.
+ */
+#pragma once
+
+namespace infos {
+	namespace kernel {
+		namespace LogLevel {
+			enum LogLevel { DEBUG, INFO, IMPORTANT, WARNING, ERROR, FATAL };
+		}
+
+		class ComponentLog {
+		public:
+			void messagef(LogLevel::LogLevel, const char *, ...) { }
+			void message(LogLevel::LogLevel, const char *) { }
+		};
+	}
+}
+
+extern infos::kernel::ComponentLog mm_log;
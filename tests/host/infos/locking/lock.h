@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for the InfOS scoped lock.
+ */
+#pragma once
+
+namespace infos {
+	namespace locking {
+		template<typename T>
+		class UniqueLock {
+		public:
+			UniqueLock(T& lock) : _lock(lock) { _lock.lock(); }
+			~UniqueLock() { _lock.unlock(); }
+
+		private:
+			T& _lock;
+		};
+	}
+}
@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for the InfOS mutex.
+ */
+#pragma once
+
+#include <mutex>
+
+namespace infos {
+	namespace locking {
+		class Mutex {
+		public:
+			void lock() { _mutex.lock(); }
+			void unlock() { _mutex.unlock(); }
+			bool try_lock() { return _mutex.try_lock(); }
+
+		private:
+			std::mutex _mutex;
+		};
+	}
+}
@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for the InfOS spinlock.
+ */
+#pragma once
+
+#include <atomic>
+
+namespace infos {
+	namespace locking {
+		class Spinlock {
+		public:
+			void lock() { while (_flag.test_and_set(std::memory_order_acquire)); }
+			void unlock() { _flag.clear(std::memory_order_release); }
+			bool try_lock() { return !_flag.test_and_set(std::memory_order_acquire); }
+
+		private:
+			std::atomic_flag _flag = ATOMIC_FLAG_INIT;
+		};
+	}
+}
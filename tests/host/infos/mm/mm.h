@@ -0,0 +1,19 @@
+/*
+ * Host stand-in for the InfOS memory manager.
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+#include <infos/kernel/log.h>
+
+namespace infos {
+	namespace mm {
+		class ObjectAllocator;
+
+		class MemoryManager {
+		public:
+			PageAllocator& pgalloc();
+			ObjectAllocator& objalloc();
+		};
+	}
+}
@@ -0,0 +1,53 @@
+/*
+ * Host stand-in for the InfOS page allocator.  The page descriptors and the memory
+ * they describe are ordinary host allocations (see host.h), and PFN 0 is the first
+ * descriptor.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+namespace infos {
+	namespace mm {
+		namespace PageDescriptorType {
+			enum PageDescriptorType { INVALID = 0, RESERVED = 1, AVAILABLE = 2, ALLOCATED = 3 };
+		}
+
+		struct PageDescriptor {
+			PageDescriptor *next_free;
+			PageDescriptorType::PageDescriptorType type;
+			uint64_t pad;
+		};
+
+		class PageAllocatorAlgorithm {
+		public:
+			virtual ~PageAllocatorAlgorithm() { }
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *alloc_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual bool reserve_page(PageDescriptor *pgd) = 0;
+			virtual const char *name() const = 0;
+			virtual void dump_state() const = 0;
+		};
+
+		class PageAllocator {
+		public:
+			uint64_t pgd_to_pfn(const PageDescriptor *pgd) const { return pgd - base; }
+			PageDescriptor *pfn_to_pgd(uint64_t pfn) const { return base + pfn; }
+			void *pgd_to_vpa(const PageDescriptor *pgd) const { return mem + (pgd - base) * 4096; }
+			PageDescriptor *vpa_to_pgd(const void *vpa) const { return base + ((const uint8_t *) vpa - mem) / 4096; }
+
+			PageDescriptor *alloc_pages(int order) { return algo->alloc_pages(order); }
+			void free_pages(PageDescriptor *pgd, int order) { algo->free_pages(pgd, order); }
+
+			PageDescriptor *base;
+			uint8_t *mem;
+			uint64_t nr_pages;
+			PageAllocatorAlgorithm *algo;
+		};
+
+#define RegisterPageAllocator(_c) _c __pgalloc_##_c;
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * Host stand-in for the InfOS list, backed by std::list.
+ */
+#pragma once
+
+#include <stdlib.h>
+#include <list>
+
+namespace infos {
+	namespace util {
+		template<typename T>
+		class List {
+		public:
+			typedef typename std::list<T>::const_iterator Iterator;
+
+			void append(const T& value) { _list.push_back(value); }
+			void push(const T& value) { _list.push_front(value); }
+			void enqueue(const T& value) { _list.push_back(value); }
+			T pop() { T value = _list.front(); _list.pop_front(); return value; }
+			T dequeue() { return pop(); }
+			void remove(const T& value) { _list.remove(value); }
+			void clear() { _list.clear(); }
+
+			bool empty() const { return _list.empty(); }
+			unsigned int count() const { return _list.size(); }
+			T& first() { return _list.front(); }
+			T& last() { return _list.back(); }
+
+			const T& at(unsigned int index) const
+			{
+				Iterator it = _list.begin();
+				while (index--) ++it;
+				return *it;
+			}
+
+			Iterator begin() const { return _list.begin(); }
+			Iterator end() const { return _list.end(); }
+
+		private:
+			std::list<T> _list;
+		};
+	}
+}
@@ -0,0 +1,56 @@
+/*
+ * Host stand-in for the InfOS map, backed by std::map.
+ */
+#pragma once
+
+#include <map>
+
+namespace infos {
+	namespace util {
+		template<typename K, typename V>
+		class Map {
+		public:
+			struct Node {
+				K key;
+				V value;
+			};
+
+			struct Iterator {
+				typename std::map<K, V>::const_iterator it;
+				Node node;
+
+				bool operator!=(const Iterator& other) const { return it != other.it; }
+				void operator++() { ++it; }
+
+				const Node& operator*()
+				{
+					node.key = it->first;
+					node.value = it->second;
+					return node;
+				}
+			};
+
+			void add(const K& key, const V& value) { _map[key] = value; }
+			void remove(const K& key) { _map.erase(key); }
+			bool contains_key(const K& key) const { return _map.count(key); }
+			unsigned int count() const { return _map.size(); }
+
+			bool try_get_value(const K& key, V& value) const
+			{
+				auto it = _map.find(key);
+				if (it == _map.end()) {
+					return false;
+				}
+
+				value = it->second;
+				return true;
+			}
+
+			Iterator begin() const { return Iterator { _map.begin() }; }
+			Iterator end() const { return Iterator { _map.end() }; }
+
+		private:
+			std::map<K, V> _map;
+		};
+	}
+}
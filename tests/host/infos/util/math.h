@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the InfOS maths helpers.
+ */
+#pragma once
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+namespace infos {
+	namespace util {
+		template<typename T> T __min(T a, T b) { return a < b ? a : b; }
+		template<typename T> T __max(T a, T b) { return a > b ? a : b; }
+	}
+}
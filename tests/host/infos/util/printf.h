@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for the InfOS formatting routines.
+ */
+#pragma once
+
+#include <stdio.h>
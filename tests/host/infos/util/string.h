@@ -0,0 +1,91 @@
+/*
+ * Host stand-in for the InfOS string.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <infos/util/list.h>
+
+namespace infos {
+	namespace util {
+		class String {
+		public:
+			typedef uint64_t hash_type;
+
+			String() : _str(strdup("")) { }
+			String(const char *str) : _str(strdup(str)) { }
+			String(const String& other) : _str(strdup(other._str)) { }
+
+			String(const char *str, size_t length) : _str((char *) malloc(length + 1))
+			{
+				memcpy(_str, str, length);
+				_str[length] = 0;
+			}
+
+			~String() { free(_str); }
+
+			String& operator=(const String& other)
+			{
+				if (this != &other) {
+					free(_str);
+					_str = strdup(other._str);
+				}
+
+				return *this;
+			}
+
+			const char *c_str() const { return _str; }
+			size_t length() const { return strlen(_str); }
+
+			hash_type get_hash() const
+			{
+				// FNV-1a.
+				hash_type hash = 1469598103934665603ull;
+				for (const char *p = _str; *p; p++) {
+					hash = (hash ^ (uint8_t) *p) * 1099511628211ull;
+				}
+
+				return hash;
+			}
+
+			bool operator==(const String& other) const { return strcmp(_str, other._str) == 0; }
+			bool operator!=(const String& other) const { return !(*this == other); }
+
+			String operator+(const String& other) const
+			{
+				size_t a = strlen(_str), b = strlen(other._str);
+				String result(_str, a + b);
+				memcpy(result._str + a, other._str, b + 1);
+				return result;
+			}
+
+			List<String> split(char delimiter, bool remove_empty) const
+			{
+				List<String> parts;
+				const char *start = _str;
+
+				for (const char *p = _str; ; p++) {
+					if (*p == delimiter || *p == 0) {
+						if (!(remove_empty && p == start)) {
+							parts.append(String(start, p - start));
+						}
+
+						if (*p == 0) {
+							break;
+						}
+
+						start = p + 1;
+					}
+				}
+
+				return parts;
+			}
+
+		private:
+			char *_str;
+		};
+	}
+}
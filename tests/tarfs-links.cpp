@@ -0,0 +1,205 @@
+/*
+ * Hard links and symbolic links in TarFS: link chains up to the depth limit, links
+ * that dangle or loop, links through directories, and the resolution memo across a
+ * refresh and under concurrent lookups.
+ */
+#include "host.h"
+#include "../buddy.h"
+#include "../tarfs.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <infos/fs/file.h>
+
+using namespace infos::mm;
+using namespace tarfs;
+
+static buddy::BuddyPageAllocator allocator;
+
+/**
+ * An archive held in memory.
+ */
+class RamDisk : public infos::drivers::block::BlockDevice {
+public:
+	int read_blocks(void *buffer, size_t offset, size_t count) override
+	{
+		memcpy(buffer, &data[offset * 512], count * 512);
+		return count;
+	}
+
+	size_t block_size() const override { return 512; }
+	size_t block_count() const override { return data.size() / 512; }
+
+	/**
+	 * Appends a member, as "tar -r" would: over the end-of-archive blocks, if any.
+	 */
+	void add(const std::string& name, char typeflag, const std::string& contents, const std::string& link = "")
+	{
+		data.resize(_end);
+
+		uint8_t header[512] = { 0 };
+		memcpy(header, name.c_str(), name.size());
+		snprintf((char *) header + 100, 8, "%07o", 0644);
+		snprintf((char *) header + 108, 8, "%07o", 0);
+		snprintf((char *) header + 116, 8, "%07o", 0);
+		snprintf((char *) header + 124, 12, "%011lo", (unsigned long) contents.size());
+		snprintf((char *) header + 136, 12, "%011lo", 1700000000ul);
+		header[156] = typeflag;
+		memcpy(header + 157, link.c_str(), link.size());
+		memcpy(header + 257, "ustar", 6);
+
+		unsigned int checksum = 0;
+		memset(header + 148, ' ', 8);
+		for (unsigned int i = 0; i < 512; i++) {
+			checksum += header[i];
+		}
+
+		snprintf((char *) header + 148, 8, "%06o", checksum);
+
+		data.insert(data.end(), header, header + 512);
+		data.insert(data.end(), contents.begin(), contents.end());
+		data.resize((data.size() + 511) / 512 * 512);
+
+		_end = data.size();
+		data.resize(_end + 1024);
+	}
+
+	std::vector<uint8_t> data;
+
+private:
+	size_t _end = 0;
+};
+
+static std::string read_all(TarFSNode *node)
+{
+	if (!node) {
+		return "<none>";
+	}
+
+	infos::fs::File *file = node->open();
+	if (!file) {
+		return "<not a file>";
+	}
+
+	std::string contents(node->size(), 0);
+	file->read(&contents[0], contents.size());
+	delete file;
+
+	return contents;
+}
+
+int main()
+{
+	host_init_memory(1 << 15, &allocator);
+	allocator.init(infos::kernel::sys.mm().pgalloc().base, 1 << 15);
+
+	// c7 -> c6 -> ... -> c0 -> f takes TARFS_MAX_SYMLINK_DEPTH links, and c8 one too many.
+	RamDisk disk;
+	disk.add("f", '0', "data");
+	for (int i = 0; i <= TARFS_MAX_SYMLINK_DEPTH; i++) {
+		disk.add("c" + std::to_string(i), '2', "", i == 0 ? "f" : "c" + std::to_string(i - 1));
+	}
+
+	disk.add("hf", '1', "", "f");
+	disk.add("hl", '1', "", "c0");
+	disk.add("dangling", '2', "", "nowhere");
+	disk.add("loop-a", '2', "", "loop-b");
+	disk.add("loop-b", '2', "", "loop-a");
+	disk.add("dir/", '5', "");
+	disk.add("dir/x", '0', "xx");
+	disk.add("dir/up", '2', "", "../f");
+	disk.add("dir/abs", '2', "", "/c3");
+	disk.add("dl", '2', "", "dir");
+
+	TarFS fs(disk);
+	TarFSNode *root = (TarFSNode *) fs.mount();
+	CHECK(root);
+
+	// The chain that is too long is resolved first, before the links it goes through
+	// are remembered.
+	TarFSNode *f = root->find_child("f");
+	CHECK(root->lookup(("c" + std::to_string(TARFS_MAX_SYMLINK_DEPTH)).c_str(), true) == NULL);
+	CHECK(read_all(root->lookup("c7", true)) == "data");
+	CHECK(root->lookup("c7", true) == f);
+	CHECK(root->find_child("c3")->resolve() == f);
+
+	// Without following, the link itself is found.
+	TarFSNode *c7 = root->lookup("c7", false);
+	CHECK(c7 && c7->is_symlink() && *c7->link_target() == "c6");
+
+	// A resolution that only ran out of depth is not remembered as a failure.
+	TarFS fs2(disk);
+	TarFSNode *root2 = (TarFSNode *) fs2.mount();
+	TarFSNode *c4 = root2->find_child("c4");
+	CHECK(c4->resolve(TARFS_MAX_SYMLINK_DEPTH - 1) == NULL);
+	CHECK(read_all(c4->resolve()) == "data");
+
+	// A hard link shares its target's data; a hard link to a symbolic link is one too.
+	CHECK(read_all(root->lookup("hf", true)) == "data");
+	CHECK(root->find_child("hf")->stat()->data_block == f->stat()->data_block);
+	CHECK(root->find_child("hl")->is_symlink() && root->lookup("hl", true) == f);
+
+	// Links that cannot be resolved fail, and go on failing.
+	for (int i = 0; i < 2; i++) {
+		CHECK(root->lookup("dangling", true) == NULL);
+		CHECK(root->lookup("loop-a", true) == NULL);
+	}
+
+	// Relative links are relative to their directory, and links to directories are
+	// followed part way through a path.
+	CHECK(read_all(root->lookup("dir/up", true)) == "data");
+	CHECK(read_all(root->lookup("dir/abs", true)) == "data");
+	CHECK(read_all(root->lookup("dl/x", true)) == "xx");
+	CHECK(read_all(root->lookup("dl/up", true)) == "data");
+	CHECK(root->get_child("dl") == root->find_child("dir"));
+
+	// A refresh that replaces the target is seen through links resolved before it.
+	disk.add("f", '0', "new data");
+	disk.add("loop-b", '0', "no longer a loop");
+	CHECK(fs.refresh() == 2);
+	CHECK(read_all(root->lookup("c7", true)) == "new data");
+	CHECK(read_all(root->lookup("hl", true)) == "new data");
+	CHECK(read_all(root->lookup("loop-a", true)) == "no longer a loop");
+
+	// Readers that resolve the same fresh chain at once all get the same answer.
+	for (int round = 0; round < 20; round++) {
+		TarFS fs3(disk);
+		TarFSNode *root3 = (TarFSNode *) fs3.mount();
+		TarFSNode *target = root3->find_child("f");
+		std::vector<std::thread> threads;
+
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&] {
+				for (int i = TARFS_MAX_SYMLINK_DEPTH - 1; i >= 0; i--) {
+					CHECK(root3->lookup(("c" + std::to_string(i)).c_str(), true) == target);
+				}
+			});
+		}
+
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+
+	// Once the chain has been resolved, a lookup through it costs the same as a
+	// lookup of its target.
+	const int nr_lookups = 200000;
+	double start = host_now();
+	for (int i = 0; i < nr_lookups; i++) {
+		root->lookup("c7", true);
+	}
+
+	double chain = host_now() - start;
+
+	start = host_now();
+	for (int i = 0; i < nr_lookups; i++) {
+		root->lookup("f", true);
+	}
+
+	double direct = host_now() - start;
+	printf("lookup through %d links: %.0f ns, of the target: %.0f ns\n", TARFS_MAX_SYMLINK_DEPTH,
+		chain / nr_lookups * 1e9, direct / nr_lookups * 1e9);
+
+	return host_finish("tarfs-links");
+}